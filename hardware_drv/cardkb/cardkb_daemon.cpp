@@ -1,28 +1,56 @@
 // ============================================================================
 // Название:      cardkb_daemon.cpp
 // Версия:        4.0 ("Умные" зажатые модификаторы и интеллектуальный Shift)
-// Описание:      Демон для M5Stack CardKB с расширенным функционалом.
+// Описание:      Демон для M5Stack CardKB с расширенным функционалом. Заодно общий узел ввода: джойстик-мышь
+//                (evdev) и картриджи MCS (FIFO) обслуживаются в том же цикле на epoll и выводятся через одно
+//                устройство uinput.
 // ============================================================================
 
 #include <iostream>
-#include <map>
-#include <set>
+#include <fstream>
+#include <sstream>
+#include <array>
+#include <bitset>
+#include <queue>
+#include <deque>
+#include <vector>
+#include <algorithm>
 #include <functional>
 #include <cstdint>
+#include <cstdlib>
+#include <cmath>
 #include <string>
-#include <cctype>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <grp.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <termios.h>
 
+#include <linux/gpio.h>
 #include <linux/i2c-dev.h>
 #include <linux/uinput.h>
 
 // --- Константы ---
 const int KEYBOARD_I2C_ADDR = 0x5F;
 const char* UINPUT_DEVICE_PATH = "/dev/uinput";
+// Период опроса CardKB: часто сразу после нажатия, чтобы не добавлять задержку к быстрому набору, обычный в остальное время
+// и редкий после долгого простоя, чтобы не будить I2C и CPU впустую
+const uint64_t I2C_POLL_INTERVAL_US = 10000;
+const uint64_t BURST_POLL_INTERVAL_US = 2000;
+const uint64_t BURST_WINDOW_US = 1500000;
+const uint64_t IDLE_POLL_INTERVAL_US = 50000;
+const uint64_t IDLE_AFTER_US = 10000000;
+const uint64_t TAP_HOLD_US = 20000;          // Сколько держать клавишу нажатой при одиночном нажатии
+const uint64_t REPEAT_DELAY_US = 400000;     // Автоповтор по умолчанию: задержка до первого повтора
+const uint64_t REPEAT_INTERVAL_US = 40000;   // и период повторов
 
 // --- Коды клавиш с CardKB ---
 enum CardKeyCodes : uint8_t {
@@ -38,230 +66,1133 @@ enum CardKeyCodes : uint8_t {
 
 // --- Глобальные переменные состояния ---
 bool g_toggle_mode_active = false;
-std::set<int> g_toggled_keys;
+std::bitset<KEY_CNT> g_toggled_keys;
 bool g_latched_ctrl = false;
 bool g_latched_alt = false;
 bool g_latched_shift = false;
+bool g_scroll_mode = false; // Движения мыши превращаются в прокрутку
+
+// --- Счётчики опроса, выводятся по SIGUSR1 ---
+struct PollStats {
+    uint64_t started_us = 0;
+    uint64_t wakeups = 0;     // Пробуждения главного цикла
+    uint64_t i2c_reads = 0;
+    uint64_t irq_edges = 0;
+    uint64_t keys = 0;
+    uint64_t latency_sum_us = 0; // Для опроса - верхняя оценка (период опроса), для прерывания - от фронта до чтения
+    uint64_t latency_max_us = 0;
+    uint64_t pointer_reports = 0; // Отчёты мыши, прошедшие через PointerFilter
+    uint64_t filter_ns_sum = 0;
+    uint64_t filter_ns_max = 0;
+};
+PollStats g_stats;
+volatile sig_atomic_t g_dump_stats = 0;
 
 // --- Вспомогательные функции эмуляции ---
-void emit_event(int fd, int type, int code, int value) {
-    struct input_event ie;
-    memset(&ie, 0, sizeof(ie));
-    ie.type = type;
-    ie.code = code;
-    ie.value = value;
-    if (write(fd, &ie, sizeof(ie)) < 0) {}
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
-void sync_events(int fd) { emit_event(fd, EV_SYN, SYN_REPORT, 0); }
-void press_key(int fd, int key_code) { emit_event(fd, EV_KEY, key_code, 1); sync_events(fd); }
-void release_key(int fd, int key_code) { emit_event(fd, EV_KEY, key_code, 0); sync_events(fd); }
-void tap_key(int fd, int key_code) { press_key(fd, key_code); usleep(20000); release_key(fd, key_code); }
-void perform_combo(int fd, int modifier_key, int key) { press_key(fd, modifier_key); tap_key(fd, key); release_key(fd, modifier_key); }
-void toggle_led(int fd, int led_code, bool state) { emit_event(fd, EV_LED, led_code, state ? 1 : 0); sync_events(fd); }
-void handle_toggle_key(int fd, int key_code) {
-    if (g_toggled_keys.count(key_code)) {
-        release_key(fd, key_code);
-        g_toggled_keys.erase(key_code);
-    } else {
-        press_key(fd, key_code);
-        g_toggled_keys.insert(key_code);
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Взводит timerfd на абсолютный срок по CLOCK_MONOTONIC, 0 или UINT64_MAX снимают таймер
+void arm_timer(int fd, uint64_t deadline_us) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (deadline_us != UINT64_MAX) {
+        its.it_value.tv_sec = deadline_us / 1000000;
+        its.it_value.tv_nsec = (deadline_us % 1000000) * 1000;
     }
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, nullptr);
 }
 
-// --- Класс для обработки стандартных нажатий ---
-class DefaultKeyHandler {
+// --- Приёмники событий: uinput или запись в файл для проверки без железа ---
+class EventSink {
+public:
+    virtual ~EventSink() {}
+    virtual void write_events(const struct input_event* events, int count) = 0;
+};
+
+class UinputSink : public EventSink {
+private:
+    int fd;
+public:
+    explicit UinputSink(int fd) : fd(fd) {}
+    void write_events(const struct input_event* events, int count) override {
+        if (write(fd, events, count * sizeof(events[0])) < 0) {}
+    }
+};
+
+// Пишет события строками "<мкс CLOCK_MONOTONIC> <type> <code> <value>"
+class CaptureSink : public EventSink {
 private:
-    std::map<char, int> base_keys;
-    std::map<char, char> shifted_to_base;
-    std::set<int> toggle_target_keys;
+    std::ostream& out;
+public:
+    explicit CaptureSink(std::ostream& out) : out(out) {}
+    void write_events(const struct input_event* events, int count) override {
+        uint64_t now = now_us();
+        for (int i = 0; i < count; ++i)
+            out << now << ' ' << events[i].type << ' ' << events[i].code << ' ' << events[i].value << '\n';
+        out.flush();
+    }
+};
+
+// --- Пакетная запись в uinput ---
+// События копятся в буфере и уходят одним write() с одним SYN_REPORT в конце: модификатор и клавиша приходят в X одним отчётом,
+// и X просыпается один раз на действие, а не на каждое событие.
+class EventBatch {
+private:
+    static const int MAX_EVENTS = 64;
+    struct input_event events[MAX_EVENTS];
+    int count = 0;
+    int report_start = 0; // Начало текущего отчёта, т.е. первое событие после последнего SYN_REPORT
+
+    void add_raw(int type, int code, int value) {
+        memset(&events[count], 0, sizeof(events[count]));
+        events[count].type = type;
+        events[count].code = code;
+        events[count].value = value;
+        ++count;
+    }
+public:
+    void add(EventSink& sink, int type, int code, int value) {
+        // Клавиша не должна менять состояние дважды в одном отчёте, иначе нажатие и отпускание могут склеиться у получателя
+        for (int i = report_start; i < count; ++i) {
+            if (events[i].type == type && events[i].code == code) {
+                add_raw(EV_SYN, SYN_REPORT, 0);
+                report_start = count;
+                break;
+            }
+        }
+        if (count >= MAX_EVENTS - 2) flush(sink); // Оставляем место под SYN_REPORT
+        add_raw(type, code, value);
+    }
+    void flush(EventSink& sink) {
+        if (count == 0) return;
+        add_raw(EV_SYN, SYN_REPORT, 0);
+        sink.write_events(events, count);
+        count = report_start = 0;
+    }
+};
+
+// --- Планировщик событий uinput ---
+// Нажатия и отпускания не отправляются сразу с usleep() между ними, а ставятся в очередь со сроками. Очередь - min-heap по сроку,
+// единственный timerfd взводится на ближайший срок, так что опрос I2C продолжается, пока клавиша "удерживается".
+class EventScheduler {
+private:
+    struct Pending {
+        uint64_t deadline_us;
+        uint64_t seq; // При равных сроках события уходят в порядке постановки
+        int type, code, value;
+        uint64_t origin_us; // Когда появился код клавиши, из-за которого событие поставлено, 0 если неизвестно
+    };
+    struct Later {
+        bool operator()(const Pending& a, const Pending& b) const {
+            return a.deadline_us != b.deadline_us ? a.deadline_us > b.deadline_us : a.seq > b.seq;
+        }
+    };
+    std::priority_queue<Pending, std::vector<Pending>, Later> heap;
+    EventSink* sink = nullptr;
+    int fd_timer = -1;
+    uint64_t origin_us = 0;
+    uint64_t last_measured_origin_us = 0;
+    uint64_t next_seq = 0;
+    uint64_t tail_us = 0; // Срок последнего события, добавленного через append()
+    EventBatch batch;
+
+    void arm() { arm_timer(fd_timer, heap.empty() ? 0 : heap.top().deadline_us); }
 public:
-    DefaultKeyHandler() {
-        base_keys = {
-            {'a', KEY_A}, {'b', KEY_B}, {'c', KEY_C}, {'d', KEY_D}, {'e', KEY_E}, {'f', KEY_F}, {'g', KEY_G}, {'h', KEY_H},
-            {'i', KEY_I}, {'j', KEY_J}, {'k', KEY_K}, {'l', KEY_L}, {'m', KEY_M}, {'n', KEY_N}, {'o', KEY_O}, {'p', KEY_P},
-            {'q', KEY_Q}, {'r', KEY_R}, {'s', KEY_S}, {'t', KEY_T}, {'u', KEY_U}, {'v', KEY_V}, {'w', KEY_W}, {'x', KEY_X},
-            {'y', KEY_Y}, {'z', KEY_Z}, {'1', KEY_1}, {'2', KEY_2}, {'3', KEY_3}, {'4', KEY_4}, {'5', KEY_5}, {'6', KEY_6},
-            {'7', KEY_7}, {'8', KEY_8}, {'9', KEY_9}, {'0', KEY_0}, {' ', KEY_SPACE}, {'`', KEY_GRAVE}, {'=', KEY_EQUAL},
-            {'[', KEY_LEFTBRACE}, {']', KEY_RIGHTBRACE}, {'\\', KEY_BACKSLASH}, {';', KEY_SEMICOLON}, {'\'', KEY_APOSTROPHE},
-            {',', KEY_COMMA}, {'.', KEY_DOT}, {'/', KEY_SLASH}, {'-', KEY_MINUS}
-        };
-        shifted_to_base = {
-            {'!', '1'}, {'@', '2'}, {'#', '3'}, {'$', '4'}, {'%', '5'}, {'^', '6'}, {'&', '7'}, {'*', '8'}, {'(', '9'},
-            {')', '0'}, {'~', '`'}, {'+', '='}, {'{', '['}, {'}', ']'}, {'|', '\\'}, {':', ';'}, {'"', '\''},
-            {'<', ','}, {'>', '.'}, {'?', '/'}, {'_', '-'}
-        };
-        toggle_target_keys = {KEY_W, KEY_A, KEY_S, KEY_D, KEY_LEFTSHIFT, KEY_LEFTCTRL, KEY_SPACE};
-    }
-    void type(int fd_uinput, uint8_t ascii_code) {
-        if (!isprint(ascii_code)) return;
-        bool use_shift = g_latched_shift || isupper(ascii_code);
-        char base_char = tolower(ascii_code);
-
-        if (!isupper(ascii_code) && shifted_to_base.count(base_char)) {
-            use_shift = true;
-            base_char = shifted_to_base[base_char];
+    // Задержки от появления кода клавиши до записи первого её события, копятся только если включено
+    bool record_latencies = false;
+    std::vector<uint64_t> latencies_us;
+
+    bool init(EventSink* event_sink) {
+        sink = event_sink;
+        fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        return fd_timer >= 0;
+    }
+    int timer_fd() const { return fd_timer; }
+    // События, поставленные до следующего вызова, относятся к коду клавиши, появившемуся в origin
+    void set_origin(uint64_t origin) { origin_us = origin; }
+
+    // Событие на абсолютный срок, независимо от остальной очереди
+    void schedule(uint64_t deadline_us, int type, int code, int value) {
+        heap.push({deadline_us, next_seq++, type, code, value, origin_us});
+    }
+    // Событие через delay_us после предыдущего добавленного, чтобы последовательности (модификатор, клавиша, отпускание)
+    // не перемешивались между собой, даже если следующая клавиша пришла раньше, чем закончилась предыдущая
+    void append(int type, int code, int value, uint64_t delay_us = 0) {
+        tail_us = std::max(tail_us, now_us()) + delay_us;
+        schedule(tail_us, type, code, value);
+    }
+    // Событие без очереди за клавиатурой, для мыши: уходит со следующим run_due()
+    void emit_now(int type, int code, int value) { schedule(now_us(), type, code, value); }
+
+    // Отправляет одной записью все события, срок которых наступил, и взводит таймер на следующее
+    void run_due() {
+        uint64_t now = now_us();
+        while (!heap.empty() && heap.top().deadline_us <= now) {
+            const Pending& e = heap.top();
+            if (record_latencies && e.origin_us && e.origin_us != last_measured_origin_us) {
+                latencies_us.push_back(now - std::min(now, e.origin_us));
+                last_measured_origin_us = e.origin_us;
+            }
+            batch.add(*sink, e.type, e.code, e.value);
+            heap.pop();
+        }
+        batch.flush(*sink);
+        arm();
+    }
+    // Вызывается, когда timerfd готов к чтению
+    void on_timer() {
+        uint64_t expirations;
+        if (read(fd_timer, &expirations, sizeof(expirations)) < 0) {}
+        run_due();
+    }
+    size_t pending() const { return heap.size(); }
+};
+
+EventScheduler g_events;
+
+void press_key(int key_code) { g_events.append(EV_KEY, key_code, 1); }
+void release_key(int key_code) { g_events.append(EV_KEY, key_code, 0); }
+void tap_key(int key_code) { press_key(key_code); g_events.append(EV_KEY, key_code, 0, TAP_HOLD_US); }
+void perform_combo(int modifier_key, int key) { press_key(modifier_key); tap_key(key); release_key(modifier_key); }
+void toggle_led(int led_code, bool state) { g_events.append(EV_LED, led_code, state ? 1 : 0); }
+void handle_toggle_key(int key_code) {
+    if (g_toggled_keys[key_code]) release_key(key_code); else press_key(key_code);
+    g_toggled_keys.flip(key_code);
+}
+
+// --- Таблица кодов CardKB ---
+// Что делать с каждым байтом от CardKB, собирается при компиляции: каждое нажатие - один доступ к массиву.
+enum class KeyAction : uint8_t {
+    NONE,
+    TYPE,       // Символ: key_code, с Shift если shift
+    TAP,        // Одиночное нажатие key_code
+    COMBO,      // key_code с зажатым модификатором extra
+    LATCH,      // Залипание модификатора key_code со светодиодом extra
+    TOGGLE_MODE,
+    SCROLL_MODE // Движения мыши прокручивают вместо перемещения курсора
+};
+
+struct KeyEntry {
+    KeyAction action;
+    bool shift;
+    bool toggle_target; // Зажимается/отпускается нажатиями в режиме FN_TAB
+    uint16_t key_code;
+    uint16_t extra;
+};
+
+struct CharKey { char ch; uint16_t key_code; };
+constexpr CharKey BASE_KEYS[] = {
+    {'a', KEY_A}, {'b', KEY_B}, {'c', KEY_C}, {'d', KEY_D}, {'e', KEY_E}, {'f', KEY_F}, {'g', KEY_G}, {'h', KEY_H},
+    {'i', KEY_I}, {'j', KEY_J}, {'k', KEY_K}, {'l', KEY_L}, {'m', KEY_M}, {'n', KEY_N}, {'o', KEY_O}, {'p', KEY_P},
+    {'q', KEY_Q}, {'r', KEY_R}, {'s', KEY_S}, {'t', KEY_T}, {'u', KEY_U}, {'v', KEY_V}, {'w', KEY_W}, {'x', KEY_X},
+    {'y', KEY_Y}, {'z', KEY_Z}, {'1', KEY_1}, {'2', KEY_2}, {'3', KEY_3}, {'4', KEY_4}, {'5', KEY_5}, {'6', KEY_6},
+    {'7', KEY_7}, {'8', KEY_8}, {'9', KEY_9}, {'0', KEY_0}, {' ', KEY_SPACE}, {'`', KEY_GRAVE}, {'=', KEY_EQUAL},
+    {'[', KEY_LEFTBRACE}, {']', KEY_RIGHTBRACE}, {'\\', KEY_BACKSLASH}, {';', KEY_SEMICOLON}, {'\'', KEY_APOSTROPHE},
+    {',', KEY_COMMA}, {'.', KEY_DOT}, {'/', KEY_SLASH}, {'-', KEY_MINUS}
+};
+struct ShiftedChar { char shifted, base; };
+constexpr ShiftedChar SHIFTED_CHARS[] = {
+    {'!', '1'}, {'@', '2'}, {'#', '3'}, {'$', '4'}, {'%', '5'}, {'^', '6'}, {'&', '7'}, {'*', '8'}, {'(', '9'},
+    {')', '0'}, {'~', '`'}, {'+', '='}, {'{', '['}, {'}', ']'}, {'|', '\\'}, {':', ';'}, {'"', '\''},
+    {'<', ','}, {'>', '.'}, {'?', '/'}, {'_', '-'}
+};
+constexpr uint16_t TOGGLE_TARGET_KEYS[] = {KEY_W, KEY_A, KEY_S, KEY_D, KEY_SPACE};
+
+constexpr KeyEntry tap(uint16_t key_code) { return {KeyAction::TAP, false, false, key_code, 0}; }
+constexpr KeyEntry combo(uint16_t modifier, uint16_t key_code) { return {KeyAction::COMBO, false, false, key_code, modifier}; }
+constexpr KeyEntry latch(uint16_t modifier, uint16_t led_code) { return {KeyAction::LATCH, false, false, modifier, led_code}; }
+
+constexpr std::array<KeyEntry, 256> build_key_table() {
+    std::array<KeyEntry, 256> t{};
+    for (const CharKey& k : BASE_KEYS) {
+        bool toggle_target = false;
+        for (uint16_t target : TOGGLE_TARGET_KEYS) toggle_target = toggle_target || target == k.key_code;
+        t[(uint8_t)k.ch] = {KeyAction::TYPE, false, toggle_target, k.key_code, 0};
+        if (k.ch >= 'a' && k.ch <= 'z') t[(uint8_t)(k.ch - 'a' + 'A')] = {KeyAction::TYPE, true, toggle_target, k.key_code, 0};
+    }
+    for (const ShiftedChar& c : SHIFTED_CHARS) {
+        t[(uint8_t)c.shifted] = t[(uint8_t)c.base];
+        t[(uint8_t)c.shifted].shift = true;
+    }
+
+    t[ENTER] = tap(KEY_ENTER); t[BACKSPACE] = tap(KEY_BACKSPACE); t[ESC] = tap(KEY_ESC); t[TAB] = tap(KEY_TAB);
+    t[UP] = tap(KEY_UP); t[DOWN] = tap(KEY_DOWN); t[LEFT] = tap(KEY_LEFT); t[RIGHT] = tap(KEY_RIGHT);
+
+    t[FN_UP] = latch(KEY_LEFTALT, LED_CAPSL);
+    t[FN_DOWN] = latch(KEY_LEFTCTRL, LED_NUML);
+    t[FN_LEFT] = latch(KEY_LEFTSHIFT, LED_SCROLLL);
+    t[FN_TAB].action = KeyAction::TOGGLE_MODE;
+    t[FN_BACKSPACE] = tap(KEY_DELETE);
+    t[FN_1] = tap(KEY_F1); t[FN_2] = tap(KEY_F2); t[FN_3] = tap(KEY_F3); t[FN_4] = tap(KEY_F4); t[FN_5] = tap(KEY_F5);
+    t[FN_6] = tap(KEY_F6); t[FN_7] = tap(KEY_F7); t[FN_8] = tap(KEY_F8); t[FN_9] = tap(KEY_F9); t[FN_0] = tap(KEY_F10);
+    t[FN_ESC] = tap(KEY_F11);
+    t[FN_C] = combo(KEY_LEFTCTRL, KEY_C); t[FN_V] = combo(KEY_LEFTCTRL, KEY_V); t[FN_X] = combo(KEY_LEFTCTRL, KEY_X);
+    t[FN_A] = combo(KEY_LEFTCTRL, KEY_A); t[FN_S] = combo(KEY_LEFTCTRL, KEY_S); t[FN_Z] = combo(KEY_LEFTCTRL, KEY_Z);
+    return t;
+}
+constexpr std::array<KeyEntry, 256> KEY_TABLE = build_key_table();
+
+bool& latch_state(uint16_t modifier) {
+    return modifier == KEY_LEFTALT ? g_latched_alt : modifier == KEY_LEFTCTRL ? g_latched_ctrl : g_latched_shift;
+}
+
+// Символ с Shift, если он нужен и ещё не зажат залипанием
+void type_shifted(uint16_t key_code, bool shift) {
+    bool use_shift = shift && !g_latched_shift;
+    if (use_shift) press_key(KEY_LEFTSHIFT);
+    tap_key(key_code);
+    if (use_shift) release_key(KEY_LEFTSHIFT);
+}
+
+void run_key_action(const KeyEntry& k) {
+    switch (k.action) {
+        case KeyAction::NONE: break;
+        case KeyAction::TYPE:
+            if (g_toggle_mode_active && k.toggle_target) handle_toggle_key(k.key_code);
+            else type_shifted(k.key_code, k.shift);
+            break;
+        case KeyAction::TAP: tap_key(k.key_code); break;
+        case KeyAction::COMBO: perform_combo(k.extra, k.key_code); break;
+        case KeyAction::LATCH: {
+            bool& latched = latch_state(k.key_code);
+            latched = !latched;
+            if (latched) press_key(k.key_code); else release_key(k.key_code);
+            toggle_led(k.extra, latched);
+            break;
         }
+        case KeyAction::TOGGLE_MODE:
+            g_toggle_mode_active = !g_toggle_mode_active;
+            // Можно добавить отдельную индикацию, если потребуется
+            if (!g_toggle_mode_active) {
+                for (int key = 0; key < KEY_CNT; ++key)
+                    if (g_toggled_keys[key]) release_key(key);
+                g_toggled_keys.reset();
+            }
+            break;
+        case KeyAction::SCROLL_MODE: g_scroll_mode = !g_scroll_mode; break;
+    }
+}
+
+// --- Автоповтор ---
+// CardKB сообщает о нажатии один раз, а пока клавиша удерживается, тот же код продолжает приходить при каждом опросе. Пока он
+// приходит подряд, через delay_us после нажатия действие клавиши ставится в планировщик заново каждые interval_us.
+// Повторяются только символы и одиночные нажатия, не залипания, режимы и комбинации.
+class KeyRepeat {
+private:
+    uint8_t code = 0;
+    uint64_t next_repeat_us = 0;
+public:
+    uint64_t delay_us = REPEAT_DELAY_US;
+    uint64_t interval_us = REPEAT_INTERVAL_US; // 0 - автоповтор выключен
+
+    void start(uint8_t key, uint64_t now) {
+        code = key;
+        next_repeat_us = now + delay_us;
+    }
+    // Тот же код пришёл снова: клавиша всё ещё удерживается
+    void held(uint64_t now) {
+        if (!code || !interval_us || now < next_repeat_us) return;
+        const KeyEntry& k = KEY_TABLE[code];
+        bool toggles = g_toggle_mode_active && k.toggle_target;
+        if (!(k.action == KeyAction::TAP || (k.action == KeyAction::TYPE && !toggles))) return;
+        run_key_action(k);
+        next_repeat_us = std::max(next_repeat_us + interval_us, now); // После долгого опроса не догоняем пропущенные повторы пачкой
+    }
+    void stop() { code = 0; }
+};
 
-        if (!base_keys.count(base_char)) return;
-        int key_code = base_keys[base_char];
+// --- Аккорды ---
+// Последовательность из двух кодов, пришедших в пределах окна, заменяется своим действием. Первый код аккорда придерживается до
+// второго или до конца окна (тогда выполняется его собственное действие), а опрос всё это время продолжается.
+struct Chord { uint8_t first, second; uint16_t window_ms; KeyEntry action; };
+constexpr Chord CHORDS[] = {
+    {SYM, ESC, 20, {KeyAction::TYPE, true, false, KEY_F11, 0}}, // SYM, затем ESC: Shift+F11
+    {SYM, TAB, 20, {KeyAction::SCROLL_MODE, false, false, 0, 0}} // SYM, затем TAB: режим прокрутки джойстиком
+};
 
-        if (g_toggle_mode_active && toggle_target_keys.count(key_code)) {
-            handle_toggle_key(fd_uinput, key_code);
+class ChordLayer {
+private:
+    uint8_t pending = 0;
+    uint64_t pending_origin_us = 0;
+    uint64_t deadline = 0;
+public:
+    // Когда истекает окно придержанного кода
+    uint64_t deadline_us() const { return pending ? deadline : UINT64_MAX; }
+    bool idle() const { return pending == 0; }
+
+    void on_key(uint8_t code, uint64_t now, uint64_t origin_us) {
+        if (pending) {
+            uint8_t first = pending;
+            pending = 0;
+            for (const Chord& c : CHORDS) {
+                if (c.first == first && c.second == code) { run_key_action(c.action); return; }
+            }
+            run_key_action(KEY_TABLE[first]);
+        }
+        uint64_t window_us = 0;
+        for (const Chord& c : CHORDS) {
+            if (c.first == code) window_us = std::max(window_us, (uint64_t)c.window_ms * 1000);
+        }
+        if (window_us) {
+            pending = code;
+            pending_origin_us = origin_us;
+            deadline = now + window_us;
         } else {
-            if (use_shift && !g_latched_shift) press_key(fd_uinput, KEY_LEFTSHIFT);
-            tap_key(fd_uinput, key_code);
-            if (use_shift && !g_latched_shift) release_key(fd_uinput, KEY_LEFTSHIFT);
+            run_key_action(KEY_TABLE[code]);
+        }
+    }
+    // Окно истекло без второго кода: выполняем действие первого
+    void expire(uint64_t now) {
+        if (!pending || now < deadline) return;
+        g_events.set_origin(pending_origin_us);
+        run_key_action(KEY_TABLE[pending]);
+        g_events.set_origin(0);
+        g_events.run_due();
+        pending = 0;
+    }
+};
+
+KeyRepeat g_repeat;
+ChordLayer g_chords;
+
+// --- Источники кодов клавиш: CardKB на I2C, pty или записанная трасса ---
+class KeySource {
+public:
+    virtual ~KeySource() {}
+    // Как CardKB: false, если чтение не удалось, иначе код нажатой клавиши или 0, если нажатий не было
+    virtual bool read_key(uint8_t& code) = 0;
+    // Когда появился последний прочитанный код, если источник это знает, иначе 0
+    virtual uint64_t arrival_us() const { return 0; }
+    // Источник больше не выдаст кодов
+    virtual bool finished() const { return false; }
+};
+
+class I2CKeySource : public KeySource {
+private:
+    int fd;
+public:
+    explicit I2CKeySource(int fd) : fd(fd) {}
+    bool read_key(uint8_t& code) override { return read(fd, &code, 1) == 1; }
+};
+
+// Байты, записанные в подчинённую сторону pty, становятся кодами клавиш, например: printf 'ab\x08' > /dev/pts/3
+class PtyKeySource : public KeySource {
+private:
+    int fd_master = -1;
+    int fd_slave = -1; // Держим открытой, иначе чтение master возвращает EIO, пока никто не пишет
+public:
+    bool open_pty(std::string& slave_path) {
+        fd_master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (fd_master < 0 || grantpt(fd_master) < 0 || unlockpt(fd_master) < 0) return false;
+        slave_path = ptsname(fd_master);
+        fd_slave = open(slave_path.c_str(), O_RDWR | O_NOCTTY);
+        if (fd_slave < 0) return false;
+        struct termios tio;
+        tcgetattr(fd_slave, &tio);
+        cfmakeraw(&tio); // Без построчной буферизации и эха, каждый байт доходит как есть
+        tcsetattr(fd_slave, TCSANOW, &tio);
+        return true;
+    }
+    bool read_key(uint8_t& code) override {
+        if (read(fd_master, &code, 1) == 1) return true;
+        code = 0;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+};
+
+// Трасса - строки "<мс от начала> <код> [<мс удержания>]", где код - число 0..255 или символ в кавычках, например: 120 'a'.
+// Строки с # пропускаются. Коды отдаются по одному на чтение, не раньше своего времени, как их отдавал бы CardKB, а удерживаемый
+// код - при каждом чтении до конца удержания.
+class TraceKeySource : public KeySource {
+private:
+    struct Entry { uint64_t at_us, hold_us; uint8_t code; };
+    std::vector<Entry> entries;
+    size_t next = 0;
+    uint64_t start_us = 0;
+    uint64_t last_arrival_us = 0;
+    uint8_t held_code = 0;
+    uint64_t hold_end_us = 0;
+public:
+    bool load(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) return false;
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            double ms, hold_ms = 0;
+            std::string code;
+            if (line.empty() || line[0] == '#' || !(fields >> ms >> code)) continue;
+            fields >> hold_ms;
+            uint8_t value = (code.size() == 3 && code[0] == '\'' && code[2] == '\'') ? code[1] : (uint8_t)atoi(code.c_str());
+            entries.push_back({(uint64_t)(ms * 1000), (uint64_t)(hold_ms * 1000), value});
+        }
+        return true;
+    }
+    void start() { start_us = now_us(); }
+    size_t size() const { return entries.size(); }
+    bool read_key(uint8_t& code) override {
+        uint64_t now = now_us();
+        code = 0;
+        if (held_code && now < hold_end_us) {
+            code = held_code;
+            return true;
+        }
+        held_code = 0;
+        if (next < entries.size() && start_us + entries[next].at_us <= now) {
+            const Entry& e = entries[next++];
+            last_arrival_us = start_us + e.at_us;
+            code = e.code;
+            if (e.hold_us) {
+                held_code = code;
+                hold_end_us = last_arrival_us + e.hold_us;
+            }
         }
+        return true;
     }
+    uint64_t arrival_us() const override { return last_arrival_us; }
+    bool finished() const override { return next == entries.size() && !held_code; }
 };
 
+// Печатает задержки от появления кода клавиши до её первого события в приёмнике и пропускную способность
+void print_benchmark_report(std::vector<uint64_t> latencies_us, size_t trace_keys, double seconds) {
+    std::sort(latencies_us.begin(), latencies_us.end());
+    auto percentile = [&](double p) { return latencies_us.empty() ? 0 : latencies_us[(size_t)(p * (latencies_us.size() - 1))]; };
+    std::cout << "Benchmark: " << trace_keys << " codes in trace, " << g_stats.keys << " keys read, " << latencies_us.size() << " keys emitted in "
+              << seconds << " s (" << latencies_us.size() / seconds << " keys/s)\n"
+              << "Latency us: p50 " << percentile(0.5) << ", p90 " << percentile(0.9) << ", p99 " << percentile(0.99)
+              << ", max " << percentile(1.0) << std::endl;
+}
+
+// Создаёт виртуальную клавиатуру uinput, возвращает её fd или -1
+int open_uinput_device() {
+    int fd_uinput = open(UINPUT_DEVICE_PATH, O_WRONLY | O_NONBLOCK);
+    if (fd_uinput < 0) return -1;
+
+    ioctl(fd_uinput, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd_uinput, UI_SET_EVBIT, EV_SYN);
+    ioctl(fd_uinput, UI_SET_EVBIT, EV_LED);
+    ioctl(fd_uinput, UI_SET_EVBIT, EV_REL);
+    for (int i = KEY_ESC; i < KEY_MAX; i++) ioctl(fd_uinput, UI_SET_KEYBIT, i); // Включая кнопки мыши BTN_*
+    ioctl(fd_uinput, UI_SET_RELBIT, REL_X);
+    ioctl(fd_uinput, UI_SET_RELBIT, REL_Y);
+    ioctl(fd_uinput, UI_SET_RELBIT, REL_WHEEL);
+    ioctl(fd_uinput, UI_SET_RELBIT, REL_HWHEEL);
+    ioctl(fd_uinput, UI_SET_LEDBIT, LED_NUML);
+    ioctl(fd_uinput, UI_SET_LEDBIT, LED_CAPSL);
+    ioctl(fd_uinput, UI_SET_LEDBIT, LED_SCROLLL);
+
+    struct uinput_setup usetup;
+    memset(&usetup, 0, sizeof(usetup));
+    usetup.id.bustype = BUS_USB;
+    usetup.id.vendor = 0x1A2B;
+    usetup.id.product = 0x3C4D;
+    strcpy(usetup.name, "CLST2 CardKB v4.0");
+    ioctl(fd_uinput, UI_DEV_SETUP, &usetup);
+    ioctl(fd_uinput, UI_DEV_CREATE);
+    sleep(1);
+    return fd_uinput;
+}
+
+// --- Цикл событий на epoll ---
+// Все источники (таймеры планировщика и опроса, линия прерывания, FIFO, устройства evdev) ждутся одним epoll_wait().
+class EventLoop {
+private:
+    struct Watch { int fd; std::function<void()> on_ready; };
+    int fd_epoll = -1;
+    std::deque<Watch> watches; // deque не двигает элементы при добавлении, на них указывает epoll_event.data.ptr
+public:
+    bool init() {
+        fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        return fd_epoll >= 0;
+    }
+    bool add(int fd, std::function<void()> on_ready) {
+        watches.push_back({fd, on_ready});
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &watches.back();
+        return epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+    // Ждёт, пока что-нибудь не будет готово (или сигнала), и вызывает обработчики готовых
+    void wait() {
+        struct epoll_event ready[16];
+        int n = epoll_wait(fd_epoll, ready, 16, -1);
+        g_stats.wakeups++;
+        for (int i = 0; i < n; ++i) ((Watch*)ready[i].data.ptr)->on_ready();
+    }
+};
+
+// --- Картриджи MCS ---
+// Эмулятор картриджа (working/MCS) пишет в FIFO паспорт вида "TP=PRINTER;NM=SIG-MA v1;DRVID=00000001;CRDID=A1B2C3D4;".
+// Паспорт выводится в журнал, а на рабочий стол уходит нажатие KEY_PROG1, на которое можно повесить действие.
+// FIFO открыт и на запись, иначе после ухода писателя epoll без конца сообщал бы о EOF.
+// Демон работает от root, поэтому FIFO не доступен на запись всем: писать в него может только группа (--mcs-group),
+// и лежит он в /run, куда обычный пользователь не подложит свой файл или ссылку вместо него.
+class McsFifoReader {
+private:
+    int fd = -1;
+
+    static std::string field(const std::string& passport, const char* name) {
+        size_t start = passport.find(std::string(name) + "=");
+        if (start == std::string::npos) return "?";
+        start += strlen(name) + 1;
+        return passport.substr(start, passport.find(';', start) - start);
+    }
+public:
+    // gid < 0: писать в FIFO может только владелец
+    bool open_fifo(const std::string& path, gid_t gid) {
+        if (mkfifo(path.c_str(), 0600) < 0 && errno != EEXIST) return false;
+        fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) return false;
+        // Уже существующий путь мог оказаться не тем FIFO, который создали мы
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode) || st.st_uid != geteuid()) {
+            close(fd);
+            fd = -1;
+            errno = EPERM;
+            return false;
+        }
+        // Права выставляются через fd и заодно чинят FIFO, оставшийся от прошлого запуска
+        if ((gid != (gid_t)-1 && fchown(fd, (uid_t)-1, gid) < 0) || fchmod(fd, gid != (gid_t)-1 ? 0620 : 0600) < 0) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        return true;
+    }
+    int fd_read() const { return fd; }
+    void on_ready() {
+        char buf[512];
+        ssize_t n;
+        // Паспорт короче PIPE_BUF и пишется одним write(), так что приходит целиком
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            std::string passport(buf, n);
+            std::cout << "Картридж: " << field(passport, "TP") << " \"" << field(passport, "NM") << "\" (" << passport << ")" << std::endl;
+            tap_key(KEY_PROG1);
+        }
+        g_events.run_due();
+    }
+};
+
+// --- Устройства evdev ---
+// Устройство ввода (например, pseudoTrackpoint на DigiSpark) захватывается через EVIOCGRAB, чтобы X не получал его события
+// напрямую, и после фильтра они уходят через общее устройство uinput. Кнопки проходят как есть.
+// Фильтр 1€ (Casiez и др., 2012): экспоненциальное сглаживание, у которого частота среза растёт со скоростью изменения сигнала.
+// Медленный сигнал сглаживается сильно (дрожание джойстика), быстрый почти без задержки.
+class OneEuroFilter {
+private:
+    double value = 0, derivative = 0;
+    bool primed = false;
+
+    static double alpha(double cutoff_hz, double dt) {
+        double tau = 1 / (2 * M_PI * cutoff_hz);
+        return 1 / (1 + tau / dt);
+    }
+public:
+    double min_cutoff_hz = 0; // 0 отключает сглаживание
+    double beta = 0;
+    double derivative_cutoff_hz = 1;
+
+    void reset() { primed = false; }
+    double filter(double x, double dt) {
+        if (min_cutoff_hz <= 0) return x;
+        if (!primed) {
+            primed = true;
+            value = x;
+            derivative = 0;
+            return x;
+        }
+        derivative += alpha(derivative_cutoff_hz, dt) * ((x - value) / dt - derivative);
+        value += alpha(min_cutoff_hz + beta * fabs(derivative), dt) * (x - value);
+        return value;
+    }
+};
+
+// Фильтр отчётов мыши. Сглаживается скорость, а не положение: джойстик не шлёт нулевых отчётов, так что при
+// остановке сглаженное положение так и не догнало бы настоящее. Скорость в отсчётах за 10 мс (период отчётов DigiSpark)
+// умножается на 1 + accel * скорость^curve, а дробные остатки копятся до целого пикселя.
+class PointerFilter {
+private:
+    int scroll_x = 0, scroll_y = 0; // Накопленное движение в режиме прокрутки
+    OneEuroFilter smooth_x, smooth_y;
+    double rest_x = 0, rest_y = 0; // Доли пикселя, ещё не отправленные
+    uint64_t last_us = 0;
+public:
+    double accel = 0;
+    double curve = 1;
+    int scroll_step = 8; // Сколько единиц движения на один щелчок колеса
+    uint64_t gap_us = 50000; // После такой паузы движение начинается заново, без истории фильтра
+
+    void set_smoothing(double min_cutoff_hz, double beta) {
+        smooth_x.min_cutoff_hz = smooth_y.min_cutoff_hz = min_cutoff_hz;
+        smooth_x.beta = smooth_y.beta = beta;
+    }
+
+    // Переводит отчёт (dx, dy) в момент at_us в смещение курсора в целых пикселях
+    void filter(int dx, int dy, uint64_t at_us, int& out_x, int& out_y) {
+        uint64_t dt_us = at_us - last_us;
+        if (last_us == 0 || dt_us > gap_us) {
+            smooth_x.reset();
+            smooth_y.reset();
+            rest_x = rest_y = 0;
+            dt_us = 10000; // Первый отчёт после паузы считаем за обычный период
+        }
+        last_us = at_us;
+        double dt = std::max<uint64_t>(dt_us, 1000) / 1e6;
+
+        double vx = smooth_x.filter(dx / dt, dt) * 0.01;
+        double vy = smooth_y.filter(dy / dt, dt) * 0.01;
+        double gain = 1 + accel * pow(hypot(vx, vy), curve);
+        rest_x += vx * gain * dt * 100;
+        rest_y += vy * gain * dt * 100;
+        out_x = (int)rest_x; // Отбрасывает дробную часть к нулю, остаток уходит в следующий отчёт
+        out_y = (int)rest_y;
+        rest_x -= out_x;
+        rest_y -= out_y;
+    }
+
+    void move(int dx, int dy, uint64_t at_us) {
+        if (g_scroll_mode) {
+            scroll_x += dx;
+            scroll_y += dy;
+            for (; abs(scroll_y) >= scroll_step; scroll_y -= (scroll_y > 0 ? scroll_step : -scroll_step))
+                g_events.emit_now(EV_REL, REL_WHEEL, scroll_y > 0 ? -1 : 1); // Вниз по джойстику - вниз по странице
+            for (; abs(scroll_x) >= scroll_step; scroll_x -= (scroll_x > 0 ? scroll_step : -scroll_step))
+                g_events.emit_now(EV_REL, REL_HWHEEL, scroll_x > 0 ? 1 : -1);
+            return;
+        }
+        scroll_x = scroll_y = 0;
+        uint64_t start_ns = now_ns();
+        int out_x, out_y;
+        filter(dx, dy, at_us, out_x, out_y);
+        uint64_t cost_ns = now_ns() - start_ns;
+        g_stats.pointer_reports++;
+        g_stats.filter_ns_sum += cost_ns;
+        g_stats.filter_ns_max = std::max(g_stats.filter_ns_max, cost_ns);
+        if (out_x) g_events.emit_now(EV_REL, REL_X, out_x);
+        if (out_y) g_events.emit_now(EV_REL, REL_Y, out_y);
+    }
+};
+
+// Прогоняет записанные отчёты мыши ("<ms> <dx> <dy>" на строку, см. --pointer-record) через фильтр без ожидания и сравнивает
+// путь курсора с сырым. Путь пишется в path_out строками "<ms> <сырой x> <сырой y> <x> <y>".
+bool replay_pointer_trace(const std::string& trace_path, PointerFilter& filter, std::ostream* path_out) {
+    std::ifstream in(trace_path);
+    if (!in) return false;
+    std::string line;
+    double raw_x = 0, raw_y = 0, x = 0, y = 0, raw_length = 0, length = 0, end_error = 0;
+    uint64_t reports = 0, cost_ns_sum = 0, cost_ns_max = 0;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        double ms;
+        int dx, dy;
+        if (line.empty() || line[0] == '#' || !(fields >> ms >> dx >> dy)) continue;
+        uint64_t start_ns = now_ns();
+        int out_x, out_y;
+        filter.filter(dx, dy, 1 + (uint64_t)(ms * 1000), out_x, out_y); // 0 означает "ещё не было отчётов"
+        uint64_t cost_ns = now_ns() - start_ns;
+        reports++;
+        cost_ns_sum += cost_ns;
+        cost_ns_max = std::max(cost_ns_max, cost_ns);
+        raw_x += dx;
+        raw_y += dy;
+        x += out_x;
+        y += out_y;
+        raw_length += hypot(dx, dy);
+        length += hypot(out_x, out_y);
+        end_error = std::max(end_error, hypot(x - raw_x, y - raw_y));
+        if (path_out) *path_out << ms << " " << raw_x << " " << raw_y << " " << x << " " << y << "\n";
+    }
+    std::cout << "Pointer replay: " << reports << " reports, raw path " << raw_length << " px to (" << raw_x << "," << raw_y
+              << "), filtered path " << length << " px to (" << x << "," << y << "), max distance between paths " << end_error << " px\n"
+              << "Filter cost ns: avg " << (reports ? cost_ns_sum / reports : 0) << ", max " << cost_ns_max << std::endl;
+    return true;
+}
+
+class EvdevInput {
+private:
+    int fd = -1;
+    std::string path;
+    int dx = 0, dy = 0;
+    std::ostream* record = nullptr;
+    uint64_t record_start_us = 0;
+public:
+    PointerFilter filter;
+
+    // Пишет сырые отчёты в формате replay_pointer_trace()
+    void record_to(std::ostream* out) { record = out; }
+
+    bool open_device(const std::string& device_path) {
+        path = device_path;
+        fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) return false;
+        if (ioctl(fd, EVIOCGRAB, 1) < 0) std::cerr << "Warning: Cannot grab " << path << ", its events will reach X twice." << std::endl;
+        return true;
+    }
+    int fd_read() const { return fd; }
+    void on_ready() {
+        struct input_event events[64];
+        ssize_t n;
+        while ((n = read(fd, events, sizeof(events))) > 0) {
+            for (size_t i = 0; i < n / sizeof(events[0]); ++i) {
+                const struct input_event& e = events[i];
+                if (e.type == EV_REL && e.code == REL_X) dx += e.value;
+                else if (e.type == EV_REL && e.code == REL_Y) dy += e.value;
+                else if (e.type == EV_REL || e.type == EV_KEY) g_events.emit_now(e.type, e.code, e.value);
+                else if (e.type == EV_SYN && e.code == SYN_REPORT && (dx || dy)) {
+                    uint64_t at_us = (uint64_t)e.input_event_sec * 1000000 + e.input_event_usec; // Время отчёта по ядру, без задержки чтения
+                    if (record) {
+                        if (!record_start_us) record_start_us = at_us;
+                        *record << (at_us - record_start_us) / 1000.0 << " " << dx << " " << dy << std::endl;
+                    }
+                    filter.move(dx, dy, at_us);
+                    dx = dy = 0;
+                }
+            }
+        }
+        if (n == 0 || (n < 0 && errno != EAGAIN)) {
+            std::cerr << "Warning: " << path << " is gone: " << (n == 0 ? "end of file" : strerror(errno)) << std::endl;
+            close(fd); // Закрытый fd сам пропадает из epoll
+            fd = -1;
+        }
+        g_events.run_due();
+    }
+};
+
+// --- Адаптивный опрос I2C ---
+uint64_t poll_interval_us(uint64_t now, uint64_t last_key_us, bool have_irq, bool key_held) {
+    // Нажатия будят по прерыванию, и без удерживаемой клавиши опрос только подстраховывает. Отпускание и автоповтор
+    // прерывания не дают, поэтому пока клавиша нажата, опрашиваем так же часто, как без линии прерывания.
+    if (have_irq && !key_held) return IDLE_POLL_INTERVAL_US;
+    if (now - last_key_us < BURST_WINDOW_US) return BURST_POLL_INTERVAL_US;
+    if (now - last_key_us < IDLE_AFTER_US) return I2C_POLL_INTERVAL_US;
+    return IDLE_POLL_INTERVAL_US;
+}
+
+// Запрашивает линию прерывания CardKB (активный низкий уровень) с событиями по спаду. Возвращает fd линии или -1.
+int open_irq_line(const std::string& chip_path, int line) {
+    int fd_chip = open(chip_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_chip < 0) return -1;
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = line;
+    req.num_lines = 1;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING | GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+    strcpy(req.consumer, "cardkb_daemon");
+    int ret = ioctl(fd_chip, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(fd_chip);
+    if (ret < 0) return -1;
+    fcntl(req.fd, F_SETFL, O_NONBLOCK);
+    return req.fd;
+}
+
+// Вычитывает все накопленные фронты, возвращает время последнего (CLOCK_MONOTONIC) или 0
+uint64_t read_irq_edges(int fd_irq) {
+    struct gpio_v2_line_event events[16];
+    uint64_t last_edge_us = 0;
+    ssize_t n;
+    while ((n = read(fd_irq, events, sizeof(events))) > 0) {
+        for (size_t i = 0; i < n / sizeof(events[0]); ++i) {
+            last_edge_us = events[i].timestamp_ns / 1000;
+            g_stats.irq_edges++;
+        }
+    }
+    return last_edge_us;
+}
+
+void print_stats() {
+    double seconds = (now_us() - g_stats.started_us) / 1e6;
+    std::cout << "Stats: " << seconds << " s, " << g_stats.wakeups << " wakeups (" << g_stats.wakeups / seconds << "/s), "
+              << g_stats.i2c_reads << " I2C reads (" << g_stats.i2c_reads / seconds << "/s), " << g_stats.irq_edges << " IRQ edges, "
+              << g_stats.keys << " keys, latency avg " << (g_stats.keys ? g_stats.latency_sum_us / g_stats.keys : 0)
+              << " us, max " << g_stats.latency_max_us << " us, " << g_stats.pointer_reports << " pointer reports, filter avg "
+              << (g_stats.pointer_reports ? g_stats.filter_ns_sum / g_stats.pointer_reports : 0) << " ns, max " << g_stats.filter_ns_max << " ns" << std::endl;
+}
+
 void print_help(const char* prog_name) {
     std::cout << "Usage: " << prog_name << " [options]\n"
               << "Options:\n"
               << "  -i, --i2c-device <path>   Path to the I2C device. Default: /dev/i2c-0\n"
+              << "  -g, --irq-gpio <line>     GPIO line wired to the CardKB interrupt output. Default: none, poll only\n"
+              << "  -c, --gpio-chip <path>    GPIO chip of the interrupt line. Default: /dev/gpiochip0\n"
+              << "  -r, --replay <trace>      Read key codes from a trace of \"<ms> <code>\" lines instead of the CardKB\n"
+              << "  -p, --pty                 Read key codes from a new pty instead of the CardKB, its path is printed\n"
+              << "  -o, --capture <file>      Write events as text to the file (- for stdout) instead of uinput\n"
+              << "  -b, --benchmark           With --replay: exit at the end of the trace and print latency percentiles\n"
+              << "  -D, --repeat-delay <ms>   Delay before a held key starts repeating. Default: 400\n"
+              << "  -R, --repeat-rate <hz>    Repeats per second of a held key, 0 to disable. Default: 25\n"
+              << "  -e, --evdev <path>        Grab a pointer device and forward it through uinput, may be repeated\n"
+              << "  -a, --pointer-accel <k>   Pointer acceleration: motion is scaled by 1 + k * speed^curve, speed in counts per 10 ms. Default: 0\n"
+              << "  -x, --pointer-curve <e>   Exponent of the acceleration curve. Default: 1\n"
+              << "  -F, --smooth-cutoff <hz>  Minimum cutoff of the 1-euro pointer smoothing, 0 to disable. Default: 0 (off)\n"
+              << "  -B, --smooth-beta <b>     Speed coefficient of the 1-euro pointer smoothing. Default: 0.002\n"
+              << "  -W, --pointer-record <f>  Write raw pointer reports of the evdev devices to the file\n"
+              << "  -P, --pointer-replay <f>  Run recorded pointer reports through the filter, print path comparison and exit\n"
+              << "  -m, --mcs-fifo <path>     Read MCS cartridge passports from the FIFO and press KEY_PROG1 on each\n"
+              << "  -G, --mcs-group <group>   Group allowed to write to the MCS FIFO. Default: none, owner only\n"
               << "  -v, --verbose             Enable verbose output for debugging.\n"
-              << "  -h, --help                Show this help message and exit.\n";
+              << "  -h, --help                Show this help message and exit.\n"
+              << "Send SIGUSR1 to print polling and latency statistics.\n";
 }
 
 // --- Главная функция ---
 int main(int argc, char *argv[]) {
     std::string i2c_device_path = "/dev/i2c-1"; // Defaulting to i2c-1 as planned
+    std::string gpio_chip_path = "/dev/gpiochip0";
+    int irq_gpio_line = -1;
+    std::string replay_path, capture_path;
+    bool use_pty = false;
+    bool benchmark = false;
     bool verbose_mode = false;
+    std::vector<std::string> evdev_paths;
+    double pointer_accel = 0, pointer_curve = 1;
+    double smooth_cutoff_hz = 0, smooth_beta = 0.002;
+    std::string pointer_record_path, pointer_replay_path;
+    std::string mcs_fifo_path, mcs_group;
 
     const struct option long_options[] = {
         {"i2c-device", required_argument, 0, 'i'},
+        {"irq-gpio",   required_argument, 0, 'g'},
+        {"gpio-chip",  required_argument, 0, 'c'},
+        {"replay",     required_argument, 0, 'r'},
+        {"pty",        no_argument,       0, 'p'},
+        {"capture",    required_argument, 0, 'o'},
+        {"benchmark",  no_argument,       0, 'b'},
+        {"repeat-delay", required_argument, 0, 'D'},
+        {"repeat-rate",  required_argument, 0, 'R'},
+        {"evdev",      required_argument, 0, 'e'},
+        {"pointer-accel", required_argument, 0, 'a'},
+        {"pointer-curve", required_argument, 0, 'x'},
+        {"smooth-cutoff", required_argument, 0, 'F'},
+        {"smooth-beta",   required_argument, 0, 'B'},
+        {"pointer-record", required_argument, 0, 'W'},
+        {"pointer-replay", required_argument, 0, 'P'},
+        {"mcs-fifo",   required_argument, 0, 'm'},
+        {"mcs-group",  required_argument, 0, 'G'},
         {"verbose",    no_argument,       0, 'v'},
         {"help",       no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "i:vh", long_options, nullptr)) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:g:c:r:po:bD:R:e:a:x:F:B:W:P:m:G:vh", long_options, nullptr)) != -1) {
         switch (opt) {
             case 'i': i2c_device_path = optarg; break;
+            case 'g': irq_gpio_line = atoi(optarg); break;
+            case 'c': gpio_chip_path = optarg; break;
+            case 'r': replay_path = optarg; break;
+            case 'p': use_pty = true; break;
+            case 'o': capture_path = optarg; break;
+            case 'b': benchmark = true; break;
+            case 'D': g_repeat.delay_us = (uint64_t)atoi(optarg) * 1000; break;
+            case 'R': g_repeat.interval_us = atoi(optarg) > 0 ? 1000000 / atoi(optarg) : 0; break;
+            case 'e': evdev_paths.push_back(optarg); break;
+            case 'a': pointer_accel = atof(optarg); break;
+            case 'x': pointer_curve = atof(optarg); break;
+            case 'F': smooth_cutoff_hz = atof(optarg); break;
+            case 'B': smooth_beta = atof(optarg); break;
+            case 'W': pointer_record_path = optarg; break;
+            case 'P': pointer_replay_path = optarg; break;
+            case 'm': mcs_fifo_path = optarg; break;
+            case 'G': mcs_group = optarg; break;
             case 'v': verbose_mode = true; break;
             case 'h': print_help(argv[0]); return 0;
             default: print_help(argv[0]); return 1;
         }
     }
 
-    int fd_uinput = open(UINPUT_DEVICE_PATH, O_WRONLY | O_NONBLOCK);
-    if (fd_uinput < 0) { std::cerr << "Error: Cannot open uinput. Run with sudo." << std::endl; return 1; }
-    
-    ioctl(fd_uinput, UI_SET_EVBIT, EV_KEY);
-    ioctl(fd_uinput, UI_SET_EVBIT, EV_SYN);
-    ioctl(fd_uinput, UI_SET_EVBIT, EV_LED);
-    for (int i = KEY_ESC; i < KEY_MAX; i++) ioctl(fd_uinput, UI_SET_KEYBIT, i);
-    ioctl(fd_uinput, UI_SET_LEDBIT, LED_NUML);
-    ioctl(fd_uinput, UI_SET_LEDBIT, LED_CAPSL);
-    ioctl(fd_uinput, UI_SET_LEDBIT, LED_SCROLLL);
-    
-    struct uinput_setup usetup;
-    memset(&usetup, 0, sizeof(usetup));
-    usetup.id.bustype = BUS_USB;
-    usetup.id.vendor = 0x1A2B;
-    usetup.id.product = 0x3C4D;
-    strcpy(usetup.name, "CLST2 CardKB v4.0");
-    ioctl(fd_uinput, UI_DEV_SETUP, &usetup);
-    ioctl(fd_uinput, UI_DEV_CREATE);
-    sleep(1);
+    if (!pointer_replay_path.empty()) {
+        PointerFilter filter;
+        filter.accel = pointer_accel;
+        filter.curve = pointer_curve;
+        filter.set_smoothing(smooth_cutoff_hz, smooth_beta);
+        std::ofstream path_file;
+        if (!capture_path.empty() && capture_path != "-") path_file.open(capture_path);
+        std::ostream* path_out = capture_path.empty() ? nullptr : (capture_path == "-" ? &std::cout : &path_file);
+        if (!replay_pointer_trace(pointer_replay_path, filter, path_out)) { std::cerr << "Error: Cannot read trace " << pointer_replay_path << std::endl; return 1; }
+        return 0;
+    }
 
-    int fd_i2c = open(i2c_device_path.c_str(), O_RDWR);
-    if (fd_i2c < 0) { std::cerr << "Error: Cannot open " << i2c_device_path << std::endl; return 1; }
-    if (ioctl(fd_i2c, I2C_SLAVE, KEYBOARD_I2C_ADDR) < 0) { std::cerr << "Error: Cannot set i2c slave address." << std::endl; return 1; }
+    if (benchmark && replay_path.empty()) { std::cerr << "Error: --benchmark needs --replay." << std::endl; return 1; }
 
-    std::cout << "Демон клавиатуры v4.0 запущен. Устройство: " << i2c_device_path << std::endl;
+    int fd_uinput = -1;
+    std::ofstream capture_file;
+    EventSink* sink;
+    if (!capture_path.empty()) {
+        if (capture_path != "-") {
+            capture_file.open(capture_path);
+            if (!capture_file) { std::cerr << "Error: Cannot open " << capture_path << std::endl; return 1; }
+        }
+        sink = new CaptureSink(capture_path == "-" ? std::cout : capture_file);
+    } else {
+        fd_uinput = open_uinput_device();
+        if (fd_uinput < 0) { std::cerr << "Error: Cannot open uinput. Run with sudo." << std::endl; return 1; }
+        sink = new UinputSink(fd_uinput);
+    }
+
+    int fd_i2c = -1;
+    KeySource* source;
+    TraceKeySource* trace = nullptr;
+    std::string source_name = i2c_device_path;
+    if (!replay_path.empty()) {
+        trace = new TraceKeySource();
+        if (!trace->load(replay_path)) { std::cerr << "Error: Cannot read trace " << replay_path << std::endl; return 1; }
+        source = trace;
+        source_name = replay_path;
+    } else if (use_pty) {
+        PtyKeySource* pty = new PtyKeySource();
+        if (!pty->open_pty(source_name)) { std::cerr << "Error: Cannot create pty." << std::endl; return 1; }
+        source = pty;
+    } else {
+        fd_i2c = open(i2c_device_path.c_str(), O_RDWR);
+        if (fd_i2c < 0) { std::cerr << "Error: Cannot open " << i2c_device_path << std::endl; return 1; }
+        if (ioctl(fd_i2c, I2C_SLAVE, KEYBOARD_I2C_ADDR) < 0) { std::cerr << "Error: Cannot set i2c slave address." << std::endl; return 1; }
+        source = new I2CKeySource(fd_i2c);
+    }
+
+    if (!g_events.init(sink)) { std::cerr << "Error: Cannot create timerfd." << std::endl; return 1; }
+    g_events.record_latencies = benchmark;
+
+    int fd_irq = -1;
+    if (irq_gpio_line >= 0 && fd_i2c >= 0) {
+        fd_irq = open_irq_line(gpio_chip_path, irq_gpio_line);
+        if (fd_irq < 0) std::cerr << "Warning: Cannot request GPIO line " << irq_gpio_line << " on " << gpio_chip_path << ", polling only." << std::endl;
+    }
+
+    EventLoop loop;
+    int fd_poll_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!loop.init() || fd_poll_timer < 0) { std::cerr << "Error: Cannot create epoll or timerfd." << std::endl; return 1; }
+
+    std::ofstream pointer_record;
+    if (!pointer_record_path.empty()) {
+        pointer_record.open(pointer_record_path);
+        if (!pointer_record) { std::cerr << "Error: Cannot open " << pointer_record_path << std::endl; return 1; }
+    }
+    std::vector<EvdevInput*> pointers;
+    for (const std::string& path : evdev_paths) {
+        EvdevInput* pointer = new EvdevInput();
+        if (!pointer->open_device(path)) { std::cerr << "Error: Cannot open " << path << std::endl; return 1; }
+        pointer->filter.accel = pointer_accel;
+        pointer->filter.curve = pointer_curve;
+        pointer->filter.set_smoothing(smooth_cutoff_hz, smooth_beta);
+        if (pointer_record.is_open()) pointer->record_to(&pointer_record);
+        loop.add(pointer->fd_read(), [pointer]() { pointer->on_ready(); });
+        pointers.push_back(pointer);
+    }
+    McsFifoReader mcs;
+    if (!mcs_fifo_path.empty()) {
+        gid_t mcs_gid = (gid_t)-1;
+        if (!mcs_group.empty()) {
+            struct group* gr = getgrnam(mcs_group.c_str());
+            if (!gr) { std::cerr << "Error: Unknown group " << mcs_group << std::endl; return 1; }
+            mcs_gid = gr->gr_gid;
+        }
+        if (!mcs.open_fifo(mcs_fifo_path, mcs_gid)) {
+            std::cerr << "Error: Cannot open FIFO " << mcs_fifo_path << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        loop.add(mcs.fd_read(), [&mcs]() { mcs.on_ready(); });
+    }
+
+    signal(SIGUSR1, [](int) { g_dump_stats = 1; });
+
+    std::cout << "Демон клавиатуры v4.0 запущен. Устройство: " << source_name << std::endl;
 
     uint8_t current_key = 0, last_key = 0;
-    DefaultKeyHandler default_handler;
-    while (true) {
-        if (read(fd_i2c, &current_key, 1) == 1) {
-            if (current_key != 0x00 && current_key != last_key) {
-                if (verbose_mode) { std::cout << "Key code: " << (int)current_key << std::endl; }
-                
-                bool key_processed = true;
-                switch(current_key) {
-                    case FN_UP:
-                        g_latched_alt = !g_latched_alt;
-                        if (g_latched_alt) press_key(fd_uinput, KEY_LEFTALT); else release_key(fd_uinput, KEY_LEFTALT);
-                        toggle_led(fd_uinput, LED_CAPSL, g_latched_alt);
-                        break;
-                    case FN_DOWN:
-                        g_latched_ctrl = !g_latched_ctrl;
-                        if (g_latched_ctrl) press_key(fd_uinput, KEY_LEFTCTRL); else release_key(fd_uinput, KEY_LEFTCTRL);
-                        toggle_led(fd_uinput, LED_NUML, g_latched_ctrl);
-                        break;
-                    case FN_LEFT:
-                        g_latched_shift = !g_latched_shift;
-                        if (g_latched_shift) press_key(fd_uinput, KEY_LEFTSHIFT); else release_key(fd_uinput, KEY_LEFTSHIFT);
-                        toggle_led(fd_uinput, LED_SCROLLL, g_latched_shift);
-                        break;
-                    case FN_TAB:
-                        g_toggle_mode_active = !g_toggle_mode_active;
-                        // Можно добавить отдельную индикацию, если потребуется
-                        if (!g_toggle_mode_active) {
-                            for (int key : g_toggled_keys) release_key(fd_uinput, key);
-                            g_toggled_keys.clear();
-                        }
-                        break;
-                    case FN_BACKSPACE: tap_key(fd_uinput, KEY_DELETE); break;
-                    case FN_1: tap_key(fd_uinput, KEY_F1); break;
-                    case FN_2: tap_key(fd_uinput, KEY_F2); break;
-                    case FN_3: tap_key(fd_uinput, KEY_F3); break;
-                    case FN_4: tap_key(fd_uinput, KEY_F4); break;
-                    case FN_5: tap_key(fd_uinput, KEY_F5); break;
-                    case FN_6: tap_key(fd_uinput, KEY_F6); break;
-                    case FN_7: tap_key(fd_uinput, KEY_F7); break;
-                    case FN_8: tap_key(fd_uinput, KEY_F8); break;
-                    case FN_9: tap_key(fd_uinput, KEY_F9); break;
-                    case FN_0: tap_key(fd_uinput, KEY_F10); break;
-                    case FN_ESC: tap_key(fd_uinput, KEY_F11); break;
-                    case SYM: {
-                        uint8_t next_key = 0;
-                        usleep(20000); // Короткая пауза для чтения следующего байта, если он есть
-                        read(fd_i2c, &next_key, 1);
-                        if (next_key == ESC) {
-                             if (!g_latched_shift) press_key(fd_uinput, KEY_LEFTSHIFT);
-                             tap_key(fd_uinput, KEY_F11);
-                             if (!g_latched_shift) release_key(fd_uinput, KEY_LEFTSHIFT);
-                        } else {
-                            default_handler.type(fd_uinput, current_key);
-                            if (next_key != 0) current_key = next_key; else { last_key = SYM; continue; }
-                             key_processed = false;
-                        }
-                        break;
-                    }
-                    case ENTER: tap_key(fd_uinput, KEY_ENTER); break;
-                    case BACKSPACE: tap_key(fd_uinput, KEY_BACKSPACE); break;
-                    case ESC: tap_key(fd_uinput, KEY_ESC); break;
-                    case TAB: tap_key(fd_uinput, KEY_TAB); break;
-                    case UP: tap_key(fd_uinput, KEY_UP); break;
-                    case DOWN: tap_key(fd_uinput, KEY_DOWN); break;
-                    case LEFT: tap_key(fd_uinput, KEY_LEFT); break;
-                    case RIGHT: tap_key(fd_uinput, KEY_RIGHT); break;
-                    case FN_C: perform_combo(fd_uinput, KEY_LEFTCTRL, KEY_C); break;
-                    case FN_V: perform_combo(fd_uinput, KEY_LEFTCTRL, KEY_V); break;
-                    case FN_X: perform_combo(fd_uinput, KEY_LEFTCTRL, KEY_X); break;
-                    case FN_A: perform_combo(fd_uinput, KEY_LEFTCTRL, KEY_A); break;
-                    case FN_S: perform_combo(fd_uinput, KEY_LEFTCTRL, KEY_S); break;
-                    case FN_Z: perform_combo(fd_uinput, KEY_LEFTCTRL, KEY_Z); break;
-                    default:
-                        key_processed = false;
-                }
-                
-                if (!key_processed) {
-                    default_handler.type(fd_uinput, current_key);
+    g_stats.started_us = now_us();
+    uint64_t last_key_us = g_stats.started_us;
+    uint64_t last_edge_us = 0;
+    uint64_t next_poll_us = g_stats.started_us;
+
+    // Опрос клавиатуры: читает CardKB, если подошёл срок опроса, и взводит таймер опроса на следующий срок
+    // или на конец окна аккорда, если придержан его первый код.
+    auto service_keyboard = [&]() {
+        uint64_t now = now_us();
+        g_chords.expire(now);
+        if (now >= next_poll_us) {
+            uint64_t interval_us = poll_interval_us(now, last_key_us, fd_irq >= 0, last_key != 0x00);
+            next_poll_us = now + interval_us;
+
+            g_stats.i2c_reads++;
+            if (source->read_key(current_key)) {
+                if (current_key != 0x00 && current_key != last_key) {
+                    if (verbose_mode) { std::cout << "Key code: " << (int)current_key << std::endl; }
+
+                    uint64_t latency_us = last_edge_us ? now - std::min(now, last_edge_us) : interval_us;
+                    g_events.set_origin(source->arrival_us());
+                    g_stats.keys++;
+                    g_stats.latency_sum_us += latency_us;
+                    g_stats.latency_max_us = std::max(g_stats.latency_max_us, latency_us);
+                    last_key_us = now;
+                    next_poll_us = now + poll_interval_us(now, last_key_us, fd_irq >= 0, true);
+
+                    g_chords.on_key(current_key, now, source->arrival_us());
+                    g_repeat.start(current_key, now);
+                } else if (current_key != 0x00) {
+                    g_repeat.held(now);
+                    last_key_us = now; // Пока клавиша удерживается, опрашиваем часто
+                } else {
+                    g_repeat.stop();
                 }
+                last_key = current_key;
+            } else {
+                last_key = 0;
+                g_repeat.stop();
             }
-            last_key = current_key;
-        } else {
-            last_key = 0;
+            last_edge_us = 0;
+            g_events.set_origin(0);
+        }
+        g_events.run_due();
+        arm_timer(fd_poll_timer, std::min(next_poll_us, g_chords.deadline_us()));
+    };
+
+    // Таймер планировщика отпускает клавиши вовремя, таймер опроса ведёт опрос I2C, а фронт на линии прерывания
+    // означает нажатие - читаем сразу
+    loop.add(g_events.timer_fd(), []() { g_events.on_timer(); });
+    loop.add(fd_poll_timer, [&]() {
+        uint64_t expirations;
+        if (read(fd_poll_timer, &expirations, sizeof(expirations)) < 0) return; // Таймер успели перевзвести
+        service_keyboard();
+    });
+    if (fd_irq >= 0) {
+        loop.add(fd_irq, [&]() {
+            last_edge_us = read_irq_edges(fd_irq);
+            next_poll_us = now_us();
+            service_keyboard();
+        });
+    }
+
+    if (trace) trace->start();
+    service_keyboard();
+    while (!(benchmark && source->finished() && g_chords.idle() && g_events.pending() == 0)) {
+        loop.wait();
+        if (g_dump_stats) {
+            g_dump_stats = 0;
+            print_stats();
         }
-        usleep(10000);
     }
     
-    ioctl(fd_uinput, UI_DEV_DESTROY);
-    close(fd_uinput);
-    close(fd_i2c);
+    if (benchmark) print_benchmark_report(g_events.latencies_us, trace->size(), (now_us() - g_stats.started_us) / 1e6);
+
+    if (fd_uinput >= 0) {
+        ioctl(fd_uinput, UI_DEV_DESTROY);
+        close(fd_uinput);
+    }
+    if (fd_i2c >= 0) close(fd_i2c);
+    if (fd_irq >= 0) close(fd_irq);
+    close(fd_poll_timer);
+    for (EvdevInput* pointer : pointers) delete pointer;
+    delete source;
+    delete sink;
     return 0;
 }
\ No newline at end of file
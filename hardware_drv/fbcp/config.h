@@ -98,7 +98,8 @@
 // if your SPI display runs at a good high SPI bus MHz speed with respect to the screen resolution.
 // Useful on Pi Zero W and ILI9341 to conserve CPU power. If this is not defined, the default much
 // more powerful diffing algorithm is used, which sends far fewer pixels each frame, (but that diffing
-// costs more CPU time). Enabling this requires that ALL_TASKS_SHOULD_DMA is also enabled.
+// costs more CPU time). This only picks the default of FBCP_UPDATE, which can also choose between the strategies at
+// runtime, see fbcp-ili9341.conf.
 // #define UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF
 
 // If UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF is used, controls whether the generated tasks are aligned for
@@ -106,10 +107,26 @@
 #define ALIGN_DIFF_TASKS_FOR_32B_CACHE_LINES
 
 // If defined, screen updates are performend without performing diffing at all, i.e. by doing
-// full updates. This is very lightweight on CPU, but excessive on the SPI bus. Enabling this
-// requires that ALL_TASKS_SHOULD_DMA is also enabled.
+// full updates. This is very lightweight on CPU, but excessive on the SPI bus. Like the above, this picks the
+// default of FBCP_UPDATE. Together with ALL_TASKS_SHOULD_DMA, the previous frame is not kept at all, and
+// FBCP_UPDATE can then only be full.
 // #define UPDATE_FRAMES_WITHOUT_DIFFING
 
+// If defined, the DMA engine streams pixel spans out to the display by reading them directly from the captured
+// framebuffer, walking each update rectangle with 2D stride DMA control blocks, instead of having the CPU first
+// copy and byte swap the pixels into the DMA source buffer. The previous frame is then maintained by swapping the
+// two framebuffers instead of copying. The DMA engine cannot byte swap, so this requires a display controller that
+// can be set to receive RGB565 pixels in little endian order (ST7789, via RAMCTRL). The framebuffers are placed in
+// uncached GPU memory, which makes CPU side diffing slower, so this pays off best together with
+// UPDATE_FRAMES_WITHOUT_DIFFING or UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF on a single core board.
+// #define DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+
+// If defined, all the span and cursor update tasks of a frame are linked together into a single DMA program that is
+// kicked off once per frame, instead of the CPU waiting for each task to finish and sending the command byte of the
+// next one in Polled SPI mode. The command bytes are then sent by DMA as well, with the Data/Control GPIO line toggled
+// by DMA control blocks. Requires ALL_TASKS_SHOULD_DMA, a single core build (no SPI thread) and a 4-wire SPI display.
+// #define DMA_CHAIN_WHOLE_FRAME
+
 #if defined(SINGLE_CORE_BOARD) && defined(USE_DMA_TRANSFERS) && !defined(SPI_3WIRE_PROTOCOL) // TODO: 3-wire SPI displays are not yet compatible with ALL_TASKS_SHOULD_DMA option.
 // These are prerequisites for good performance on Pi Zero
 #ifndef ALL_TASKS_SHOULD_DMA
@@ -140,6 +157,9 @@
 #define ALIGN_TASKS_FOR_DMA_TRANSFERS
 #endif
 
+// The three SAVE_BATTERY_* options below only give the defaults of the FBCP_SLEEP_UNTIL_TARGET_FRAME, FBCP_SLEEP_WHEN_IDLE and
+// FBCP_PREDICT_FRAME_ARRIVAL_TIMES settings, which can also be changed at runtime, see settings.h.
+
 // If defined, the GPU polling thread will be put to sleep for 1/TARGET_FRAMERATE seconds after receiving
 // each new GPU frame, to wait for the earliest moment that the next frame could arrive.
 #define SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
@@ -182,7 +202,8 @@
 // probably no other displays in existence?) allow one to adjust the direction that the scanline refresh
 // cycle runs in, but the scanline refresh always runs in portrait mode in these displays. Not having
 // this defined reduces CPU usage at the expense of more tearing, although it is debatable which
-// effect is better - this can be subjective. Impact is around 0.5-1.0msec of extra CPU time.
+// effect is better - this can be subjective. Impact is one transpose of each captured frame, see
+// TRANSPOSE_ONLY_CHANGED_TILES below.
 // DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE disabled: diagonal tearing
 // DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE enabled: traditional no-vsync tearing (tear line runs in portrait
 // i.e. narrow direction)
@@ -190,6 +211,29 @@
 #define DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
 #endif
 
+#if defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && !defined(USE_GPU_VSYNC)
+// If enabled, each captured frame is compared against the previous capture in 16x16 tiles, and only the tiles that changed are
+// transposed, straight into the capture buffer that still holds the previous transpose. Every frame is still compared in full,
+// and the previous capture takes an extra frame worth of memory, so this only pays off when most of the screen is usually static.
+// Uncomment BENCHMARK_TRANSPOSE in transpose.cpp to measure it. Not available with USE_GPU_VSYNC, where the main thread snapshots to
+// framebuffers that it swaps and draws overlays on.
+// #define TRANSPOSE_ONLY_CHANGED_TILES
+#endif
+
+// If enabled, the source frame is captured from dispmanx at its native resolution and scaled down to the display on the CPU,
+// instead of having dispmanx scale it. Integer 2:1 scaling uses a box filter and other ratios down to 2:1 are bilinear filtered,
+// both with NEON code paths when building with the NEON CMake option. Larger downscales average the source area of each display
+// pixel, since two bilinear taps would skip source pixels. Useful when the dispmanx scaler is not available or its filtering is
+// not wanted. Overscan cropping and DISPLAY_CROPPED_INSTEAD_OF_SCALING keep working, the cropping is done on the source.
+// #define USE_SOFTWARE_SCALING
+
+#if defined(USE_SOFTWARE_SCALING)
+// If enabled, the source frame is compared against the previous one in 16x16 tiles, and only the parts of the scaled frame
+// that changed tiles contribute to are rescaled. Costs an extra copy of the source frame and of the scaled frame in memory,
+// and a copy of the scaled frame out each frame, so this only pays off when most of the screen is usually static.
+// #define SOFTWARE_SCALING_ONLY_CHANGED_TILES
+#endif
+
 // If enabled, build to utilize DMA transfers to communicate with the SPI peripheral. Otherwise polling
 // writes will be performed (possibly with interrupts, if using kernel side driver module)
 // #define USE_DMA_TRANSFERS
@@ -222,6 +266,76 @@
 // Polling interval (in micro-second) for the low battery pin.
 #define LOW_BATTERY_POLLING_INTERVAL 1000000
 
+// If defined, the display controller is switched into its power saving modes based on what changes on screen:
+// a lower panel refresh rate (FRCTRL2) when nothing changes, idle mode (IDMON: 8 colors) when every pixel on screen
+// is one of those 8 colors, and partial display mode (PTLON) when only a thin horizontal band (e.g. a status
+// bar) keeps updating and the rest of the screen is black. A mode is left as soon as the content no longer fits it.
+// Not all modes are available on all controllers, see DISPLAY_SUPPORTS_PARTIAL_MODE, DISPLAY_SUPPORTS_IDLE_MODE and DISPLAY_FRAME_RATE_CONTROL.
+// #define PANEL_POWER_SAVING
+
+// Screen contents must have fit a power saving mode for this many usecs before the mode is entered.
+#define PANEL_POWER_SAVING_DELAY_USECS 5000000
+
+// Partial display mode is only used if the band of updating rows is at most this % of the screen height.
+#define PANEL_PARTIAL_MODE_MAX_HEIGHT_PERCENTAGE 25
+
+// If defined, a second, smaller display with the same controller as the main display is driven on the other chip select line of
+// SPI0 (CE1, or CE0 if the main display uses CS1). It mirrors a SECONDARY_DISPLAY_WIDTH x SECONDARY_DISPLAY_HEIGHT viewport of the
+// captured frame whose top left corner is at (SECONDARY_DISPLAY_VIEWPORT_X, SECONDARY_DISPLAY_VIEWPORT_Y) in framebuffer coordinates.
+// Both displays get the same initialization sequence. See secondary_display.cpp. On displays that need the chip select line to toggle
+// for each command (DISPLAY_NEEDS_CHIP_SELECT_SIGNAL, e.g. ST7789), the main display keeps the hardware chip select of SPI0 and the
+// secondary display's line is toggled as a GPIO, see SwitchBusToPanel() in spi.cpp. Such displays cannot be combined with
+// ALL_TASKS_SHOULD_DMA, since DMA leaves no chance to toggle the GPIO line between commands.
+// #define SECONDARY_DISPLAY
+
+#ifdef SECONDARY_DISPLAY
+#define SECONDARY_DISPLAY_WIDTH 128
+#define SECONDARY_DISPLAY_HEIGHT 64
+#define SECONDARY_DISPLAY_VIEWPORT_X 0
+#define SECONDARY_DISPLAY_VIEWPORT_Y 0
+
+// When both displays have updates pending, the SPI bus is shared between them in proportion to these priorities.
+#define PRIMARY_DISPLAY_BUS_PRIORITY 3
+#define SECONDARY_DISPLAY_BUS_PRIORITY 1
+#endif
+
+// If defined, fbcp keeps its memory footprint small for boards with 512MB of RAM or less: the span pool is sized to the
+// worst case that the diff can produce and links spans with 16-bit indices, capture buffers only reserve the room that the
+// vc_dispmanx_resource_read_data() workaround needs in front of them instead of being allocated at double size, and the
+// SPI task ring holds two frames instead of three. Allocations, totals and the peak ring occupancy are printed out.
+// #define COMPACT_MEMORY_PROFILE
+
+// If defined, all CPU side buffers (framebuffers, spans, SPI task ring, ...) are carved out of a single arena of this many bytes
+// that is reserved and prefaulted at startup, backed by huge pages if some have been reserved in /proc/sys/vm/nr_hugepages, and
+// mlock()ed, so that the realtime path never takes page faults and needs fewer TLB entries. Allocations are 64-byte aligned, and
+// large buffers start at different cache line offsets so that buffers that are diffed against each other do not thrash the same
+// cache sets. Allocations that do not fit fall back to malloc(). A per-allocation report is printed at startup and exit.
+// #define MEMORY_ARENA_SIZE (16*1024*1024)
+
+// If defined, the run length encoded splash image in this file is sent to the display right after the display has been
+// initialized, while GPU capture is still initializing, and captured frames then take over from it without a blank frame
+// in between. This gets something on the display a lot sooner at boot. The time to first pixel is printed out. See splash.cpp
+// for the file format.
+// #define FAST_START_SPLASH "/etc/fbcp-splash.rle"
+
+// If the FAST_START_SPLASH file also has animation frames after the image, they are played as the boot animation on a thread of its
+// own while GPU capture initializes, with each frame only sending the rectangles that changed. If this is defined, the animation loops
+// until a connection is made to this Unix domain socket, after which captured frames take over. working/boot-animation.service makes
+// that connection when boot reaches the login prompt. If not defined, the animation is played through once.
+// #define BOOT_ANIMATION_HANDOFF_SOCKET "/run/fbcp-handoff.sock"
+
+// The settings in settings.h (target frame rate, interlacing and diff method) can be changed in this file at runtime, without
+// rebuilding. It is the same file that fbcp-ili9341.service loads as its EnvironmentFile, so it holds KEY=value lines.
+#define RUNTIME_CONFIG_FILE "/etc/fbcp-ili9341.conf"
+
+// If defined, fbcp listens for commands on this Unix domain socket: settings can be changed while running (set FBCP_DIFF=exact),
+// a full refresh of the display requested, and statistics counters and a trace of the most recent frames read out as JSON. See
+// control.cpp for the commands.
+// #define CONTROL_SOCKET "/run/fbcp-control.sock"
+
+// While no new frames arrive, the main loop still wakes up this often to answer commands on the control socket.
+#define CONTROL_SOCKET_POLL_INTERVAL_USECS 50000
+
 // If less than this much % of the screen changes per frame, the screen is considered to be inactive, and
 // the display backlight can automatically turn off, if TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY is 
 // defined.
@@ -0,0 +1,212 @@
+#include "config.h"
+#include "control.h"
+
+#ifdef CONTROL_SOCKET
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mem_alloc.h"
+#include "settings.h"
+#include "spi.h"
+#include "statistics.h"
+#include "tick.h"
+#include "update_strategy.h"
+#include "util.h"
+
+// Commands are lines of text, and each command gets a single line of JSON back:
+//   set KEY=value  Changes a setting in settings.h, e.g. "set FBCP_INTERLACING=never"
+//   refresh        Sends the whole next frame to the display
+//   stats          Returns the current settings and statistics counters
+//   trace          Returns the most recent frames sent to the display from the trace ring
+// e.g. echo stats | socat - UNIX-CONNECT:/run/fbcp-control.sock
+
+// Number of most recent frames kept in the trace ring
+#define CONTROL_TRACE_SIZE 256
+
+struct FrameTrace
+{
+  uint64_t time;
+  uint32_t bytesTransferred;
+  bool interlaced;
+};
+
+static FrameTrace frameTrace[CONTROL_TRACE_SIZE];
+static uint32_t numFramesTraced = 0;
+
+static int listenSocket = -1, clientSocket = -1;
+static char command[256];
+static int commandLength = 0;
+
+// Replies are built here and sent in one go. Large enough for the whole trace ring.
+static char reply[CONTROL_TRACE_SIZE*96 + 64];
+static int replyLength = 0;
+
+void TraceFrame(uint64_t time, int bytesTransferred, bool interlaced)
+{
+  FrameTrace &t = frameTrace[numFramesTraced++ % CONTROL_TRACE_SIZE];
+  t.time = time;
+  t.bytesTransferred = bytesTransferred;
+  t.interlaced = interlaced;
+}
+
+void OpenControlSocket()
+{
+  listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenSocket < 0) return;
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, CONTROL_SOCKET, sizeof(addr.sun_path) - 1);
+  unlink(addr.sun_path);
+  if (bind(listenSocket, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenSocket, 4) < 0)
+  {
+    printf("Failed to listen on control socket %s: %s\n", CONTROL_SOCKET, strerror(errno));
+    close(listenSocket);
+    listenSocket = -1;
+    return;
+  }
+  printf("Listening for commands on control socket %s\n", CONTROL_SOCKET);
+}
+
+void CloseControlSocket()
+{
+  if (clientSocket >= 0) close(clientSocket);
+  if (listenSocket >= 0)
+  {
+    close(listenSocket);
+    unlink(CONTROL_SOCKET);
+  }
+  clientSocket = listenSocket = -1;
+}
+
+static void Append(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(reply + replyLength, sizeof(reply) - replyLength, format, args);
+  va_end(args);
+  if (len > 0) replyLength += MIN(len, (int)sizeof(reply) - 1 - replyLength);
+}
+
+static void SendReply()
+{
+  Append("\n");
+  // The client may have gone away already, which must not raise SIGPIPE
+  if (send(clientSocket, reply, replyLength, MSG_NOSIGNAL) != replyLength)
+    printf("Control socket: failed to send a reply of %d bytes\n", replyLength);
+  replyLength = 0;
+}
+
+static void AppendStats()
+{
+  Append("{\"settings\":{\"FBCP_TARGET_FRAME_RATE\":%d,\"FBCP_INTERLACING\":\"%s\",\"FBCP_DIFF\":\"%s\",\"FBCP_UPDATE\":\"%s\","
+    "\"FBCP_SLEEP_UNTIL_TARGET_FRAME\":%d,\"FBCP_SLEEP_WHEN_IDLE\":%d,\"FBCP_PREDICT_FRAME_ARRIVAL_TIMES\":%d}",
+    settings.targetFrameRate, interlacingModeNames[settings.interlacing], diffMethodNames[settings.diffMethod], updateStrategyNames[settings.update],
+    settings.sleepUntilTargetFrame, settings.sleepWhenIdle, settings.predictFrameArrivalTimes);
+  // Estimated usecs per frame of each fixed update strategy, to compare them on the content being shown
+  Append(",\"adaptiveUpdateStrategy\":\"%s\",\"adaptiveUpdateStrategySwitches\":%u,\"updateCostUsecs\":{\"spans\":%.0f,\"rectangle\":%.0f,\"full\":%.0f}",
+    updateStrategyNames[adaptiveUpdateStrategy], numAdaptiveUpdateStrategySwitches, updateStrategyCostUsecs[UPDATE_SCANLINE_SPANS],
+    updateStrategyCostUsecs[UPDATE_SINGLE_RECTANGLE], updateStrategyCostUsecs[UPDATE_FULL_FRAME]);
+  Append(",\"framesSent\":%u,\"cpuMemoryAllocated\":%llu,\"spiQueueSize\":%u,\"spiQueuePeakOccupancy\":%u",
+    numFramesTraced, totalCpuMemoryAllocated, (uint32_t)SPI_QUEUE_SIZE, spiQueuePeakOccupancyBytes);
+#ifdef STATISTICS
+  Append(",\"bytesTransferred\":%llu,\"spiBusSpeed\":%.2f,\"spiThreadUtilization\":%.3f,\"spiBusDataRate\":%.0f,\"cpuTemperature\":%.1f,\"gpuPollingWasted\":%d,\"framesSkipped\":%d",
+    statsBytesTransferred, statsSpiBusSpeed, spiThreadUtilizationRate, spiBusDataRate, statsCpuTemperature, statsGpuPollingWasted, frameSkipTimeHistorySize);
+#endif
+  Append("}");
+}
+
+static void AppendTrace()
+{
+  // Oldest frame first, times relative to now so that they are easy to read.
+  const uint64_t now = tick();
+  const uint32_t numFrames = MIN(numFramesTraced, (uint32_t)CONTROL_TRACE_SIZE);
+  Append("[");
+  for(uint32_t i = numFramesTraced - numFrames; i < numFramesTraced; ++i)
+  {
+    const FrameTrace &t = frameTrace[i % CONTROL_TRACE_SIZE];
+    Append("%s{\"frame\":%u,\"usecsAgo\":%llu,\"bytes\":%u,\"interlaced\":%s}", i == numFramesTraced - numFrames ? "" : ",", i, now - t.time, t.bytesTransferred, t.interlaced ? "true" : "false");
+  }
+  Append("]");
+}
+
+// Runs a single command and replies to it, returns true if a full refresh was requested.
+static bool RunCommand(char *cmd)
+{
+  bool fullRefresh = false;
+  if (!strncmp(cmd, "set ", 4))
+  {
+    char *value = strchr(cmd + 4, '=');
+    if (value) *value++ = '\0';
+    if (value && ApplySetting(cmd + 4, value, "Control socket")) Append("{\"ok\":true}");
+    else Append("{\"ok\":false,\"error\":\"invalid setting\"}");
+  }
+  else if (!strcmp(cmd, "refresh"))
+  {
+    fullRefresh = true;
+    Append("{\"ok\":true}");
+  }
+  else if (!strcmp(cmd, "stats")) AppendStats();
+  else if (!strcmp(cmd, "trace")) AppendTrace();
+  else Append("{\"ok\":false,\"error\":\"unknown command\"}");
+  SendReply();
+  return fullRefresh;
+}
+
+bool PollControlSocket()
+{
+  if (listenSocket < 0) return false;
+  if (clientSocket < 0)
+  {
+    // Serve one client at a time, others wait in the listen backlog
+    clientSocket = accept4(listenSocket, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientSocket < 0) return false;
+    commandLength = 0;
+  }
+
+  bool fullRefresh = false;
+  for(;;)
+  {
+    ssize_t bytesRead = read(clientSocket, command + commandLength, sizeof(command) - 1 - commandLength);
+    if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (bytesRead <= 0)
+    {
+      close(clientSocket);
+      clientSocket = -1;
+      break;
+    }
+    commandLength += bytesRead;
+    command[commandLength] = '\0';
+
+    char *newline;
+    while((newline = strchr(command, '\n')))
+    {
+      *newline = '\0';
+      if (newline > command && newline[-1] == '\r') newline[-1] = '\0';
+      if (command[0]) fullRefresh = RunCommand(command) || fullRefresh;
+      commandLength -= newline + 1 - command;
+      memmove(command, newline + 1, commandLength + 1);
+    }
+    if (commandLength == sizeof(command) - 1)
+    {
+      Append("{\"ok\":false,\"error\":\"command too long\"}");
+      SendReply();
+      commandLength = 0;
+    }
+  }
+  return fullRefresh;
+}
+
+#else
+
+void OpenControlSocket() {}
+void CloseControlSocket() {}
+bool PollControlSocket() { return false; }
+void TraceFrame(uint64_t time, int bytesTransferred, bool interlaced) {}
+
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <inttypes.h>
+
+// All functions here are no-op when CONTROL_SOCKET is undef so they can be
+// called unconditionnaly.
+
+// Starts listening for connections on the control socket.
+void OpenControlSocket(void);
+void CloseControlSocket(void);
+
+// Runs the commands that have arrived on the control socket, without blocking.
+// Called by the main loop at frame boundaries, so that changed settings take
+// effect from the next frame on, and every CONTROL_SOCKET_POLL_INTERVAL_USECS
+// while it waits for new frames. Returns true if a full refresh of the display
+// was requested.
+bool PollControlSocket(void);
+
+// Records a frame that was sent to the display in the trace ring that the
+// "trace" command dumps.
+void TraceFrame(uint64_t time, int bytesTransferred, bool interlaced);
@@ -4,11 +4,11 @@
 #include "display.h"
 #include "gpu.h"
 #include "spi.h"
+#include "overlay.h"
 
 Span *spans = 0;
 
-#ifdef UPDATE_FRAMES_WITHOUT_DIFFING
-// Naive non-diffing functionality: just submit the whole display contents
+// Naive non-diffing functionality: just submit the whole display contents. Used for FBCP_UPDATE=full (UPDATE_FRAMES_WITHOUT_DIFFING), and for full refreshes.
 void NoDiffChangedRectangle(Span *&head)
 {
   head = spans;
@@ -19,9 +19,7 @@ void NoDiffChangedRectangle(Span *&head)
   head->size = gpuFrameWidth*gpuFrameHeight;
   head->next = 0;
 }
-#endif
 
-#ifdef UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF
 // Coarse diffing of two framebuffers with tight stride, 16 pixels at a time
 // Finds the first changed pixel, coarse result aligned down to 8 pixels boundary
 static int coarse_linear_diff(uint16_t *framebuffer, uint16_t *prevFramebuffer, uint16_t *framebufferEnd)
@@ -278,9 +276,9 @@ found_right:
   head->size = (head->endX-head->x)*(head->endY-head->y-1) + (head->lastScanEndX - head->x);
   head->next = 0;
 }
-#endif
 
-void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+template<bool interlacedDiff>
+static void DiffToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, int interlacedFieldParity, Span *&head)
 {
   int numSpans = 0;
   int y = interlacedDiff ? interlacedFieldParity : 0;
@@ -358,7 +356,8 @@ void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, ui
     head = 0;
 }
 
-void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+template<bool interlacedDiff>
+static void DiffToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, int interlacedFieldParity, Span *&head)
 {
   int numSpans = 0;
   int y = interlacedDiff ? interlacedFieldParity : 0;
@@ -449,6 +448,19 @@ void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevF
   }
 }
 
+// The diff loops are instantiated separately for progressive and interlaced updates, so that neither pays for the other in the inner loops.
+void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  if (interlacedDiff) DiffToScanlineSpansFastAndCoarse4Wide<true>(framebuffer, prevFramebuffer, interlacedFieldParity, head);
+  else DiffToScanlineSpansFastAndCoarse4Wide<false>(framebuffer, prevFramebuffer, interlacedFieldParity, head);
+}
+
+void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  if (interlacedDiff) DiffToScanlineSpansExact<true>(framebuffer, prevFramebuffer, interlacedFieldParity, head);
+  else DiffToScanlineSpansExact<false>(framebuffer, prevFramebuffer, interlacedFieldParity, head);
+}
+
 void MergeScanlineSpanList(Span *listHead)
 {
   for(Span *i = listHead; i; i = i->next)
@@ -488,3 +500,15 @@ void MergeScanlineSpanList(Span *listHead)
     }
   }
 }
+
+int MaxNumSpans()
+{
+#ifdef COMPACT_MEMORY_PROFILE
+  // Every span that the scanline diffs produce covers at least one changed pixel followed by more than SPAN_MERGE_THRESHOLD unchanged ones
+  // (at least two 4-pixel words in the coarse diff), except for the last span on each scanline. Merging only ever removes spans.
+  const int maxSpansPerScanline = gpuFrameWidth / MIN(SPAN_MERGE_THRESHOLD + 2, 8) + 1;
+  return gpuFrameHeight * maxSpansPerScanline + 2*MAX_OVERLAYS;
+#else
+  return gpuFrameWidth * gpuFrameHeight / 2;
+#endif
+}
@@ -2,15 +2,36 @@
 
 #include <inttypes.h>
 
+struct Span;
+extern Span *spans;
+
+#ifdef COMPACT_MEMORY_PROFILE
+// Link to a span, stored as a 16-bit index into the spans array instead of a full pointer. Reads and assigns like a Span pointer.
+struct SpanLink
+{
+  uint16_t index; // Index of the linked span plus one, or 0 for none
+  inline operator Span*() const;
+  inline SpanLink &operator=(Span *span);
+};
+#endif
+
 // Spans track dirty rectangular areas on screen
 struct Span
 {
   uint16_t x, endX, y, endY, lastScanEndX;
+#ifdef COMPACT_MEMORY_PROFILE
+  SpanLink next; // Fills the padding before size, so a span takes 16 bytes instead of 20
+#endif
   uint32_t size; // Specifies a box of width [x, endX[ * [y, endY[, where scanline endY-1 can be partial, and ends in lastScanEndX.
+#ifndef COMPACT_MEMORY_PROFILE
   Span *next; // Maintain a linked skip list inside the array for fast seek to next active element when pruning
+#endif
 };
 
-extern Span *spans;
+#ifdef COMPACT_MEMORY_PROFILE
+inline SpanLink::operator Span*() const { return index ? spans + index - 1 : 0; }
+inline SpanLink &SpanLink::operator=(Span *span) { index = span ? span - spans + 1 : 0; return *this; }
+#endif
 
 // Looking at SPI communication in a logic analyzer, it is observed that waiting for the finish of an SPI command FIFO causes pretty exactly one byte of delay to the command stream.
 // Therefore the time/bandwidth cost of ending the current span and starting a new span is as follows:
@@ -42,3 +63,6 @@ void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, ui
 void NoDiffChangedRectangle(Span *&head);
 
 void MergeScanlineSpanList(Span *listHead);
+
+// Returns the number of spans that the diff functions and overlays can produce for a single frame.
+int MaxNumSpans();
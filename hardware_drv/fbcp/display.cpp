@@ -1,6 +1,7 @@
 #include "config.h"
 #include "display.h"
 #include "spi.h"
+#include "util.h"
 
 #include <memory.h>
 
@@ -37,3 +38,52 @@ void ClearScreen()
 #endif
 }
 
+void ConvertToDisplayPixels(uint8_t *dst, const uint16_t *src, int numPixels)
+{
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+  for(int i = 0; i < numPixels; ++i, dst += 3)
+  {
+    uint16_t r = (src[i] >> 8) & 0xF8;
+    uint16_t g = (src[i] >> 3) & 0xFC;
+    uint16_t b = (src[i] << 3) & 0xF8;
+    dst[0] = r | (r >> 5);
+    dst[1] = g;
+    dst[2] = b | (b >> 5);
+  }
+#elif defined(DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER)
+  memcpy(dst, src, numPixels*sizeof(uint16_t)); // The display has been configured to take in little endian pixels
+#else
+  for(int i = 0; i < numPixels; ++i)
+    ((uint16_t*)dst)[i] = __builtin_bswap16(src[i]);
+#endif
+}
+
+void QueueDisplayRectangle(const uint16_t *src, int stride, int x, int y, int width, int height)
+{
+  if (width <= 0 || height <= 0) return;
+  int bytesTransferred = 0; // Counted by the QUEUE_* macros
+  QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_X, x, x + width - 1);
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+  for(int bandY = 0; bandY < height; bandY += DISPLAY_RECTANGLE_BAND_HEIGHT)
+  {
+    const int bandHeight = MIN(DISPLAY_RECTANGLE_BAND_HEIGHT, height - bandY);
+    QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, y + bandY, y + bandY + bandHeight - 1);
+    IN_SINGLE_THREADED_MODE_RUN_TASK();
+
+    SPITask *task = AllocTask(width*bandHeight*SPI_BYTESPERPIXEL);
+    task->cmd = DISPLAY_WRITE_PIXELS;
+    if (src)
+      for(int Y = bandY; Y < bandY + bandHeight; ++Y)
+        ConvertToDisplayPixels(task->data + (Y - bandY)*width*SPI_BYTESPERPIXEL, src + Y*stride, width);
+    else
+      memset(task->data, 0, width*bandHeight*SPI_BYTESPERPIXEL);
+#ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
+    // The pixels are already prepared in the task, so the DMA backend sends them as is.
+    task->fb = task->data;
+    task->prevFb = 0;
+    task->width = width;
+#endif
+    CommitTask(task);
+    IN_SINGLE_THREADED_MODE_RUN_TASK();
+  }
+}
@@ -2,6 +2,10 @@
 
 #include "config.h"
 
+#ifndef KERNEL_MODULE
+#include <inttypes.h>
+#endif
+
 // Configure the desired display update rate. Use 120 for max performance/minimized latency, and 60/50/30/24 etc. for regular content, or to save battery.
 #define TARGET_FRAME_RATE 60
 
@@ -98,8 +102,32 @@
 #define OFFLOAD_PIXEL_COPY_TO_DMA_CPP
 #endif
 
+#if defined(DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER)
+#if !defined(OFFLOAD_PIXEL_COPY_TO_DMA_CPP)
+#error DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER requires the conditions for OFFLOAD_PIXEL_COPY_TO_DMA_CPP above (single threaded ALL_TASKS_SHOULD_DMA build with USE_GPU_VSYNC)
+#endif
+#if !defined(DISPLAY_SUPPORTS_LITTLE_ENDIAN_PIXELS)
+#error DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER requires a display controller that can receive pixels in little endian byte order
+#endif
+#if !defined(NO_INTERLACING)
+// Swapping the framebuffers instead of copying the sent pixels over to the previous framebuffer is only correct if each frame is sent in full.
+#error DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER requires NO_INTERLACING
+#endif
+#endif
+
 void ClearScreen(void);
 
+// Converts CPU native R5G6B5 pixels to the pixel format that the display takes in over SPI.
+void ConvertToDisplayPixels(uint8_t *dst, const uint16_t *src, int numPixels);
+
+// QueueDisplayRectangle() sends rectangles out in bands of this many scanlines, so that the SPI thread can start sending before the whole
+// rectangle is queued.
+#define DISPLAY_RECTANGLE_BAND_HEIGHT 16
+
+// Queues the given rectangle of the display to be filled with the pixels at src, or with black if src is null. Stride is in pixels. The
+// write window of the display is left covering the last band of the rectangle.
+void QueueDisplayRectangle(const uint16_t *src, int stride, int x, int y, int width, int height);
+
 void TurnBacklightOn(void);
 void TurnBacklightOff(void);
 void TurnDisplayOn(void);
@@ -16,6 +16,10 @@
 
 #ifdef USE_DMA_TRANSFERS
 
+#if defined(DMA_CHAIN_WHOLE_FRAME) && !defined(ALL_TASKS_SHOULD_DMA)
+#error DMA_CHAIN_WHOLE_FRAME requires ALL_TASKS_SHOULD_DMA
+#endif
+
 #define BCM2835_PERI_BASE               0x3F000000
 
 SharedMemory *dmaSourceMemory = 0;
@@ -38,42 +42,131 @@ struct GpuMemory
   uint32_t sizeBytes;
 };
 
+#ifdef DMA_CHAIN_WHOLE_FRAME
+// A whole frame worth of spans is submitted as one DMA program, so reserve more control blocks to build it in.
+#define NUM_DMA_CBS 4096
+#else
 #define NUM_DMA_CBS 1024
+#endif
 GpuMemory dmaCb, dmaSourceBuffer, dmaConstantData;
 
+// The last control blocks of dmaCb are reserved for the completion fences of DMA programs in flight.
+#define MAX_DMA_PROGRAMS_IN_FLIGHT 16
+
+// Indices to the words in dmaConstantData
+#define DMA_CONSTANT_DISABLE_TRANSFER_ACTIVE 0
+#define DMA_CONSTANT_START_CHANNEL 1
+#define DMA_CONSTANT_DATA_CONTROL_PIN 2
+#define DMA_CONSTANT_COMPLETED_PROGRAM 3 // Written by the DMA engine: sequence number of the most recently finished DMA program
+#define DMA_CONSTANT_PROGRAM_SEQUENCE 4 // MAX_DMA_PROGRAMS_IN_FLIGHT words that the completion fences copy over to DMA_CONSTANT_COMPLETED_PROGRAM
+#define NUM_DMA_CONSTANTS (DMA_CONSTANT_PROGRAM_SEQUENCE + MAX_DMA_PROGRAMS_IN_FLIGHT)
+volatile uint32_t *dmaConstants = 0;
+
 volatile DMAControlBlock *dmaSendTail = 0;
 volatile DMAControlBlock *dmaRecvTail = 0;
-volatile DMAControlBlock *firstFreeCB = 0;
-volatile uint8_t *dmaSourceEnd = 0;
 
-volatile DMAControlBlock *GrabFreeCBs(int num)
+// Control blocks and DMA source bytes are handed out from two ring buffers. Each DMA program that is kicked off records how far into the
+// rings its data reaches, and the DMA engine writes the sequence number of the program to memory as its last step, so ring space can be
+// reclaimed one finished program at a time, instead of waiting for all DMA to finish whenever the end of a buffer is reached.
+struct DMARing
 {
-  volatile DMAControlBlock *firstCB = (volatile DMAControlBlock *)dmaCb.virtualAddr;
-  volatile DMAControlBlock *endCB = firstCB + NUM_DMA_CBS;
-  if ((uintptr_t)(firstFreeCB + num) >= (uintptr_t)dmaCb.virtualAddr + dmaCb.sizeBytes)
-  {
-    WaitForDMAFinished();
-    firstFreeCB = firstCB;
-  }
+  volatile uint8_t *begin, *end;
+  volatile uint8_t *head; // Next free byte
+  volatile uint8_t *tail; // Start of the oldest data that DMA may still be using. The ring is empty when head == tail.
+  volatile uint8_t *linkedEnd; // End of the data of the tasks that have been linked to a DMA program so far
+};
+DMARing cbRing, sourceRing;
 
-  volatile DMAControlBlock *ret = firstFreeCB;
-  firstFreeCB += num;
-  return ret;
+struct DMAProgram
+{
+  uint32_t sequence;
+  volatile uint8_t *cbEnd;
+  volatile uint8_t *sourceEnd;
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+  GpuMemory *framebuffer; // The framebuffer that the program reads pixels from, or null if it reads only from the source ring
+#endif
+};
+DMAProgram dmaProgramsInFlight[MAX_DMA_PROGRAMS_IN_FLIGHT];
+int numDmaProgramsInFlight = 0;
+uint32_t nextDmaProgramSequence = 1;
+
+static bool DMAProgramFinished(const DMAProgram &program)
+{
+  return (int32_t)(dmaConstants[DMA_CONSTANT_COMPLETED_PROGRAM] - program.sequence) >= 0; // Sequence numbers wrap around
 }
 
-volatile uint8_t *GrabFreeDMASourceBytes(int bytes)
+static void RetireFinishedDMAPrograms()
+{
+  int numFinished = 0;
+  while(numFinished < numDmaProgramsInFlight && DMAProgramFinished(dmaProgramsInFlight[numFinished])) ++numFinished;
+  if (numFinished == 0) return;
+
+  cbRing.tail = dmaProgramsInFlight[numFinished-1].cbEnd;
+  sourceRing.tail = dmaProgramsInFlight[numFinished-1].sourceEnd;
+  numDmaProgramsInFlight -= numFinished;
+  for(int i = 0; i < numDmaProgramsInFlight; ++i) dmaProgramsInFlight[i] = dmaProgramsInFlight[i+numFinished];
+}
+
+// Marks all data allocated from the rings so far to belong to the DMA program that is being built.
+static void LinkAllocatedDMAData()
+{
+  cbRing.linkedEnd = cbRing.head;
+  sourceRing.linkedEnd = sourceRing.head;
+}
+
+static void WaitForOldestDMAProgram();
+
+// A chain of DMA control blocks that performs one or more back to back SPI transfers.
+struct DMASPIChain
+{
+  volatile DMAControlBlock *tx0; // Control blocks to start the TX and RX channels at
+  volatile DMAControlBlock *rx0;
+  volatile DMAControlBlock *rxTail; // Last RX control block of the chain, further transfers are linked after it
+  int numBytes; // Total number of bytes that the chain sends out
+};
+
+#ifdef DMA_CHAIN_WHOLE_FRAME
+// All the tasks of the current frame, linked together, waiting to be kicked off by SubmitDMAFrame()
+DMASPIChain dmaFrame = {};
+#endif
+
+static volatile uint8_t *GrabFromRing(DMARing &ring, uint32_t bytes)
 {
-  if ((uintptr_t)dmaSourceEnd + bytes >= (uintptr_t)dmaSourceBuffer.virtualAddr + dmaSourceBuffer.sizeBytes)
+  if (bytes >= (uint32_t)(ring.end - ring.begin)) FATAL_ERROR("DMA task does not fit in DMA ring buffer!");
+  for(;;)
   {
-    WaitForDMAFinished();
-    dmaSourceEnd = (volatile uint8_t *)dmaSourceBuffer.virtualAddr;
+    RetireFinishedDMAPrograms();
+    if (ring.head == ring.tail) ring.head = ring.tail = ring.linkedEnd = ring.begin;
+
+    if (ring.head >= ring.tail)
+    {
+      if (ring.head + bytes <= ring.end) break;
+      if (ring.begin + bytes < ring.tail) // Wrap around, leaving the end of the ring unused for this round
+      {
+        ring.head = ring.begin;
+        break;
+      }
+    }
+    else if (ring.head + bytes < ring.tail) break;
+
+    WaitForOldestDMAProgram();
   }
 
-  volatile uint8_t *ret = dmaSourceEnd;
-  dmaSourceEnd += bytes;
+  volatile uint8_t *ret = ring.head;
+  ring.head += bytes;
   return ret;
 }
 
+volatile DMAControlBlock *GrabFreeCBs(int num)
+{
+  return (volatile DMAControlBlock *)GrabFromRing(cbRing, num*sizeof(DMAControlBlock));
+}
+
+volatile uint8_t *GrabFreeDMASourceBytes(int bytes)
+{
+  return GrabFromRing(sourceRing, ALIGN_UP(bytes, 4));
+}
+
 static int AllocateDMAChannel(int *dmaChannel, int *irq)
 {
   // Snooping DMA, channels 3, 5 and 6 seen active.
@@ -155,6 +248,57 @@ void FreeUncachedGpuMemory(GpuMemory mem)
   Mailbox(MEM_FREE_MESSAGE, mem.allocationHandle);
 }
 
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+
+// Current and previous framebuffer
+#define MAX_DMA_FRAMEBUFFERS 2
+GpuMemory dmaFramebuffers[MAX_DMA_FRAMEBUFFERS];
+int numDmaFramebuffers = 0;
+
+// The framebuffer that the DMA program being built reads pixels from, or null if none of its tasks read from a framebuffer. Handed over to
+// the DMAProgram that tracks it when the program is kicked off.
+static GpuMemory *dmaFramebufferLinked = 0;
+
+// Full DMA channels can walk a 2D rectangle in a single control block, but lite channels lack TDMODE and need one control block per scanline.
+static bool dmaTxSupports2DMode = false;
+
+void *AllocateDMAFramebuffer(uint32_t numBytes, const char *reason)
+{
+  if (numDmaFramebuffers >= MAX_DMA_FRAMEBUFFERS) FATAL_ERROR("Too many DMA framebuffers allocated!");
+  dmaFramebuffers[numDmaFramebuffers] = AllocateUncachedGpuMemory(numBytes, reason);
+  return dmaFramebuffers[numDmaFramebuffers++].virtualAddr;
+}
+
+static GpuMemory *FindDMAFramebuffer(const void *ptr)
+{
+  for(int i = 0; i < numDmaFramebuffers; ++i)
+    if ((uintptr_t)ptr >= (uintptr_t)dmaFramebuffers[i].virtualAddr && (uintptr_t)ptr < (uintptr_t)dmaFramebuffers[i].virtualAddr + dmaFramebuffers[i].sizeBytes)
+      return &dmaFramebuffers[i];
+  return 0;
+}
+
+static bool DMAProgramsInFlightReadFramebuffer(const GpuMemory *framebuffer)
+{
+  RetireFinishedDMAPrograms();
+  for(int i = 0; i < numDmaProgramsInFlight; ++i)
+    if (dmaProgramsInFlight[i].framebuffer == framebuffer) return true;
+  return false;
+}
+
+void WaitForDMAToStopReadingFramebuffer(const void *framebuffer)
+{
+  GpuMemory *mem = FindDMAFramebuffer(framebuffer);
+  if (!mem) return;
+#ifdef DMA_CHAIN_WHOLE_FRAME
+  if (dmaFramebufferLinked == mem) SubmitDMAFrame(); // A frame that is still being built cannot be waited on, send it off first
+#endif
+  // Programs finish in the order they were kicked off, so retire them from the oldest until none of the remaining ones reads the framebuffer.
+  while(DMAProgramsInFlightReadFramebuffer(mem))
+    WaitForOldestDMAProgram();
+}
+
+#endif
+
 volatile DMAChannelRegisterFile *GetDMAChannel(int channelNumber)
 {
   if (channelNumber < 0 || channelNumber >= BCM2835_NUM_DMA_CHANNELS)
@@ -236,15 +380,28 @@ int InitDMA()
 #if !defined(KERNEL_MODULE)
   dmaCb = AllocateUncachedGpuMemory(sizeof(DMAControlBlock) * NUM_DMA_CBS, "DMA control blocks");
   memset(dmaCb.virtualAddr, 0, dmaCb.sizeBytes); // Some fields of the CBs (debug, reserved) are initialized to zero and assumed to stay so throughout app lifetime.
-  firstFreeCB = (volatile DMAControlBlock *)dmaCb.virtualAddr;
+  cbRing.begin = cbRing.head = cbRing.tail = cbRing.linkedEnd = (volatile uint8_t *)dmaCb.virtualAddr;
+  cbRing.end = cbRing.begin + (NUM_DMA_CBS - MAX_DMA_PROGRAMS_IN_FLIGHT) * sizeof(DMAControlBlock);
 
+#ifdef COMPACT_MEMORY_PROFILE
+  // A DMA program stages at most one task's payload of MAX_SPI_TASK_SIZE bytes here (with ALL_TASKS_SHOULD_DMA only control words), so the size
+  // of the task ring is plenty.
+  dmaSourceBuffer = AllocateUncachedGpuMemory(SHARED_MEMORY_SIZE, "DMA source data");
+#else
   dmaSourceBuffer = AllocateUncachedGpuMemory(SHARED_MEMORY_SIZE*2, "DMA source data");
-  dmaSourceEnd = (volatile uint8_t *)dmaSourceBuffer.virtualAddr;
-
-  dmaConstantData = AllocateUncachedGpuMemory(2*sizeof(uint32_t), "DMA constant data");
-  uint32_t *constantData = (uint32_t *)dmaConstantData.virtualAddr;
-  constantData[0] = BCM2835_SPI0_CS_DMAEN; // constantData[0] is for disableTransferActive task
-  constantData[1] = BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END; // constantData[1] is for startDMATxChannel task
+#endif
+  sourceRing.begin = sourceRing.head = sourceRing.tail = sourceRing.linkedEnd = (volatile uint8_t *)dmaSourceBuffer.virtualAddr;
+  sourceRing.end = sourceRing.begin + dmaSourceBuffer.sizeBytes;
+
+  dmaConstantData = AllocateUncachedGpuMemory(NUM_DMA_CONSTANTS*sizeof(uint32_t), "DMA constant data");
+  dmaConstants = (volatile uint32_t *)dmaConstantData.virtualAddr;
+  // For disableTransferActive task. Also clears the SPI FIFOs of any padding bytes that the last 32-bit word of the previous transfer pushed in.
+  dmaConstants[DMA_CONSTANT_DISABLE_TRANSFER_ACTIVE] = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_CLEAR;
+  dmaConstants[DMA_CONSTANT_START_CHANNEL] = BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END; // For startDMATxChannel task
+#if defined(GPIO_TFT_DATA_CONTROL) && GPIO_TFT_DATA_CONTROL >= 0
+  dmaConstants[DMA_CONSTANT_DATA_CONTROL_PIN] = 1 << GPIO_TFT_DATA_CONTROL; // For toggling the Data/Control line between SPI transfers
+#endif
+  dmaConstants[DMA_CONSTANT_COMPLETED_PROGRAM] = 0;
 #endif
 
   LOG("DMA hardware register file is at ptr: %p, using DMA TX channel: %d and DMA RX channel: %d", dma0, dmaTxChannel, dmaRxChannel);
@@ -276,6 +433,12 @@ int InitDMA()
   if ((dmaRx->cb.debug & BCM2835_DMA_DEBUG_LITE) != 0)
     FATAL_ERROR("DMA RX channel cannot be a lite channel, because to get best performance we want to use BCM2835_DMA_TI_DEST_IGNORE DMA operation mode that lite DMA channels do not have. (Try using DMA RX channel value < 7)");
 
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+  dmaTxSupports2DMode = (dmaTx->cb.debug & BCM2835_DMA_DEBUG_LITE) == 0;
+  if (!dmaTxSupports2DMode)
+    LOG("DMA TX channel %d is a lite channel without 2D mode, framebuffer rectangles will be read one scanline per DMA control block. (Try using DMA TX channel value < 7)", dmaTxChannel);
+#endif
+
   LOG("Resetting DMA channels for use");
   ResetDMAChannels();
 
@@ -369,6 +532,9 @@ extern volatile bool programRunning;
 
 void WaitForDMAFinished()
 {
+#ifdef DMA_CHAIN_WHOLE_FRAME
+  SubmitDMAFrame(); // If a frame is still being built, send it off first, or there would be nothing to wait for.
+#endif
   int spins = 0;
   uint64_t t0 = tick();
   while((dmaTx->cs & BCM2835_DMA_CS_ACTIVE) && programRunning)
@@ -395,6 +561,39 @@ void WaitForDMAFinished()
   }
   dmaSendTail = 0;
   dmaRecvTail = 0;
+
+  // All DMA programs have now finished, so all ring space can be reclaimed.
+  numDmaProgramsInFlight = 0;
+  cbRing.tail = cbRing.linkedEnd;
+  sourceRing.tail = sourceRing.linkedEnd;
+}
+
+static void WaitForOldestDMAProgram()
+{
+  if (numDmaProgramsInFlight == 0)
+  {
+#ifdef DMA_CHAIN_WHOLE_FRAME
+    // The frame being built has filled up the rings, so kick off what has been built so far to be able to reclaim space.
+    if (dmaFrame.numBytes > 0)
+    {
+      SubmitDMAFrame();
+      return;
+    }
+#endif
+    FATAL_ERROR("DMA ring buffer exhausted!");
+  }
+
+  uint64_t t0 = tick();
+  while(!DMAProgramFinished(dmaProgramsInFlight[0]))
+  {
+    usleep(100);
+    if (tick() - t0 > 2000000)
+    {
+      DumpDMAState();
+      FATAL_ERROR("DMA program has stalled!");
+    }
+  }
+  RetireFinishedDMAPrograms();
 }
 
 #ifdef ALL_TASKS_SHOULD_DMA
@@ -458,25 +657,34 @@ static void memcpy_to_dma_and_prev_framebuffer(uint16_t *dstDma, uint16_t **dstP
 
 static void memcpy_to_dma_and_prev_framebuffer_in_c(uint16_t *dstDma, uint16_t **dstPrevFramebuffer, uint16_t **srcFramebuffer, int numBytes, int *taskStartX, int width, int stride)
 {
+#ifndef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER // In that mode, this is only a fallback for the occasional misaligned span
   static bool performanceWarningPrinted = false;
   if (!performanceWarningPrinted)
   {
     printf("Performance warning: using slow memcpy_to_dma_and_prev_framebuffer_in_c() function. Check conditions in display.h that enable OFFLOAD_PIXEL_COPY_TO_DMA_CPP and configure to use that instead.\n");
     performanceWarningPrinted = true;
   }
+#endif
   int numPixels = numBytes>>1;
   int endStridePixels = (stride>>1) - width;
   uint16_t *prevData = *dstPrevFramebuffer;
   uint16_t *data = *srcFramebuffer;
   for(int i = 0; i < numPixels; ++i)
   {
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+    // The previous frame is kept by swapping framebuffers, not by copying, and DMA may still be streaming out of prevData, so leave it be.
+    dstDma[i] = *data++; // Display has been configured to receive little endian pixels.
+#else
     *prevData++ = *data;
     dstDma[i] = __builtin_bswap16(*data++);
+#endif
     if (++*taskStartX >= width)
     {
       *taskStartX = 0;
       data += endStridePixels;
+#ifndef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
       prevData += endStridePixels;
+#endif
     }
   }
   *srcFramebuffer = data;
@@ -494,13 +702,55 @@ static void memcpy_to_dma_and_prev_framebuffer_in_c(uint16_t *dstDma, uint16_t *
 #error OFFLOAD_PIXEL_COPY_TO_DMA_CPP and SPI_3WIRE_PROTOCOL are not mutually compatible!
 #endif
 
-void SPIDMATransfer(SPITask *task)
-{
 // There is a limit to how many bytes can be sent in one DMA-based SPI task, so if the task
 // is larger than this, we'll split the send into multiple individual DMA SPI transfers
 // and chain them together. This should be a multiple of 32 bytes to keep tasks cache aligned on ARMv6.
 #define MAX_DMA_SPI_TASK_SIZE 65504
 
+// Chains the SPI transfer starting at DMA control blocks tx & rx to run after the transfer that ends in rxTail: when the RX channel finishes the previous
+// transfer, it points the TX channel to the new TX control block, resets the SPI transfer active bit and restarts the TX channel. Consumes three control blocks at cb.
+static void ChainDMASPITransfer(volatile DMAControlBlock *rxTail, volatile DMAControlBlock *tx, volatile DMAControlBlock *rx, volatile DMAControlBlock *cb, volatile uint32_t *setDMATxAddressData)
+{
+  volatile DMAControlBlock *setDMATxAddress = cb++;
+  volatile DMAControlBlock *disableTransferActive = cb++;
+  volatile DMAControlBlock *startDMATxChannel = cb++;
+
+  rxTail->next = VIRT_TO_BUS(dmaCb, setDMATxAddress);
+
+  setDMATxAddressData[0] = VIRT_TO_BUS(dmaCb, tx);
+  setDMATxAddress->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
+  setDMATxAddress->src = VIRT_TO_BUS(dmaSourceBuffer, setDMATxAddressData);
+  setDMATxAddress->dst = DMA_DMA0_CB_PHYS_ADDRESS + dmaTxChannel*0x100 + 4;
+  setDMATxAddress->len = 4;
+  setDMATxAddress->next = VIRT_TO_BUS(dmaCb, disableTransferActive);
+
+  disableTransferActive->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
+  disableTransferActive->src = dmaConstantData.busAddress + 4*DMA_CONSTANT_DISABLE_TRANSFER_ACTIVE;
+  disableTransferActive->dst = DMA_SPI_CS_PHYS_ADDRESS;
+  disableTransferActive->len = 4;
+  disableTransferActive->next = VIRT_TO_BUS(dmaCb, startDMATxChannel);
+
+  startDMATxChannel->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
+  startDMATxChannel->src = dmaConstantData.busAddress + 4*DMA_CONSTANT_START_CHANNEL;
+  startDMATxChannel->dst = DMA_DMA0_CB_PHYS_ADDRESS + dmaTxChannel*0x100;
+  startDMATxChannel->len = 4;
+  startDMATxChannel->next = VIRT_TO_BUS(dmaCb, rx);
+}
+
+static volatile DMAControlBlock *CreateSPIRxControlBlock(volatile DMAControlBlock *rx, int sendSize)
+{
+  rx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_RX) | BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_DEST_IGNORE;
+  rx->src = DMA_SPI_FIFO_PHYS_ADDRESS;
+  rx->dst = 0;
+  rx->len = sendSize;
+  rx->stride = 0;
+  rx->next = 0;
+  return rx;
+}
+
+// Builds the DMA control block chain for a task by copying its pixels over to the DMA source buffer.
+static void BuildDMATransferFromSourceBuffer(SPITask *task, DMASPIChain &chain)
+{
   const int numDMASendTasks = (task->PayloadSize() + MAX_DMA_SPI_TASK_SIZE - 1) / MAX_DMA_SPI_TASK_SIZE;
 
   volatile uint32_t *dmaData = (volatile uint32_t *)GrabFreeDMASourceBytes(4*(numDMASendTasks-1)+4*numDMASendTasks+task->PayloadSize());
@@ -510,13 +760,17 @@ void SPIDMATransfer(SPITask *task)
   volatile DMAControlBlock *cb = GrabFreeCBs(numDMASendTasks*5-3);
 
   volatile DMAControlBlock *rxTail = 0;
-  volatile DMAControlBlock *tx0 = &cb[0];
-  volatile DMAControlBlock *rx0 = &cb[1];
+  chain.tx0 = &cb[0];
+  chain.rx0 = &cb[1];
 
 #ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
   uint8_t *data = task->fb;
   uint8_t *prevData = task->prevFb;
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+  const bool taskAndFramebufferSizesCompatibleWithTightMemcpy = false; // The tight memcpy byte swaps, but the display has been configured to take in little endian pixels.
+#else
   const bool taskAndFramebufferSizesCompatibleWithTightMemcpy = (task->PayloadSize() % 32 == 0) && (task->width % 16 == 0);
+#endif
 #else
   uint8_t *data = task->PayloadStart();
 #endif
@@ -561,48 +815,138 @@ void SPIDMATransfer(SPITask *task)
     tx->src = VIRT_TO_BUS(dmaSourceBuffer, txData);
     tx->dst = DMA_SPI_FIFO_PHYS_ADDRESS; // Write out to the SPI peripheral
     tx->len = 4+sendSize;
+    tx->stride = 0;
     tx->next = 0;
     txData += 1+sendSize/4;
 
-    volatile DMAControlBlock *rx = cb++;
-    rx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_RX) | BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_DEST_IGNORE;
-    rx->src = DMA_SPI_FIFO_PHYS_ADDRESS;
-    rx->dst = 0;
-    rx->len = sendSize;
-    rx->next = 0;
+    volatile DMAControlBlock *rx = CreateSPIRxControlBlock(cb++, sendSize);
 
     if (rxTail)
     {
-      volatile DMAControlBlock *setDMATxAddress = cb++;
-      volatile DMAControlBlock *disableTransferActive = cb++;
-      volatile DMAControlBlock *startDMATxChannel = cb++;
-
-      rxTail->next = VIRT_TO_BUS(dmaCb, setDMATxAddress);
-
-      setDMATxAddressData[0] = VIRT_TO_BUS(dmaCb, tx);
-      setDMATxAddress->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
-      setDMATxAddress->src = VIRT_TO_BUS(dmaSourceBuffer, setDMATxAddressData);
-      setDMATxAddress->dst = DMA_DMA0_CB_PHYS_ADDRESS + dmaTxChannel*0x100 + 4;
-      setDMATxAddress->len = 4;
-      setDMATxAddress->next = VIRT_TO_BUS(dmaCb, disableTransferActive);
-      ++setDMATxAddressData;
-
-      disableTransferActive->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
-      disableTransferActive->src = dmaConstantData.busAddress;
-      disableTransferActive->dst = DMA_SPI_CS_PHYS_ADDRESS;
-      disableTransferActive->len = 4;
-      disableTransferActive->next = VIRT_TO_BUS(dmaCb, startDMATxChannel);
-
-      startDMATxChannel->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
-      startDMATxChannel->src = dmaConstantData.busAddress+4;
-      startDMATxChannel->dst = DMA_DMA0_CB_PHYS_ADDRESS + dmaTxChannel*0x100;
-      startDMATxChannel->len = 4;
-      startDMATxChannel->next = VIRT_TO_BUS(dmaCb, rx);
+      ChainDMASPITransfer(rxTail, tx, rx, cb, setDMATxAddressData++);
+      cb += 3;
+    }
+    rxTail = rx;
+  }
+  chain.rxTail = rxTail;
+  chain.numBytes = task->PayloadSize();
+}
+
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+
+// The DMA engine feeds the SPI FIFO 32 bits at a time, so each run of pixels that a control block reads must start at a 4-byte aligned address and be
+// a multiple of 4 bytes long, or padding bytes would get injected to the pixel stream at scanline boundaries.
+static bool TaskCanBeReadDirectlyFromFramebuffer(SPITask *task)
+{
+  const int rowBytes = task->width * SPI_BYTESPERPIXEL;
+  const int lastRowBytes = task->PayloadSize() % rowBytes;
+  return FindDMAFramebuffer(task->fb) && (uintptr_t)task->fb % 4 == 0 && rowBytes % 4 == 0 && lastRowBytes % 4 == 0 && gpuFramebufferScanlineStrideBytes % 4 == 0;
+}
+
+// Appends a TX control block that reads numRows scanlines of rowBytes each from the framebuffer at bus address src, and returns it.
+static volatile DMAControlBlock *ReadFramebufferRows(volatile DMAControlBlock *txTail, volatile DMAControlBlock *tx, uint32_t src, int rowBytes, int numRows)
+{
+  tx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
+  tx->src = src;
+  tx->dst = DMA_SPI_FIFO_PHYS_ADDRESS;
+  if (numRows > 1 && rowBytes != gpuFramebufferScanlineStrideBytes)
+  {
+    // In 2D mode, the engine performs YLENGTH+1 transfers of XLENGTH bytes each, and adds S_STRIDE (signed 16-bit) to the source address after each of them.
+    tx->ti |= BCM2835_DMA_TI_TDMODE;
+    tx->len = ((numRows-1) << 16) | rowBytes;
+    tx->stride = (uint16_t)(gpuFramebufferScanlineStrideBytes - rowBytes);
+  }
+  else
+  {
+    tx->len = numRows * rowBytes; // Full width scanlines are back to back in memory, so they can be read as one linear run.
+    tx->stride = 0;
+  }
+  tx->next = 0;
+  txTail->next = VIRT_TO_BUS(dmaCb, tx);
+  return tx;
+}
+
+// Builds the DMA control block chain for a pixel task so that the DMA engine reads the pixels directly from the framebuffer, without the CPU touching them.
+// Each SPI transfer consists of a DLEN header control block, followed by control blocks that walk the rectangle of pixels in the framebuffer.
+static void BuildDMATransferFromFramebuffer(SPITask *task, DMASPIChain &chain)
+{
+  GpuMemory *framebuffer = FindDMAFramebuffer(task->fb);
+  const int rowBytes = task->width * SPI_BYTESPERPIXEL;
+  const int numFullRows = task->PayloadSize() / rowBytes;
+  const int lastRowBytes = task->PayloadSize() % rowBytes;
+  const int rowsPerSendTask = MAX_DMA_SPI_TASK_SIZE / rowBytes;
+  const int maxDMASendTasks = numFullRows / rowsPerSendTask + 2;
+
+  volatile uint32_t *dmaData = (volatile uint32_t *)GrabFreeDMASourceBytes(8*maxDMASendTasks);
+  volatile uint32_t *setDMATxAddressData = dmaData;
+  volatile uint32_t *txData = dmaData+maxDMASendTasks;
+
+  // Each send task takes a header, rx and three chaining control blocks, plus at most one control block per scanline.
+  volatile DMAControlBlock *cb = GrabFreeCBs(maxDMASendTasks*6 + numFullRows);
+
+  volatile DMAControlBlock *rxTail = 0;
+  chain.tx0 = &cb[0];
+
+  uint32_t src = VIRT_TO_BUS(*framebuffer, task->fb);
+  int rowsLeft = numFullRows;
+  bool lastRowLeft = (lastRowBytes > 0);
+
+  while(rowsLeft > 0 || lastRowLeft)
+  {
+    const int numRows = MIN(rowsLeft, rowsPerSendTask);
+    rowsLeft -= numRows;
+    int sendSize = numRows * rowBytes;
+    const bool sendLastRow = lastRowLeft && rowsLeft == 0 && sendSize + lastRowBytes <= MAX_DMA_SPI_TASK_SIZE;
+    if (sendLastRow)
+    {
+      sendSize += lastRowBytes;
+      lastRowLeft = false;
+    }
 
+    volatile DMAControlBlock *tx = cb++;
+    txData[0] = BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS | (sendSize << 16);
+    tx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
+    tx->src = VIRT_TO_BUS(dmaSourceBuffer, txData);
+    tx->dst = DMA_SPI_FIFO_PHYS_ADDRESS;
+    tx->len = 4;
+    tx->stride = 0;
+    tx->next = 0;
+    ++txData;
+
+    volatile DMAControlBlock *txTail = tx;
+    if (numRows > 0)
+    {
+      if (dmaTxSupports2DMode)
+        txTail = ReadFramebufferRows(txTail, cb++, src, rowBytes, numRows);
+      else
+        for(int y = 0; y < numRows; ++y)
+          txTail = ReadFramebufferRows(txTail, cb++, src + y * gpuFramebufferScanlineStrideBytes, rowBytes, 1);
+      src += numRows * gpuFramebufferScanlineStrideBytes;
+    }
+    if (sendLastRow)
+      txTail = ReadFramebufferRows(txTail, cb++, src, lastRowBytes, 1);
+
+    volatile DMAControlBlock *rx = CreateSPIRxControlBlock(cb++, sendSize);
+    if (rxTail)
+    {
+      ChainDMASPITransfer(rxTail, tx, rx, cb, setDMATxAddressData++);
+      cb += 3;
     }
+    else
+      chain.rx0 = rx;
     rxTail = rx;
   }
+  chain.rxTail = rxTail;
+  chain.numBytes = task->PayloadSize();
+  dmaFramebufferLinked = framebuffer;
+}
+
+#endif
 
+// Kicks off the given DMA program once the DMA channels have finished running the previous one. If cmd >= 0, that command byte is first sent
+// in Polled SPI mode, and the program sends the data payload for it. Otherwise the program starts by sending a command byte itself.
+static void KickOffDMAProgram(DMASPIChain &program, int cmd)
+{
   static uint64_t taskStartTime = 0;
   static int pendingTaskBytes = 1;
   double pendingTaskUSecs = pendingTaskBytes * spiUsecsPerByte;
@@ -635,38 +979,165 @@ void SPIDMATransfer(SPITask *task)
   }
   if (!programRunning) return;
 
-  pendingTaskBytes = task->PayloadSize();
+  // The previous program has now finished, so it can be retired, and the new one tracked in its place. The program owns all ring data
+  // linked so far. The completion fence is the last control block on the RX channel, since RX finishes only after the last byte has gone
+  // out on the bus.
+  RetireFinishedDMAPrograms();
+  if (numDmaProgramsInFlight >= MAX_DMA_PROGRAMS_IN_FLIGHT) WaitForOldestDMAProgram();
+  DMAProgram &tracked = dmaProgramsInFlight[numDmaProgramsInFlight++];
+  tracked.sequence = nextDmaProgramSequence++;
+  tracked.cbEnd = cbRing.linkedEnd;
+  tracked.sourceEnd = sourceRing.linkedEnd;
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+  tracked.framebuffer = dmaFramebufferLinked;
+  dmaFramebufferLinked = 0;
+#endif
+
+  const int fenceIndex = tracked.sequence % MAX_DMA_PROGRAMS_IN_FLIGHT;
+  dmaConstants[DMA_CONSTANT_PROGRAM_SEQUENCE + fenceIndex] = tracked.sequence;
+  volatile DMAControlBlock *fence = (volatile DMAControlBlock *)cbRing.end + fenceIndex;
+  fence->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
+  fence->src = dmaConstantData.busAddress + 4*(DMA_CONSTANT_PROGRAM_SEQUENCE + fenceIndex);
+  fence->dst = dmaConstantData.busAddress + 4*DMA_CONSTANT_COMPLETED_PROGRAM;
+  fence->len = 4;
+  fence->stride = 0;
+  fence->next = 0;
+  program.rxTail->next = VIRT_TO_BUS(dmaCb, fence);
 
-  // First send the SPI command byte in Polled SPI mode
-  spi->cs = BCM2835_SPI0_CS_TA | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
+  pendingTaskBytes = program.numBytes;
+
+  if (cmd >= 0)
+  {
+    // First send the SPI command byte in Polled SPI mode
+    spi->cs = BCM2835_SPI0_CS_TA | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
 
 #ifndef SPI_3WIRE_PROTOCOL
-  CLEAR_GPIO(GPIO_TFT_DATA_CONTROL);
+    CLEAR_GPIO(GPIO_TFT_DATA_CONTROL);
 #ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
-  spi->fifo = 0;
-  spi->fifo = task->cmd;
-  while(!(spi->cs & (BCM2835_SPI0_CS_DONE))) /*nop*/;
-  // spi->fifo; // Currently no need to flush these, the clear below clears the rx queue.
-  // spi->fifo;
+    spi->fifo = 0;
+    spi->fifo = cmd;
+    while(!(spi->cs & (BCM2835_SPI0_CS_DONE))) /*nop*/;
+    // spi->fifo; // Currently no need to flush these, the clear below clears the rx queue.
+    // spi->fifo;
 #else
-  spi->fifo = task->cmd;
-  while(!(spi->cs & (BCM2835_SPI0_CS_RXD|BCM2835_SPI0_CS_DONE))) /*nop*/;
-  // spi->fifo; // Currently no need to flush this, the clear below clears the rx queue.
+    spi->fifo = cmd;
+    while(!(spi->cs & (BCM2835_SPI0_CS_RXD|BCM2835_SPI0_CS_DONE))) /*nop*/;
+    // spi->fifo; // Currently no need to flush this, the clear below clears the rx queue.
 #endif
 
-  SET_GPIO(GPIO_TFT_DATA_CONTROL);
+    SET_GPIO(GPIO_TFT_DATA_CONTROL);
+#endif
+  }
+#ifndef SPI_3WIRE_PROTOCOL
+  else
+    CLEAR_GPIO(GPIO_TFT_DATA_CONTROL); // The program starts with a command transfer
 #endif
 
   spi->cs = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
 
-  dmaTx->cbAddr = VIRT_TO_BUS(dmaCb, tx0);
-  dmaRx->cbAddr = VIRT_TO_BUS(dmaCb, rx0);
+  dmaTx->cbAddr = VIRT_TO_BUS(dmaCb, program.tx0);
+  dmaRx->cbAddr = VIRT_TO_BUS(dmaCb, program.rx0);
   __sync_synchronize();
   dmaTx->cs = BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END;
   dmaRx->cs = BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END;
   taskStartTime = tick();
 }
 
+#ifdef DMA_CHAIN_WHOLE_FRAME
+
+#if defined(USE_SPI_THREAD) || defined(SPI_3WIRE_PROTOCOL) || defined(KERNEL_MODULE_CLIENT)
+#error DMA_CHAIN_WHOLE_FRAME requires a single threaded build driving a 4-wire SPI display from userland
+#endif
+
+// Appends a DMA control block on the RX channel that sets or clears the Data/Control GPIO line, and returns it.
+static volatile DMAControlBlock *WriteDataControlLine(volatile DMAControlBlock *rxTail, volatile DMAControlBlock *cb, bool data)
+{
+  cb->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
+  cb->src = dmaConstantData.busAddress + 4*DMA_CONSTANT_DATA_CONTROL_PIN;
+  cb->dst = data ? DMA_GPIO_SET_PHYS_ADDRESS : DMA_GPIO_CLEAR_PHYS_ADDRESS;
+  cb->len = 4;
+  cb->stride = 0;
+  cb->next = 0;
+  rxTail->next = VIRT_TO_BUS(dmaCb, cb);
+  return cb;
+}
+
+// Appends the given task to the DMA program of the current frame: the command byte is sent as its own SPI transfer with Data/Control line low,
+// after which the line is raised and the payload transfers follow. The GPIO writes are done on the RX channel, since RX is the one that
+// finishes only after the preceding bytes have fully gone out on the bus.
+static void AppendTaskToDMAFrame(SPITask *task, DMASPIChain &payload)
+{
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+  const int cmdSize = 2;
+  const uint32_t cmdWord = task->cmd << 8; // All commands are 16-bit, with the MSB byte zero
+#else
+  const int cmdSize = 1;
+  const uint32_t cmdWord = task->cmd;
+#endif
+  volatile uint32_t *dmaData = (volatile uint32_t *)GrabFreeDMASourceBytes(4*4);
+  volatile DMAControlBlock *cb = GrabFreeCBs(10);
+
+  dmaData[0] = BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS | (cmdSize << 16);
+  dmaData[1] = cmdWord;
+
+  volatile DMAControlBlock *cmdTx = cb++;
+  cmdTx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
+  cmdTx->src = VIRT_TO_BUS(dmaSourceBuffer, dmaData);
+  cmdTx->dst = DMA_SPI_FIFO_PHYS_ADDRESS;
+  cmdTx->len = 8;
+  cmdTx->stride = 0;
+  cmdTx->next = 0;
+  volatile DMAControlBlock *cmdRx = CreateSPIRxControlBlock(cb++, cmdSize);
+
+  if (dmaFrame.numBytes == 0)
+  {
+    // First task of the frame, KickOffDMAProgram() lowers the Data/Control line before starting.
+    dmaFrame.tx0 = cmdTx;
+    dmaFrame.rx0 = cmdRx;
+  }
+  else
+  {
+    volatile DMAControlBlock *lowerDataControl = WriteDataControlLine(dmaFrame.rxTail, cb++, false);
+    ChainDMASPITransfer(lowerDataControl, cmdTx, cmdRx, cb, dmaData+2);
+    cb += 3;
+  }
+
+  volatile DMAControlBlock *raiseDataControl = WriteDataControlLine(cmdRx, cb++, true);
+  ChainDMASPITransfer(raiseDataControl, payload.tx0, payload.rx0, cb, dmaData+3);
+
+  dmaFrame.rxTail = payload.rxTail;
+  dmaFrame.numBytes += cmdSize + payload.numBytes;
+  LinkAllocatedDMAData();
+}
+
+void SubmitDMAFrame()
+{
+  if (dmaFrame.numBytes == 0) return;
+  DMASPIChain frame = dmaFrame;
+  dmaFrame.numBytes = 0;
+  KickOffDMAProgram(frame, -1);
+}
+
+#endif
+
+void SPIDMATransfer(SPITask *task)
+{
+  DMASPIChain chain;
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+  if (task->prevFb && TaskCanBeReadDirectlyFromFramebuffer(task))
+    BuildDMATransferFromFramebuffer(task, chain);
+  else
+#endif
+    BuildDMATransferFromSourceBuffer(task, chain);
+
+#ifdef DMA_CHAIN_WHOLE_FRAME
+  AppendTaskToDMAFrame(task, chain);
+#else
+  LinkAllocatedDMAData();
+  KickOffDMAProgram(chain, task->cmd);
+#endif
+}
+
 #else
 
 void SPIDMATransfer(SPITask *task)
@@ -744,6 +1215,11 @@ void DeinitDMA(void)
   FreeUncachedGpuMemory(dmaSourceBuffer);
   FreeUncachedGpuMemory(dmaCb);
   FreeUncachedGpuMemory(dmaConstantData);
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+  for(int i = 0; i < numDmaFramebuffers; ++i)
+    FreeUncachedGpuMemory(dmaFramebuffers[i]);
+  numDmaFramebuffers = 0;
+#endif
   if (dmaTxChannel != -1)
   {
     FreeDMAChannel(dmaTxChannel);
@@ -134,6 +134,19 @@ typedef struct SPITask SPITask;
 
 void SPIDMATransfer(SPITask *task);
 
+#ifdef DMA_CHAIN_WHOLE_FRAME
+// Kicks off all the tasks that have been passed to SPIDMATransfer() since the previous call as a single DMA program.
+void SubmitDMAFrame(void);
+#endif
+
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+// Allocates a framebuffer in uncached GPU memory, so that the DMA engine is able to read pixel spans straight out of it. The memory is released in DeinitDMA().
+void *AllocateDMAFramebuffer(uint32_t numBytes, const char *reason);
+
+// Blocks until DMA is no longer streaming pixels out from the given framebuffer, so that it is safe to overwrite its contents.
+void WaitForDMAToStopReadingFramebuffer(const void *framebuffer);
+#endif
+
 extern int dmaTxChannel;
 extern int dmaRxChannel;
 extern uint64_t totalGpuMemoryUsed;
@@ -29,6 +29,13 @@
 #include "mem_alloc.h"
 #include "keyboard.h"
 #include "low_battery.h"
+#include "panel_power.h"
+#include "overlay.h"
+#include "splash.h"
+#include "settings.h"
+#include "control.h"
+#include "secondary_display.h"
+#include "update_strategy.h"
 
 int CountNumChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer)
 {
@@ -77,11 +84,16 @@ void ProgramInterruptHandler(int signal)
   MarkProgramQuitting();
   __sync_synchronize();
   // Wake the SPI thread if it was sleeping so that it can gracefully quit
-  if (spiTaskMemory)
+#ifdef SECONDARY_DISPLAY
+  SharedMemory *queue = spiTaskQueues[PRIMARY_PANEL]; // spiTaskMemory may point to the secondary panel's queue at this moment
+#else
+  SharedMemory *queue = spiTaskMemory;
+#endif
+  if (queue)
   {
-    __atomic_fetch_add(&spiTaskMemory->queueHead, 1, __ATOMIC_SEQ_CST);
-    __atomic_fetch_add(&spiTaskMemory->queueTail, 1, __ATOMIC_SEQ_CST);
-    syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
+    __atomic_fetch_add(&queue->queueHead, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&queue->queueTail, 1, __ATOMIC_SEQ_CST);
+    WAKE_SPI_THREAD(); // Wake the SPI thread if it was sleeping to get new tasks
   }
 
   // Wake the main thread if it was sleeping for a new frame so that it can gracefully quit
@@ -99,8 +111,11 @@ int main()
 #ifdef RUN_WITH_REALTIME_THREAD_PRIORITY
   SetRealtimeThreadPriority();
 #endif
+  LoadSettings();
   OpenMailbox();
   InitSPI();
+  ShowSplash();
+  PlayBootAnimation();
   displayContentsLastChanged = tick();
   displayOff = false;
   InitLowBatterySystem();
@@ -112,23 +127,43 @@ int main()
 
   InitGPU();
 
-  spans = (Span*)Malloc((gpuFrameWidth * gpuFrameHeight / 2) * sizeof(Span), "main() task spans");
-  int size = gpuFramebufferSizeBytes;
+  const int maxNumSpans = MaxNumSpans();
+#ifdef COMPACT_MEMORY_PROFILE
+  if (maxNumSpans >= 65535) FATAL_ERROR("Display is too large for 16-bit span links, disable COMPACT_MEMORY_PROFILE!");
+#endif
+  spans = (Span*)Malloc(maxNumSpans * sizeof(Span), "main() task spans");
+  int headroom = 0;
 #ifdef USE_GPU_VSYNC
   // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
   // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
   // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
-  // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
+  // with room in front of it so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
   // to randomly fail and then subsequently hang if called a second time)
-  size *= 2;
-#endif
+  headroom = snapshotHeadroomBytes;
+#endif
+  const int size = headroom + gpuFramebufferSizeBytes;
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+  // DMA reads the pixels straight out from the framebuffers, and the two are swapped each frame, so both need to live in DMA visible memory
+  // and be prepared for the dispmanx bug.
+  uint16_t *framebuffer[2] = { (uint16_t *)AllocateDMAFramebuffer(size, "main() framebuffer0"), (uint16_t *)AllocateDMAFramebuffer(size, "main() framebuffer1") };
+  memset(framebuffer[0], 0, size);
+  memset(framebuffer[1], 0, size);
+  framebuffer[0] += (headroom>>1);
+  framebuffer[1] += (headroom>>1);
+#else
   uint16_t *framebuffer[2] = { (uint16_t *)Malloc(size, "main() framebuffer0"), (uint16_t *)Malloc(gpuFramebufferSizeBytes, "main() framebuffer1") };
   memset(framebuffer[0], 0, size); // Doublebuffer received GPU memory contents, first buffer contains current GPU memory,
   memset(framebuffer[1], 0, gpuFramebufferSizeBytes); // second buffer contains whatever the display is currently showing. This allows diffing pixels between the two.
-#ifdef USE_GPU_VSYNC
   // Due to the above bug. In USE_GPU_VSYNC mode, we directly snapshot to framebuffer[0], so it has to be prepared specially to work around the
   // dispmanx bug.
-  framebuffer[0] += (gpuFramebufferSizeBytes>>1);
+  framebuffer[0] += (headroom>>1);
+#endif
+  HandOverSplashToCapture(framebuffer[1]);
+  StartGPUCapture();
+  InitSecondaryDisplay();
+
+#if defined(COMPACT_MEMORY_PROFILE) || defined(MEMORY_ARENA_SIZE)
+  PrintMemoryUsageReport();
 #endif
 
   uint32_t curFrameEnd = spiTaskMemory->queueTail;
@@ -136,11 +171,16 @@ int main()
 
   bool prevFrameWasInterlacedUpdate = false;
   bool interlacedUpdate = false; // True if the previous update we did was an interlaced half field update.
+  bool fullRefreshRequested = false; // Set through the control socket, the whole next captured frame is then sent to the display.
   int frameParity = 0; // For interlaced frame updates, this is either 0 or 1 to denote evens or odds.
   OpenKeyboard();
+  OpenControlSocket();
   printf("All initialized, now running main loop...\n");
   while(programRunning)
   {
+    if (PollControlSocket())
+      fullRefreshRequested = true;
+
     prevFrameWasInterlacedUpdate = interlacedUpdate;
 
     // If last update was interlaced, it means we still have half of the image pending to be updated. In such a case,
@@ -162,6 +202,7 @@ int main()
       uint64_t waitStart = tick();
       while(__atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) == 0)
       {
+        uint64_t sleepUsecs = 0; // 0: sleep until the next frame arrives
 #if defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
         if (!displayOff && tick() - waitStart > TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
         {
@@ -170,15 +211,19 @@ int main()
         }
 
         if (!displayOff)
-        {
-          timespec timeout = {};
-          timeout.tv_sec = ((uint64_t)TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY * 1000) / 1000000000;
-          timeout.tv_nsec = ((uint64_t)TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY * 1000) % 1000000000;
-          if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, 0, &timeout, 0, 0); // Sleep until the next frame arrives
-        }
-        else
-#endif
-          if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, 0, 0, 0, 0); // Sleep until the next frame arrives
+          sleepUsecs = TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY;
+#endif
+#ifdef CONTROL_SOCKET
+        // Wake up periodically to answer commands on the control socket also while the screen stays static
+        if (sleepUsecs == 0 || sleepUsecs > CONTROL_SOCKET_POLL_INTERVAL_USECS)
+          sleepUsecs = CONTROL_SOCKET_POLL_INTERVAL_USECS;
+#endif
+        timespec timeout = {};
+        timeout.tv_sec = (sleepUsecs * 1000) / 1000000000;
+        timeout.tv_nsec = (sleepUsecs * 1000) % 1000000000;
+        if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, 0, sleepUsecs ? &timeout : 0, 0, 0); // Sleep until the next frame arrives
+        if (PollControlSocket())
+          fullRefreshRequested = true;
       }
     }
 
@@ -255,13 +300,18 @@ int main()
       frameObtainedTime = tick();
       uint64_t framePollingStartTime = frameObtainedTime;
 
-#if defined(SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES) || defined(SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE)
-    uint64_t nextFrameArrivalTime = PredictNextFrameArrivalTime();
-    int64_t timeToSleep = nextFrameArrivalTime - tick();
-    if (timeToSleep > 0)
-      usleep(timeToSleep);
-#endif
+      if (settings.predictFrameArrivalTimes || settings.sleepWhenIdle)
+      {
+        uint64_t nextFrameArrivalTime = PredictNextFrameArrivalTime();
+        int64_t timeToSleep = nextFrameArrivalTime - tick();
+        if (timeToSleep > 0)
+          usleep(timeToSleep);
+      }
 
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+      // framebuffer[0] held the frame before last, so DMA has most likely finished streaming it out by now, but make sure before overwriting.
+      WaitForDMAToStopReadingFramebuffer(framebuffer[0]);
+#endif
       framebufferHasNewChangedPixels = SnapshotFramebuffer(framebuffer[0]);
 #else
       memcpy(framebuffer[0], videoCoreFramebuffer[1], gpuFramebufferSizeBytes);
@@ -277,7 +327,7 @@ int main()
       __atomic_fetch_sub(&numNewGpuFrames, numNewFrames, __ATOMIC_SEQ_CST);
 
       DrawStatisticsOverlay(framebuffer[0]);
-      DrawLowBatteryIcon(framebuffer[0]);
+      DrawOverlays(framebuffer[0]);
 
 #ifdef USE_GPU_VSYNC
 
@@ -290,14 +340,14 @@ int main()
       // we must keep polling for frames until we find one that it has produced.
 #ifdef SELF_SYNCHRONIZE_TO_GPU_VSYNC_PRODUCED_NEW_FRAMES
       framebufferHasNewChangedPixels = framebufferHasNewChangedPixels && IsNewFramebuffer(framebuffer[0], framebuffer[1]);
-      uint64_t timeToGiveUpThereIsNotGoingToBeANewFrame = framePollingStartTime + 1000000/TARGET_FRAME_RATE/2;
+      uint64_t timeToGiveUpThereIsNotGoingToBeANewFrame = framePollingStartTime + 1000000/settings.targetFrameRate/2;
       while(!framebufferHasNewChangedPixels && tick() < timeToGiveUpThereIsNotGoingToBeANewFrame)
       {
         usleep(2000);
         frameObtainedTime = tick();
         framebufferHasNewChangedPixels = SnapshotFramebuffer(framebuffer[0]);
         DrawStatisticsOverlay(framebuffer[0]);
-        DrawLowBatteryIcon(framebuffer[0]);
+        DrawOverlays(framebuffer[0]);
         framebufferHasNewChangedPixels = framebufferHasNewChangedPixels && IsNewFramebuffer(framebuffer[0], framebuffer[1]);
       }
 #else
@@ -324,7 +374,7 @@ int main()
 
     // If too many pixels have changed on screen, drop adaptively to interlaced updating to keep up the frame rate.
     double inputDataFps = 1000000.0 / EstimateFrameRateInterval();
-    double desiredTargetFps = MAX(1, MIN(inputDataFps, TARGET_FRAME_RATE));
+    double desiredTargetFps = MAX(1, MIN(inputDataFps, settings.targetFrameRate));
 #ifdef SINGLE_CORE_BOARD
     const double timesliceToUseForScreenUpdates = 250000;
 #elif defined(ILI9486) || defined(ILI9486L) ||defined(HX8357D)
@@ -334,43 +384,76 @@ int main()
 #endif
     const double tooMuchToUpdateUsecs = timesliceToUseForScreenUpdates / desiredTargetFps; // If updating the current and new frame takes too many frames worth of allotted time, drop to interlacing.
 
+#if !defined(NO_INTERLACING) || !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)) // Only read by the interlacing decision and the diff below
+    const UpdateStrategy updateStrategy = ChooseUpdateStrategy();
+#endif
+
 #if !defined(NO_INTERLACING) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY))
-    int numChangedPixels = framebufferHasNewChangedPixels ? CountNumChangedPixels(framebuffer[0], framebuffer[1]) : 0;
+#if defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
+    const bool countChangedPixels = framebufferHasNewChangedPixels;
+#else
+    const bool countChangedPixels = framebufferHasNewChangedPixels && updateStrategy == UPDATE_SCANLINE_SPANS; // Only needed to decide on interlacing
+#endif
+    int numChangedPixels = countChangedPixels ? CountNumChangedPixels(framebuffer[0], framebuffer[1]) : 0;
 #endif
 
 #ifdef NO_INTERLACING
     interlacedUpdate = false;
-#elif defined(ALWAYS_INTERLACING)
-    interlacedUpdate = (numChangedPixels > 0);
 #else
-    uint32_t bytesToSend = numChangedPixels * SPI_BYTESPERPIXEL + (DISPLAY_DRAWABLE_HEIGHT<<1);
-    interlacedUpdate = ((bytesToSend + spiTaskMemory->spiBytesQueued) * spiUsecsPerByte > tooMuchToUpdateUsecs); // Decide whether to do interlacedUpdate - only updates half of the screen
+    if (settings.interlacing == INTERLACING_NEVER)
+      interlacedUpdate = false;
+    else if (settings.interlacing == INTERLACING_ALWAYS)
+      interlacedUpdate = (numChangedPixels > 0);
+    else
+    {
+      uint32_t bytesToSend = numChangedPixels * SPI_BYTESPERPIXEL + (DISPLAY_DRAWABLE_HEIGHT<<1);
+      interlacedUpdate = ((bytesToSend + spiTaskMemory->spiBytesQueued) * spiUsecsPerByte > tooMuchToUpdateUsecs); // Decide whether to do interlacedUpdate - only updates half of the screen
+    }
+    if (updateStrategy != UPDATE_SCANLINE_SPANS) interlacedUpdate = false; // Only the scanline diffs can produce half fields
 #endif
 
+    // A full refresh waits for a newly captured frame, so that it does not send out an outdated one
+    const bool fullRefresh = fullRefreshRequested && gotNewFramebuffer && !displayOff;
+    if (fullRefresh)
+    {
+      interlacedUpdate = false;
+      fullRefreshRequested = false;
+    }
+
     if (interlacedUpdate) frameParity = 1-frameParity; // Swap even-odd fields every second time we do an interlaced update (progressive updates ignore field order)
     int bytesTransferred = 0;
     Span *head = 0;
 
 #if defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)
     NoDiffChangedRectangle(head);
-#elif defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF)
-    DiffFramebuffersToSingleChangedRectangle(framebuffer[0], framebuffer[1], head);
 #else
     // Collect all spans in this image
-    if (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate)
+    const uint64_t diffStartTime = tick();
+    if (fullRefresh)
+      NoDiffChangedRectangle(head);
+    else if (updateStrategy == UPDATE_FULL_FRAME)
+    {
+      // Also when switching over right after an interlaced update, which left the other field of the frame unsent
+      if (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate)
+        NoDiffChangedRectangle(head);
+    }
+    else if (updateStrategy == UPDATE_SINGLE_RECTANGLE)
+      DiffFramebuffersToSingleChangedRectangle(framebuffer[0], framebuffer[1], head);
+    else if (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate)
     {
       // If possible, utilize a faster 4-wide pixel diffing method
-#ifdef FAST_BUT_COARSE_PIXEL_DIFF
-      if (gpuFrameWidth % 4 == 0 && gpuFramebufferScanlineStrideBytes % 8 == 0)
+      if (settings.diffMethod == DIFF_FAST_BUT_COARSE && gpuFrameWidth % 4 == 0 && gpuFramebufferScanlineStrideBytes % 8 == 0)
         DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head);
       else
-#endif
         DiffFramebuffersToScanlineSpansExact(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head); // If disabled, or framebuffer width is not compatible, use the exact method
     }
 
     // Merge spans together on adjacent scanlines - works only if doing a progressive update
     if (!interlacedUpdate)
       MergeScanlineSpanList(head);
+
+    if (gotNewFramebuffer && framebufferHasNewChangedPixels && !fullRefresh)
+      ClassifyFrame(updateStrategy, head, tick() - diffStartTime, interlacedUpdate);
 #endif
 
 #ifdef USE_GPU_VSYNC
@@ -387,6 +470,19 @@ int main()
     }
 #endif
 
+#ifdef STATISTICS
+    // Overlay updates alone do not count as new frames in the statistics
+    const bool frameHasNewContent = (head != 0);
+#endif
+
+    // Send out the overlays that changed since the last frame on top of the frame's own spans
+    if (!displayOff)
+      PresentChangedOverlays(framebuffer[0], head);
+
+    // Switch panel power saving modes based on what changed in this frame, before the changes are sent out
+    if (!displayOff)
+      UpdatePanelPowerSaving(framebuffer[0], head);
+
     // Submit spans
     if (!displayOff)
     for(Span *i = head; i; i = i->next)
@@ -521,6 +617,24 @@ int main()
       IN_SINGLE_THREADED_MODE_RUN_TASK();
     }
 
+#ifdef DMA_CHAIN_WHOLE_FRAME
+    SubmitDMAFrame();
+#endif
+
+    if (gotNewFramebuffer)
+      UpdateSecondaryDisplay(framebuffer[0]);
+
+#ifdef DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER
+    // The sent pixels were not copied over to framebuffer[1], since DMA reads them straight from framebuffer[0]. Swap the two instead, so
+    // that the frame that was just sent becomes the previous frame to diff against, and the next frame gets captured to the other buffer.
+    if (gotNewFramebuffer && !displayOff)
+    {
+      uint16_t *sentFramebuffer = framebuffer[0];
+      framebuffer[0] = framebuffer[1];
+      framebuffer[1] = sentFramebuffer;
+    }
+#endif
+
 #ifdef KERNEL_MODULE_CLIENT
     // Wake the kernel module up to run tasks. TODO: This might not be best placed here, we could pre-empt
     // to start running tasks already half-way during task submission above.
@@ -533,6 +647,8 @@ int main()
     {
       prevFrameEnd = curFrameEnd;
       curFrameEnd = spiTaskMemory->queueTail;
+      SampleSPIQueueOccupancy();
+      TraceFrame(tick(), bytesTransferred, interlacedUpdate);
     }
 
 #if defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
@@ -558,7 +674,7 @@ int main()
 #endif
 
 #ifdef STATISTICS
-    if (bytesTransferred > 0)
+    if (frameHasNewContent && bytesTransferred > 0)
     {
       if (frameTimeHistorySize < FRAME_HISTORY_MAX_SIZE)
       {
@@ -571,8 +687,13 @@ int main()
 #endif
   }
 
+#if defined(COMPACT_MEMORY_PROFILE) || defined(MEMORY_ARENA_SIZE)
+  PrintMemoryUsageReport();
+#endif
+  CloseControlSocket();
   DeinitGPU();
   DeinitSPI();
+  DeinitSecondaryDisplay();
   CloseMailbox();
   CloseKeyboard();
   printf("Quit.\n");
@@ -13,6 +13,9 @@
 #include "util.h"
 #include "statistics.h"
 #include "mem_alloc.h"
+#include "scaler.h"
+#include "transpose.h"
+#include "settings.h"
 
 bool MarkProgramQuitting(void);
 
@@ -41,12 +44,19 @@ int gpuFrameWidth = 0;
 int gpuFrameHeight = 0;
 int gpuFramebufferScanlineStrideBytes = 0;
 int gpuFramebufferSizeBytes = 0;
+int snapshotHeadroomBytes = 0;
 
 int excessPixelsLeft = 0;
 int excessPixelsRight = 0;
 int excessPixelsTop = 0;
 int excessPixelsBottom = 0;
 
+#ifdef USE_SOFTWARE_SCALING
+// Source frame captured at its native resolution, before it is scaled on the CPU.
+uint16_t *sourceFramebuffer = 0;
+int sourceFramebufferScanlineStrideBytes = 0;
+#endif
+
 // If one first runs content that updates at e.g. 24fps, a video perhaps, the frame rate histogram will lock to that update
 // rate and frame snapshots are done at 24fps. Later when user quits watching the video, and returns to e.g. 60fps updated
 // launcher menu, there needs to be some mechanism that detects that update rate has now increased, and synchronizes to the
@@ -65,6 +75,25 @@ int RoundUpToMultipleOf(int val, int multiple)
   return ((val + multiple - 1) / multiple) * multiple;
 }
 
+// Returns how much room a capture buffer needs in front of it for the vc_dispmanx_resource_read_data() bug (see InitGPU()), when the captured
+// rectangle starts offsetBytes into the buffer.
+static int DispmanxReadDataHeadroom(int bufferSizeBytes, int offsetBytes)
+{
+#ifdef COMPACT_MEMORY_PROFILE
+  return RoundUpToMultipleOf(offsetBytes, 32);
+#else
+  return bufferSizeBytes; // Simply allocate the buffers at double size
+#endif
+}
+
+// Allocates a zero-initialized capture buffer with the given number of bytes of room in front of it.
+static uint16_t *AllocateCaptureBuffer(int sizeBytes, int headroomBytes, const char *reason)
+{
+  uint8_t *buffer = (uint8_t *)Malloc(headroomBytes + sizeBytes, reason);
+  memset(buffer, 0, headroomBytes + sizeBytes);
+  return (uint16_t *)(buffer + headroomBytes);
+}
+
 // Tests if the pixels on the given new captured frame actually contain new image data from the previous frame
 bool IsNewFramebuffer(uint16_t *possiblyNewFramebuffer, uint16_t *oldFramebuffer)
 {
@@ -135,33 +164,56 @@ bool SnapshotFramebuffer(uint16_t *destination)
   // to randomly fail and then subsequently hang if called a second time)
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
   static uint16_t *tempTransposeBuffer = 0; // Allocate as static here to keep the number of #ifdefs down a bit
+#ifdef TRANSPOSE_ONLY_CHANGED_TILES
+  static uint16_t *prevTransposeBuffer = 0; // The previous capture, to find the tiles that changed. Its transpose is still in destination.
+#endif
   const int pixelWidth = gpuFrameHeight+excessPixelsTop+excessPixelsBottom;
   const int pixelHeight = gpuFrameWidth + excessPixelsLeft + excessPixelsRight;
   const int stride = RoundUpToMultipleOf(pixelWidth*sizeof(uint16_t), 32);
   if (!tempTransposeBuffer)
   {
-    tempTransposeBuffer = (uint16_t *)Malloc(pixelHeight * stride * 2, "gpu.cpp tempTransposeBuffer");
-    tempTransposeBuffer += pixelHeight * (stride>>1);
+    const int headroom = DispmanxReadDataHeadroom(pixelHeight * stride, excessPixelsLeft * stride + excessPixelsTop * sizeof(uint16_t));
+    tempTransposeBuffer = AllocateCaptureBuffer(pixelHeight * stride, headroom, "gpu.cpp tempTransposeBuffer");
+#ifdef TRANSPOSE_ONLY_CHANGED_TILES
+    // Start from an all black previous frame, whose transpose is the all black videoCoreFramebuffer[0]
+    prevTransposeBuffer = AllocateCaptureBuffer(pixelHeight * stride, headroom, "gpu.cpp prevTransposeBuffer");
+#endif
   }
+#ifdef TRANSPOSE_ONLY_CHANGED_TILES
+  // Capture alternately to the two buffers, so that the previous capture is kept around for comparison
+  uint16_t *capturedTransposeBuffer = prevTransposeBuffer;
+  prevTransposeBuffer = tempTransposeBuffer;
+  tempTransposeBuffer = capturedTransposeBuffer;
+#endif
   uint16_t *destPtr = tempTransposeBuffer - excessPixelsLeft * (stride >> 1) - excessPixelsTop;
 #else
   uint16_t *destPtr = destination - excessPixelsTop*(gpuFramebufferScanlineStrideBytes>>1) - excessPixelsLeft;
   const int stride = gpuFramebufferScanlineStrideBytes;
 #endif
+#ifdef USE_SOFTWARE_SCALING
+  // Same pointer adjustment as above, applied to the unscaled source frame.
+  failed = vc_dispmanx_resource_read_data(screen_resource, &rect, sourceFramebuffer - rect.y*(sourceFramebufferScanlineStrideBytes>>1) - rect.x, sourceFramebufferScanlineStrideBytes);
+#else
   failed = vc_dispmanx_resource_read_data(screen_resource, &rect, destPtr, stride);
+#endif
   if (failed)
   {
     printf("vc_dispmanx_resource_read_data failed with return code %d!\n", failed);
     MarkProgramQuitting();
     return false;
   }
+#ifdef USE_SOFTWARE_SCALING
+  ScaleFramebuffer(sourceFramebuffer, sourceFramebufferScanlineStrideBytes, destPtr, stride);
+#endif
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
-  // Transpose the snapshotted frame from landscape to portrait. The following takes around 0.5-1.0 msec
-  // of extra CPU time, so while this improves tearing to be perhaps a bit nicer visually, it probably
-  // is not good on the Pi Zero.
-  for(int y = 0; y < gpuFrameHeight; ++y)
-    for(int x = 0; x < gpuFrameWidth; ++x)
-      destination[y*(gpuFramebufferScanlineStrideBytes>>1)+x] = tempTransposeBuffer[x*(stride>>1)+y];
+  // Transpose the snapshotted frame from landscape to portrait. A full transpose takes a fraction of a msec even when done in cache
+  // friendly tiles, so optionally only the tiles that changed since the previous capture are transposed. The GPU polling thread always
+  // snapshots to videoCoreFramebuffer[0] and nothing else writes to it, so it still holds the transpose of the previous capture.
+#ifdef TRANSPOSE_ONLY_CHANGED_TILES
+  TransposeChangedTiles(tempTransposeBuffer, prevTransposeBuffer, stride, destination, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, gpuFrameWidth);
+#else
+  TransposeFramebuffer(tempTransposeBuffer, stride, destination, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, gpuFrameWidth);
+#endif
 #endif
 
 #endif
@@ -172,9 +224,9 @@ bool SnapshotFramebuffer(uint16_t *destination)
 
 void VsyncCallback(DISPMANX_UPDATE_HANDLE_T u, void *arg)
 {
-  // If TARGET_FRAME_RATE is e.g. 30 or 20, decimate only every second or third vsync callback to be processed.
+  // If the target frame rate is e.g. 30 or 20, decimate only every second or third vsync callback to be processed.
   static int frameSkipCounter = 0;
-  frameSkipCounter += TARGET_FRAME_RATE;
+  frameSkipCounter += __atomic_load_n(&settings.targetFrameRate, __ATOMIC_RELAXED);
   if (frameSkipCounter < 60) return;
   frameSkipCounter -= 60;
 
@@ -191,21 +243,23 @@ void *gpu_polling_thread(void*)
   uint64_t lastNewFrameReceivedTime = tick();
   while(programRunning)
   {
-#ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
-    const int64_t earlyFramePrediction = 500;
-    uint64_t earliestNextFrameArrivaltime = lastNewFrameReceivedTime + 1000000/TARGET_FRAME_RATE - earlyFramePrediction;
-    uint64_t now = tick();
-    if (earliestNextFrameArrivaltime > now)
-      usleep(earliestNextFrameArrivaltime - now);
-#endif
+    if (__atomic_load_n(&settings.sleepUntilTargetFrame, __ATOMIC_RELAXED))
+    {
+      const int64_t earlyFramePrediction = 500;
+      uint64_t earliestNextFrameArrivaltime = lastNewFrameReceivedTime + 1000000/__atomic_load_n(&settings.targetFrameRate, __ATOMIC_RELAXED) - earlyFramePrediction;
+      uint64_t now = tick();
+      if (earliestNextFrameArrivaltime > now)
+        usleep(earliestNextFrameArrivaltime - now);
+    }
 
-#if defined(SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES) || defined(SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE)
-    uint64_t nextFrameArrivalTime = PredictNextFrameArrivalTime();
-    int64_t timeToSleep = nextFrameArrivalTime - tick();
-    const int64_t minimumSleepTime = 150; // Don't sleep if the next frame is expected to arrive in less than this much time
-    if (timeToSleep > minimumSleepTime)
-      usleep(timeToSleep - minimumSleepTime);
-#endif
+    if (__atomic_load_n(&settings.predictFrameArrivalTimes, __ATOMIC_RELAXED) || __atomic_load_n(&settings.sleepWhenIdle, __ATOMIC_RELAXED))
+    {
+      uint64_t nextFrameArrivalTime = PredictNextFrameArrivalTime();
+      int64_t timeToSleep = nextFrameArrivalTime - tick();
+      const int64_t minimumSleepTime = 150; // Don't sleep if the next frame is expected to arrive in less than this much time
+      if (timeToSleep > minimumSleepTime)
+        usleep(timeToSleep - minimumSleepTime);
+    }
 
     uint64_t t0 = tick();
 
@@ -274,20 +328,22 @@ uint64_t EstimateFrameRateInterval()
 #ifdef RANDOM_TEST_PATTERN
   return 1000000/RANDOM_TEST_PATTERN_FRAME_RATE;
 #endif
-  if (histogramSize == 0) return 1000000/TARGET_FRAME_RATE;
+  const uint64_t targetFrameInterval = 1000000/__atomic_load_n(&settings.targetFrameRate, __ATOMIC_RELAXED);
+  if (histogramSize == 0) return targetFrameInterval;
   uint64_t mostRecentFrame = GET_HISTOGRAM(0);
 
   // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
   uint64_t timeNow = tick();
-#ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
-  // "Deep sleep" options: is user leaves the device with static content on screen for a long time.
-  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return 500000; } // if it's been more than one minute since last seen update, assume interval of 500ms.
-  if (timeNow - mostRecentFrame > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
-#endif
+  if (__atomic_load_n(&settings.sleepWhenIdle, __ATOMIC_RELAXED))
+  {
+    // "Deep sleep" options: is user leaves the device with static content on screen for a long time.
+    if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return 500000; } // if it's been more than one minute since last seen update, assume interval of 500ms.
+    if (timeNow - mostRecentFrame > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
+  }
+
+  if (!__atomic_load_n(&settings.predictFrameArrivalTimes, __ATOMIC_RELAXED))
+    return targetFrameInterval;
 
-#ifndef SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
-  return 1000000/TARGET_FRAME_RATE;
-#else
   if (histogramSize < 2) return 100000; // Frame histogram needs to have at least a few entries to bootstrap, if there's very few, either refresh rate is low, or fbcp-ili9341 just started
 
   // Look at the intervals of all previous arrived frames, and take some percentile value as our expected current frame rate
@@ -304,10 +360,9 @@ uint64_t EstimateFrameRateInterval()
   // Fast tracking #1: Always look at two most recent frames in addition to the ~40% percentile and follow whichever is a shorter period of time
   interval = MIN(interval, GET_HISTOGRAM(0) - GET_HISTOGRAM(1));
   // Fast tracking #2: if we seem to always get a new frame whenever snapshotting, we should try speeding up
-  interval = MAX((int64_t)interval - eagerFastTrackToSnapshottingFramesEarlierFactor*1000, (int64_t)1000000/TARGET_FRAME_RATE);
+  interval = MAX((int64_t)interval - eagerFastTrackToSnapshottingFramesEarlierFactor*1000, (int64_t)targetFrameInterval);
   if (interval > 100000) interval = 100000;
-  return MAX(interval, 1000000/TARGET_FRAME_RATE);
-#endif
+  return MAX(interval, targetFrameInterval);
 }
 
 uint64_t PredictNextFrameArrivalTime()
@@ -316,11 +371,12 @@ uint64_t PredictNextFrameArrivalTime()
 
   // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
   uint64_t timeNow = tick();
-#ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
-  // "Deep sleep" options: is user leaves the device with static content on screen for a long time.
-  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return lastFramePollTime + 100000; } // if it's been more than one minute since last seen update, assume interval of 100ms.
-  if (timeNow - mostRecentFrame > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
-#endif
+  if (__atomic_load_n(&settings.sleepWhenIdle, __ATOMIC_RELAXED))
+  {
+    // "Deep sleep" options: is user leaves the device with static content on screen for a long time.
+    if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return lastFramePollTime + 100000; } // if it's been more than one minute since last seen update, assume interval of 100ms.
+    if (timeNow - mostRecentFrame > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
+  }
   uint64_t interval = EstimateFrameRateInterval();
 
   // Assume that frames are arriving at times mostRecentFrame + k * interval.
@@ -438,6 +494,13 @@ void InitGPU()
   excessPixelsTop = ROUND_TO_NEAREST_INT(display_info.height * overscanTop * scalingFactorHeight);
   excessPixelsBottom = ROUND_TO_NEAREST_INT(display_info.height * overscanBottom * scalingFactorHeight);
 
+#ifdef USE_SOFTWARE_SCALING
+  // The source is captured unscaled, and overscan is cropped away by the grab rectangle of the source, so the scaled frame has no excess pixels around it.
+  const int sourceCropLeft = ROUND_TO_NEAREST_INT(display_info.width * overscanLeft);
+  const int sourceCropTop = ROUND_TO_NEAREST_INT(display_info.height * overscanTop);
+  excessPixelsLeft = excessPixelsRight = excessPixelsTop = excessPixelsBottom = 0;
+#endif
+
   gpuFrameWidth = scaledWidth;
   gpuFrameHeight = scaledHeight;
   gpuFramebufferScanlineStrideBytes = RoundUpToMultipleOf((gpuFrameWidth + excessPixelsLeft + excessPixelsRight) * 2, 32);
@@ -446,19 +509,41 @@ void InitGPU()
   // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
   // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
   // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
-  // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
-  // to randomly fail and then subsequently hang if called a second time)
-  videoCoreFramebuffer[0] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp framebuffer0");
-  videoCoreFramebuffer[1] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp framebuffer1");
-  memset(videoCoreFramebuffer[0], 0, gpuFramebufferSizeBytes*2);
-  memset(videoCoreFramebuffer[1], 0, gpuFramebufferSizeBytes*2);
-  videoCoreFramebuffer[0] += (gpuFramebufferSizeBytes>>1);
-  videoCoreFramebuffer[1] += (gpuFramebufferSizeBytes>>1);
+  // with room in front of it so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
+  // to randomly fail and then subsequently hang if called a second time). The software flip and scaler capture to buffers of their own, so the buffers
+  // given to SnapshotFramebuffer() then need no room with COMPACT_MEMORY_PROFILE.
+#if defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) || defined(USE_SOFTWARE_SCALING)
+  snapshotHeadroomBytes = DispmanxReadDataHeadroom(gpuFramebufferSizeBytes, 0);
+#else
+  snapshotHeadroomBytes = DispmanxReadDataHeadroom(gpuFramebufferSizeBytes, excessPixelsTop * gpuFramebufferScanlineStrideBytes + excessPixelsLeft * sizeof(uint16_t));
+#endif
+  videoCoreFramebuffer[0] = AllocateCaptureBuffer(gpuFramebufferSizeBytes, snapshotHeadroomBytes, "gpu.cpp framebuffer0");
+  videoCoreFramebuffer[1] = AllocateCaptureBuffer(gpuFramebufferSizeBytes, DispmanxReadDataHeadroom(gpuFramebufferSizeBytes, 0), "gpu.cpp framebuffer1");
 
   syslog(LOG_INFO, "GPU display is %dx%d. SPI display is %dx%d with drawable area of %dx%d. Applying scaling factor horiz=%.2fx & vert=%.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT, scalingFactorWidth, scalingFactorHeight, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
   printf("Source GPU display is %dx%d. Output SPI display is %dx%d with a drawable area of %dx%d. Applying scaling factor horiz=%.2fx & vert=%.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d\n", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT, scalingFactorWidth, scalingFactorHeight, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
 
   uint32_t image_prt;
+#ifdef USE_SOFTWARE_SCALING
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // Frames are scaled in landscape, before they are transposed to portrait
+  const int sourceWidth = display_info.height, sourceHeight = display_info.width;
+  vc_dispmanx_rect_set(&rect, sourceCropTop, sourceCropLeft, relevantDisplayHeight, relevantDisplayWidth);
+  InitSoftwareScaler(relevantDisplayHeight, relevantDisplayWidth, scaledHeight, scaledWidth);
+#else
+  const int sourceWidth = display_info.width, sourceHeight = display_info.height;
+  vc_dispmanx_rect_set(&rect, sourceCropLeft, sourceCropTop, relevantDisplayWidth, relevantDisplayHeight);
+  InitSoftwareScaler(relevantDisplayWidth, relevantDisplayHeight, scaledWidth, scaledHeight);
+#endif
+  printf("Creating dispmanX resource of size %dx%d, scaling on the CPU.\n", sourceWidth, sourceHeight);
+  screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, sourceWidth, sourceHeight, &image_prt);
+  if (!screen_resource) FATAL_ERROR("vc_dispmanx_resource_create failed!");
+  // Allocated with room in front for the vc_dispmanx_resource_read_data() bug, see above.
+  sourceFramebufferScanlineStrideBytes = RoundUpToMultipleOf(sourceWidth*2, 32);
+  sourceFramebuffer = AllocateCaptureBuffer(sourceFramebufferScanlineStrideBytes*sourceHeight,
+    DispmanxReadDataHeadroom(sourceFramebufferScanlineStrideBytes*sourceHeight, rect.y*sourceFramebufferScanlineStrideBytes + rect.x*sizeof(uint16_t)), "gpu.cpp sourceFramebuffer");
+  printf("GPU grab rectangle is offset x=%d,y=%d, size w=%dxh=%d\n", rect.x, rect.y, rect.width, rect.height);
+#else
   printf("Creating dispmanX resource of size %dx%d (aspect ratio=%f).\n", scaledWidth + excessPixelsLeft + excessPixelsRight, scaledHeight + excessPixelsTop + excessPixelsBottom, (double)(scaledWidth + excessPixelsLeft + excessPixelsRight) / (scaledHeight + excessPixelsTop + excessPixelsBottom));
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
   screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, scaledHeight + excessPixelsTop + excessPixelsBottom, scaledWidth + excessPixelsLeft + excessPixelsRight, &image_prt);
@@ -469,7 +554,11 @@ void InitGPU()
 #endif
   if (!screen_resource) FATAL_ERROR("vc_dispmanx_resource_create failed!");
   printf("GPU grab rectangle is offset x=%d,y=%d, size w=%dxh=%d, aspect ratio=%f\n", excessPixelsLeft, excessPixelsTop, scaledWidth, scaledHeight, (double)scaledWidth / scaledHeight);
+#endif
+}
 
+void StartGPUCapture()
+{
 #ifdef USE_GPU_VSYNC
   // Register to receive vsync notifications. This is a heuristic, since the application might not be locked at vsync, and even
   // if it was, this signal is not a guaranteed edge trigger for availability of new frames.
@@ -478,7 +567,7 @@ void InitGPU()
   // Record some fake samples to frame rate histogram to fast track it to warm state.
   uint64_t now = tick();
   for(int i = 0; i < HISTOGRAM_SIZE; ++i)
-    AddHistogramSample(now - 1000000ULL*(HISTOGRAM_SIZE-i) / TARGET_FRAME_RATE);
+    AddHistogramSample(now - 1000000ULL*(HISTOGRAM_SIZE-i) / settings.targetFrameRate);
 
   int rc = pthread_create(&gpuPollingThread, NULL, gpu_polling_thread, NULL); // After creating the thread, it is assumed to have ownership of the SPI bus, so no SPI chat on the main thread after this.
   if (rc != 0) FATAL_ERROR("Failed to create GPU polling thread!");
@@ -3,6 +3,9 @@
 #include <inttypes.h>
 
 void InitGPU(void);
+// Starts snapshotting frames, from the vsync callback or the polling thread. Kept apart from InitGPU() so that
+// nothing is captured while the boot animation still owns the display, see HandOverSplashToCapture().
+void StartGPUCapture(void);
 void DeinitGPU(void);
 void AddHistogramSample(uint64_t t);
 bool SnapshotFramebuffer(uint16_t *destination);
@@ -18,6 +21,8 @@ extern int gpuFrameWidth;
 extern int gpuFrameHeight;
 extern int gpuFramebufferScanlineStrideBytes;
 extern int gpuFramebufferSizeBytes;
+// Number of bytes that buffers passed to SnapshotFramebuffer() must have allocated in front of them, see the vc_dispmanx_resource_read_data() bug in gpu.cpp
+extern int snapshotHeadroomBytes;
 
 extern int excessPixelsLeft;
 extern int excessPixelsRight;
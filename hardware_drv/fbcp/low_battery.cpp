@@ -4,6 +4,7 @@
 #include "low_battery.h"
 #include "gpu.h"
 #include "spi.h"
+#include "overlay.h"
 
 #ifdef LOW_BATTERY_PIN
 
@@ -16,6 +17,7 @@
 
 static bool lowBattery = false;
 static uint64_t lowBatteryLastPolled = 0;
+static Overlay *lowBatteryOverlay = 0;
 
 // Battery icon from: https://github.com/martinohanlon/grrl-bat-monitor
 static uint16_t lowBatteryIcon [LOW_BATTERY_ICON_HEIGHT][LOW_BATTERY_ICON_WIDTH] = {
@@ -46,6 +48,7 @@ void InitLowBatterySystem()
   for(int y = 0; y < LOW_BATTERY_ICON_HEIGHT; ++y)
     for(int x = 0; x < LOW_BATTERY_ICON_WIDTH; ++x)
       lowBatteryIcon[y][x] = lowBatteryIcon[y][x] ? LOW_BATTERY_FORE_COLOR : LOW_BATTERY_BACK_COLOR;
+  lowBatteryOverlay = CreateOverlay(LOW_BATTERY_ICON_WIDTH*LOW_BATTERY_ICON_HEIGHT, "low_battery.cpp overlay");
   PollLowBattery();
 }
 
@@ -56,25 +59,21 @@ void PollLowBattery()
   {
     lowBattery = GET_GPIO(LOW_BATTERY_PIN) ? LOW_BATTERY_IS_ACTIVE_HIGH : !LOW_BATTERY_IS_ACTIVE_HIGH;
     lowBatteryLastPolled = now;
-  }
-}
-
-void DrawLowBatteryIcon(uint16_t *framebuffer)
-{
-  if (!lowBattery)
-    return;
 
-  for(int y = 0; y < LOW_BATTERY_ICON_HEIGHT; ++y)
-  {
-    int framebuffer_start_offset = (LOW_BATTERY_ICON_TOP_LEFT_Y+y)*(gpuFramebufferScanlineStrideBytes>>1)+LOW_BATTERY_ICON_TOP_LEFT_X;
-    memcpy(framebuffer+framebuffer_start_offset, lowBatteryIcon[y], LOW_BATTERY_ICON_WIDTH*2);
+    if (lowBattery)
+    {
+      uint16_t *pixels = BeginOverlayUpdate(lowBatteryOverlay, LOW_BATTERY_ICON_TOP_LEFT_X, LOW_BATTERY_ICON_TOP_LEFT_Y, LOW_BATTERY_ICON_WIDTH, LOW_BATTERY_ICON_HEIGHT);
+      memcpy(pixels, lowBatteryIcon, sizeof(lowBatteryIcon));
+      EndOverlayUpdate(lowBatteryOverlay);
+    }
+    else
+      HideOverlay(lowBatteryOverlay);
   }
 }
 
 #else 
   
 void InitLowBatterySystem() {}
-void PollLowBattery() {}  
-void DrawLowBatteryIcon(uint16_t *framebuffer) {}
+void PollLowBattery() {}
 
 #endif
\ No newline at end of file
@@ -9,11 +9,8 @@
 // internal data related to rendering the low battery icon.
 void InitLowBatterySystem();
 
-// Polls and saves the state of the battery. No-op if the function was called
-// less than LOW_BATTERY_POLLING_INTERVAL tick() ago.
+// Polls and saves the state of the battery, and shows the low battery icon
+// overlay while the battery is low. No-op if the function was called less
+// than LOW_BATTERY_POLLING_INTERVAL tick() ago.
 void PollLowBattery();
 
-// Draws a low battery icon on the given framebuffer if the last call to
-// pollLowBattery found a low battery state.
-void DrawLowBatteryIcon(uint16_t *framebuffer);
-
@@ -4,16 +4,125 @@
 #include <memory.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dma.h"
+#include "spi.h"
 
 uint64_t totalCpuMemoryAllocated = 0;
 
+#ifdef COMPACT_MEMORY_PROFILE
+static void PrintAllocation(size_t bytes, const char *reason, uint64_t totalBytes)
+{
+	printf("Allocated %zd bytes of CPU memory for %s. Total memory allocated: %llu bytes\n", bytes, reason, totalBytes);
+}
+void (*mallocReportHook)(size_t bytes, const char *reason, uint64_t totalBytes) = PrintAllocation;
+#else
+void (*mallocReportHook)(size_t bytes, const char *reason, uint64_t totalBytes) = 0;
+#endif
+
+// Allocations are tallied per reason string for PrintMemoryUsageReport(). Reasons past this many all get lumped into the last entry.
+#define MAX_ALLOCATION_REASONS 64
+
+struct AllocationRecord
+{
+	const char *reason;
+	uint64_t bytes;
+	int count;
+};
+
+static AllocationRecord allocationRecords[MAX_ALLOCATION_REASONS];
+static int numAllocationRecords = 0;
+
+static void RecordAllocation(size_t bytes, const char *reason)
+{
+	int i = 0;
+	while(i < numAllocationRecords && strcmp(allocationRecords[i].reason, reason)) ++i;
+	if (i == numAllocationRecords)
+	{
+		if (numAllocationRecords < MAX_ALLOCATION_REASONS) allocationRecords[numAllocationRecords++].reason = reason;
+		else i = MAX_ALLOCATION_REASONS-1;
+	}
+	allocationRecords[i].bytes += bytes;
+	++allocationRecords[i].count;
+}
+
+#ifdef MEMORY_ARENA_SIZE
+
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+// Buffers at least this large are placed at a different cache line offset from the start of a page each, so that buffers that are walked
+// in lockstep (the two framebuffers that get diffed against each other, the capture buffers that get transposed) do not map to the same
+// cache sets and keep evicting each other.
+#define ARENA_COLOURED_ALLOCATION_MIN_SIZE 4096
+#define ARENA_NUM_CACHE_COLOURS 16
+
+static uint8_t *arena = 0, *arenaHead = 0, *arenaEnd = 0;
+static int nextCacheColour = 0;
+static bool arenaIsHugePageBacked = false, arenaIsLocked = false;
+
+static void InitArena()
+{
+	// Prefer explicit huge pages, which need pages to be reserved in /proc/sys/vm/nr_hugepages first, and fall back to regular pages.
+	const size_t hugeSize = (MEMORY_ARENA_SIZE + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	void *ptr = mmap(0, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	size_t size = hugeSize;
+	if (ptr != MAP_FAILED) arenaIsHugePageBacked = true;
+	else
+	{
+		size = MEMORY_ARENA_SIZE;
+		ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (ptr == MAP_FAILED)
+		{
+			printf("Failed to map %zd bytes of memory for the memory arena!\n", size);
+			exit(1);
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(ptr, size, MADV_HUGEPAGE); // Transparent huge pages, if the kernel has them
+#endif
+	}
+	// Keeps the arena resident, so that the realtime path never takes a page fault on it
+	arenaIsLocked = (mlock(ptr, size) == 0);
+	if (!arenaIsLocked) printf("Warning: failed to mlock() the memory arena, its pages may get swapped out\n");
+	arena = arenaHead = (uint8_t*)ptr;
+	arenaEnd = arena + size;
+}
+
+static void *ArenaAlloc(size_t bytes)
+{
+	if (!arena) InitArena();
+	uintptr_t ptr = ((uintptr_t)arenaHead + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+	if (bytes >= ARENA_COLOURED_ALLOCATION_MIN_SIZE)
+	{
+		ptr = (ptr + ARENA_COLOURED_ALLOCATION_MIN_SIZE - 1) & ~(uintptr_t)(ARENA_COLOURED_ALLOCATION_MIN_SIZE - 1);
+		ptr += nextCacheColour * CACHE_LINE_SIZE;
+		nextCacheColour = (nextCacheColour + 1) % ARENA_NUM_CACHE_COLOURS;
+	}
+	if (ptr + bytes > (uintptr_t)arenaEnd) return 0;
+	arenaHead = (uint8_t*)(ptr + bytes);
+	return (void*)ptr;
+}
+#endif
+
 void *Malloc(size_t bytes, const char *reason)
 {
+#ifdef MEMORY_ARENA_SIZE
+	void *ptr = ArenaAlloc(bytes);
+	if (!ptr)
+	{
+		printf("Warning: memory arena is full, allocating %zd bytes for %s from the heap instead. Increase MEMORY_ARENA_SIZE in config.h\n", bytes, reason);
+		ptr = malloc(bytes);
+	}
+#else
 	void *ptr = malloc(bytes);
+#endif
 	if (ptr)
 	{
 		totalCpuMemoryAllocated += bytes; // Currently we don't decrement this, so this only counts up (all allocations are persistent so far, so that's ok for now)
-//		printf("Allocated %zd bytes of CPU memory for %s. Total memory allocated: %llu bytes\n", bytes, reason, totalCpuMemoryAllocated);
+		RecordAllocation(bytes, reason);
+		if (mallocReportHook) mallocReportHook(bytes, reason, totalCpuMemoryAllocated);
 		return ptr;
 	}
 	else
@@ -22,3 +131,25 @@ void *Malloc(size_t bytes, const char *reason)
 		exit(1);
 	}
 }
+
+void Free(void *ptr)
+{
+#ifdef MEMORY_ARENA_SIZE
+	if ((uint8_t*)ptr >= arena && (uint8_t*)ptr < arenaEnd) return; // The arena is only released when the process exits
+#endif
+	free(ptr);
+}
+
+void PrintMemoryUsageReport()
+{
+	for(int i = 0; i < numAllocationRecords; ++i)
+		printf("%10llu bytes in %3d allocations: %s\n", allocationRecords[i].bytes, allocationRecords[i].count, allocationRecords[i].reason);
+	printf("CPU memory allocated: %llu bytes\n", totalCpuMemoryAllocated);
+#ifdef MEMORY_ARENA_SIZE
+	if (arena) printf("Memory arena: %zd/%zd bytes used, %s pages, %s\n", (size_t)(arenaHead - arena), (size_t)(arenaEnd - arena), arenaIsHugePageBacked ? "huge" : "regular", arenaIsLocked ? "locked" : "not locked");
+#endif
+#ifdef USE_DMA_TRANSFERS
+	printf("GPU memory allocated: %llu bytes\n", totalGpuMemoryUsed);
+#endif
+	printf("SPI task ring: %u bytes, peak occupancy %u bytes\n", (uint32_t)SPI_QUEUE_SIZE, spiQueuePeakOccupancyBytes);
+}
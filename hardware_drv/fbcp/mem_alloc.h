@@ -5,4 +5,15 @@
 
 extern uint64_t totalCpuMemoryAllocated;
 
+// Allocates persistent memory. With MEMORY_ARENA_SIZE, allocations are carved out of a single locked arena, 64-byte aligned
+// and with large buffers staggered across cache sets.
 void *Malloc(size_t bytes, const char *reason);
+
+// Releases memory returned by Malloc().
+void Free(void *ptr);
+
+// If set, called after each allocation made with Malloc(), e.g. to log where memory goes. Prints each allocation by default with COMPACT_MEMORY_PROFILE.
+extern void (*mallocReportHook)(size_t bytes, const char *reason, uint64_t totalBytes);
+
+// Prints the CPU memory allocated so far per reason and in total, the GPU memory allocated, and the peak occupancy of the SPI task ring.
+void PrintMemoryUsageReport(void);
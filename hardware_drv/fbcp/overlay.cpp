@@ -0,0 +1,361 @@
+#include "config.h"
+#include "overlay.h"
+
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "gpu.h"
+#include "mem_alloc.h"
+#include "text.h"
+#include "util.h"
+
+// #define CHECK_OVERLAY_SPANS // Uncomment to check AddSpan() and CutBoxOutOfSpan() against randomized span lists and overlay rectangles at first use
+
+struct OverlayRect
+{
+  int x, y, width, height; // In framebuffer coordinates, width == 0 when the overlay is hidden
+};
+
+struct Overlay
+{
+  int maxPixels;
+  OverlayRect shown, pending;
+  uint16_t *shownPixels, *pendingPixels;
+  uint16_t *underPixels; // Pixels of the captured frame that the shown overlay covers up, so that they can be restored when the overlay moves or hides
+  bool dirty;
+};
+
+static Overlay *overlays[MAX_OVERLAYS];
+static int numOverlays = 0;
+
+Overlay *CreateOverlay(int maxPixels, const char *reason)
+{
+  if (numOverlays >= MAX_OVERLAYS) FATAL_ERROR("Too many overlays! Increase MAX_OVERLAYS in overlay.h");
+  Overlay *o = (Overlay*)Malloc(sizeof(Overlay), reason);
+  memset(o, 0, sizeof(Overlay));
+  o->maxPixels = maxPixels;
+  o->shownPixels = (uint16_t*)Malloc(maxPixels*sizeof(uint16_t), reason);
+  o->pendingPixels = (uint16_t*)Malloc(maxPixels*sizeof(uint16_t), reason);
+  o->underPixels = (uint16_t*)Malloc(maxPixels*sizeof(uint16_t), reason);
+  overlays[numOverlays++] = o;
+  return o;
+}
+
+uint16_t *BeginOverlayUpdate(Overlay *o, int x, int y, int width, int height)
+{
+  if (width*height > o->maxPixels) FATAL_ERROR("Overlay contents do not fit in the overlay!");
+  o->pending.x = x;
+  o->pending.y = y;
+  o->pending.width = width;
+  o->pending.height = height;
+  return o->pendingPixels;
+}
+
+void EndOverlayUpdate(Overlay *o)
+{
+  // Comparing against what is on screen lets callers redraw their overlays unconditionally, without causing updates to the display
+  o->dirty = memcmp(&o->shown, &o->pending, sizeof(OverlayRect)) || memcmp(o->shownPixels, o->pendingPixels, o->pending.width*o->pending.height*sizeof(uint16_t));
+}
+
+void DrawOverlayText(Overlay *o, const char *text, int x, int y, uint16_t color, uint16_t bgColor)
+{
+  const int textWidth = strlen(text)*TEXT_CELL_WIDTH;
+  if (textWidth == 0)
+  {
+    HideOverlay(o);
+    return;
+  }
+  // DrawText() fills the character cells completely, so they make up the whole overlay.
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  uint16_t *pixels = BeginOverlayUpdate(o, y-2, x, TEXT_CELL_HEIGHT, textWidth);
+  DrawText(pixels, TEXT_CELL_HEIGHT, TEXT_CELL_HEIGHT*sizeof(uint16_t), textWidth, text, 0, 2, color, bgColor);
+#else
+  uint16_t *pixels = BeginOverlayUpdate(o, x, y-2, textWidth, TEXT_CELL_HEIGHT);
+  DrawText(pixels, textWidth, textWidth*sizeof(uint16_t), TEXT_CELL_HEIGHT, text, 0, 2, color, bgColor);
+#endif
+  EndOverlayUpdate(o);
+}
+
+void HideOverlay(Overlay *o)
+{
+  memset(&o->pending, 0, sizeof(OverlayRect));
+  o->dirty = (o->shown.width != 0);
+}
+
+// Clips the rectangle to the framebuffer, returns false if nothing of it remains.
+static bool ClipToFramebuffer(const OverlayRect &r, int &x, int &y, int &endX, int &endY)
+{
+  x = MAX(r.x, 0);
+  y = MAX(r.y, 0);
+  endX = MIN(r.x + r.width, gpuFrameWidth);
+  endY = MIN(r.y + r.height, gpuFrameHeight);
+  return x < endX && y < endY;
+}
+
+// Copies the visible part of the rectangle r from the tightly packed pixel buffer to the framebuffer, or the other way around.
+static void CopyRect(uint16_t *framebuffer, const OverlayRect &r, uint16_t *pixels, bool toFramebuffer)
+{
+  int x, y, endX, endY;
+  if (!ClipToFramebuffer(r, x, y, endX, endY)) return;
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int Y = y; Y < endY; ++Y)
+  {
+    uint16_t *scanline = framebuffer + Y*stride + x;
+    uint16_t *row = pixels + (Y - r.y)*r.width + (x - r.x);
+    if (toFramebuffer) memcpy(scanline, row, (endX - x)*sizeof(uint16_t));
+    else memcpy(row, scanline, (endX - x)*sizeof(uint16_t));
+  }
+}
+
+void DrawOverlays(uint16_t *framebuffer)
+{
+  for(int i = 0; i < numOverlays; ++i)
+  {
+    Overlay *o = overlays[i];
+    if (o->shown.width == 0) continue;
+    CopyRect(framebuffer, o->shown, o->underPixels, false);
+    CopyRect(framebuffer, o->shown, o->shownPixels, true);
+  }
+}
+
+struct Box
+{
+  int x, y, endX, endY;
+};
+
+// Replaces the span i with spans that cover the parts of it outside the box r: above, below, left and right of r. The last scanline of a span
+// can end early (see diff.h), so it is cut separately from the full scanlines above it. Returns false if nothing is left of the span, so that
+// it should be unlinked. If there are not enough free spans left, the span is left as is.
+static bool CutBoxOutOfSpan(Span *i, const Box &r, Span *&freeSpan, Span *freeSpansEnd)
+{
+  const int fullEndY = (i->lastScanEndX == i->endX) ? i->endY : i->endY - 1;
+  const Box parts[2] = { { i->x, i->y, i->endX, fullEndY }, { i->x, fullEndY, i->lastScanEndX, i->endY } };
+  Box pieces[6];
+  int numPieces = 0;
+  bool overlaps = false;
+  for(int p = 0; p < 2; ++p)
+  {
+    const Box &b = parts[p];
+    if (b.x >= b.endX || b.y >= b.endY) continue;
+    if (b.x >= r.endX || b.endX <= r.x || b.y >= r.endY || b.endY <= r.y)
+    {
+      pieces[numPieces++] = b;
+      continue;
+    }
+    overlaps = true;
+    const int y = MAX(b.y, r.y), endY = MIN(b.endY, r.endY);
+    if (b.y < r.y) pieces[numPieces++] = { b.x, b.y, b.endX, r.y };
+    if (b.endY > r.endY) pieces[numPieces++] = { b.x, r.endY, b.endX, b.endY };
+    if (b.x < r.x) pieces[numPieces++] = { b.x, y, r.x, endY };
+    if (b.endX > r.endX) pieces[numPieces++] = { r.endX, y, b.endX, endY };
+  }
+  if (!overlaps || (numPieces > 1 && freeSpansEnd - freeSpan < numPieces - 1)) return true;
+
+  // The first piece reuses the span itself, and the others are linked in right after it
+  Span *span = i;
+  for(int p = 0; p < numPieces; ++p)
+  {
+    if (p > 0)
+    {
+      span = freeSpan++;
+      span->next = i->next;
+      i->next = span;
+    }
+    span->x = pieces[p].x;
+    span->endX = span->lastScanEndX = pieces[p].endX;
+    span->y = pieces[p].y;
+    span->endY = pieces[p].endY;
+    span->size = (pieces[p].endX - pieces[p].x)*(pieces[p].endY - pieces[p].y);
+  }
+  return numPieces > 0;
+}
+
+// Adds a span that covers the given rectangle, and cuts the rectangle out of the spans that are already in the list, so that no pixel is sent twice.
+static void AddSpan(const OverlayRect &rect, Span *&head)
+{
+  Box r;
+  if (!ClipToFramebuffer(rect, r.x, r.y, r.endX, r.endY)) return;
+
+  // The diff allocates spans linearly from the start of the spans array, so everything past the last span in the list is free. Cutting spans
+  // may not use up the spans that are reserved for the overlays themselves, see MaxNumSpans().
+  Span *freeSpan = spans;
+  for(Span *i = head; i; i = i->next)
+    if (i >= freeSpan) freeSpan = i + 1;
+  Span *freeSpansEnd = spans + MaxNumSpans() - 2*MAX_OVERLAYS;
+
+  Span *prev = 0;
+  for(Span *i = head; i; i = i->next)
+  {
+    if (i->x >= r.endX || i->endX <= r.x || i->y >= r.endY || i->endY <= r.y) { prev = i; continue; }
+    // If the spans run out, the overlapping pixels are just sent twice
+    if (CutBoxOutOfSpan(i, r, freeSpan, freeSpansEnd)) prev = i;
+    else if (prev) prev->next = i->next;
+    else head = i->next;
+  }
+
+  Span *span = freeSpan;
+  span->x = r.x;
+  span->endX = span->lastScanEndX = r.endX;
+  span->y = r.y;
+  span->endY = r.endY;
+  span->size = (r.endX - r.x)*(r.endY - r.y);
+  span->next = head;
+  head = span;
+}
+
+#ifdef CHECK_OVERLAY_SPANS
+static void CheckOverlaySpans();
+#endif
+
+void PresentChangedOverlays(uint16_t *framebuffer, Span *&head)
+{
+#ifdef CHECK_OVERLAY_SPANS
+  static bool checked = false;
+  if (!checked)
+  {
+    checked = true;
+    CheckOverlaySpans();
+  }
+#endif
+  bool anyDirty = false;
+  for(int i = 0; i < numOverlays; ++i)
+    anyDirty = anyDirty || overlays[i]->dirty;
+  if (!anyDirty) return;
+
+  // Peel off all overlays in reverse order to get back the captured frame, since overlays may overlap each other
+  for(int i = numOverlays-1; i >= 0; --i)
+    if (overlays[i]->shown.width > 0)
+      CopyRect(framebuffer, overlays[i]->shown, overlays[i]->underPixels, true);
+
+  for(int i = 0; i < numOverlays; ++i)
+  {
+    Overlay *o = overlays[i];
+    if (!o->dirty) continue;
+    AddSpan(o->shown, head);
+    if (memcmp(&o->shown, &o->pending, sizeof(OverlayRect)))
+      AddSpan(o->pending, head);
+    o->shown = o->pending;
+    memcpy(o->shownPixels, o->pendingPixels, o->shown.width*o->shown.height*sizeof(uint16_t));
+    o->dirty = false;
+  }
+
+  DrawOverlays(framebuffer);
+}
+
+#ifdef CHECK_OVERLAY_SPANS
+// Adds one to the count of each pixel that the span covers
+static void CountSpanPixels(const Span *s, uint8_t *count)
+{
+  for(int y = s->y; y < s->endY; ++y)
+  {
+    const int endX = (y == s->endY - 1) ? s->lastScanEndX : s->endX;
+    for(int x = s->x; x < endX; ++x)
+      ++count[y*gpuFrameWidth + x];
+  }
+}
+
+static uint32_t SpanSize(const Span *s)
+{
+  return (s->endX - s->x)*(s->endY - s->y - 1) + (s->lastScanEndX - s->x);
+}
+
+// Adds random rectangles to random lists of disjoint spans, and checks that the spans then cover exactly the union of the original spans
+// and the rectangles, that no pixel is covered twice, and that the sizes of the spans are right.
+static void CheckOverlaySpans()
+{
+  const int numFrames = 2000, numRectsPerFrame = 3, numPixels = gpuFrameWidth*gpuFrameHeight;
+  // A rectangle splits a single scanline span into at most two, so this many spans leaves enough free spans for all the pieces
+  const int maxSpans = (MaxNumSpans() - 2*MAX_OVERLAYS) >> numRectsPerFrame;
+  // AddSpan() works on the global spans array, which still holds the spans of the frame being presented
+  Span *frameSpans = spans;
+  spans = (Span*)malloc(MaxNumSpans()*sizeof(Span));
+  uint8_t *expected = (uint8_t*)malloc(numPixels);
+  uint8_t *covered = (uint8_t*)malloc(numPixels);
+  int failedFrame = -1, failedPixel = -1;
+  bool sizeMismatch = false;
+  srand(1);
+  for(int frame = 0; frame < numFrames && failedFrame < 0; ++frame)
+  {
+    memset(expected, 0, numPixels);
+    Span *head = 0;
+    int numSpans = 0;
+    if (rand() % 4 == 0)
+    {
+      // A single box whose last scanline ends early, as the diff produces when it merges the spans of consecutive scanlines
+      Span *s = spans + numSpans++;
+      s->x = rand() % (gpuFrameWidth/2);
+      s->endX = s->x + 1 + rand() % (gpuFrameWidth/2);
+      s->y = rand() % (gpuFrameHeight/2);
+      s->endY = s->y + 1 + rand() % (gpuFrameHeight/2);
+      s->lastScanEndX = s->x + 1 + rand() % (s->endX - s->x);
+      s->next = head;
+      head = s;
+    }
+    else
+    {
+      // Short spans on single scanlines with gaps in between, in a band of scanlines
+      // MIN() evaluates its arguments twice, so the random numbers are drawn first
+      const int bandY = rand() % gpuFrameHeight, bandHeight = 1 + rand() % 32, bandEndY = MIN(gpuFrameHeight, bandY + bandHeight);
+      for(int y = bandY; y < bandEndY; ++y)
+        for(int x = rand() % 8; x < gpuFrameWidth && numSpans < maxSpans;)
+        {
+          const int width = 1 + rand() % 10, endX = MIN(gpuFrameWidth, x + width);
+          if (rand() % 2)
+          {
+            Span *s = spans + numSpans++;
+            s->x = x;
+            s->endX = s->lastScanEndX = endX;
+            s->y = y;
+            s->endY = y + 1;
+            s->next = head;
+            head = s;
+          }
+          x = endX + 1 + rand() % 6;
+        }
+    }
+    for(Span *i = head; i; i = i->next)
+    {
+      CountSpanPixels(i, expected);
+      i->size = SpanSize(i);
+    }
+
+    for(int j = 0; j < numRectsPerFrame; ++j)
+    {
+      // Rectangles may reach over the edges of the frame
+      OverlayRect r = { rand() % (gpuFrameWidth + 16) - 8, rand() % (gpuFrameHeight + 16) - 8, 1 + rand() % (gpuFrameWidth/3), 1 + rand() % (gpuFrameHeight/3) };
+      AddSpan(r, head);
+      int x, y, endX, endY;
+      if (ClipToFramebuffer(r, x, y, endX, endY))
+        for(int Y = y; Y < endY; ++Y)
+          memset(expected + Y*gpuFrameWidth + x, 1, endX - x);
+    }
+
+    memset(covered, 0, numPixels);
+    for(Span *i = head; i; i = i->next)
+    {
+      CountSpanPixels(i, covered);
+      if (i->size != SpanSize(i)) sizeMismatch = true;
+    }
+    for(int p = 0; p < numPixels && failedPixel < 0; ++p)
+      if ((expected[p] != 0) != (covered[p] != 0) || covered[p] > 1)
+        failedPixel = p;
+    if (sizeMismatch || failedPixel >= 0)
+      failedFrame = frame;
+  }
+
+  if (failedFrame < 0)
+    printf("Overlay span check: %d random frames of %dx%d pixels with %d rectangles each, OK.\n", numFrames, gpuFrameWidth, gpuFrameHeight, numRectsPerFrame);
+  else if (sizeMismatch)
+    printf("Overlay span check: FAILED at frame %d, a span has the wrong size.\n", failedFrame);
+  else
+    printf("Overlay span check: FAILED at frame %d, pixel (%d,%d) should be covered %s, but is covered %d times.\n", failedFrame,
+      failedPixel % gpuFrameWidth, failedPixel / gpuFrameWidth, expected[failedPixel] ? "once" : "zero times", covered[failedPixel]);
+  free(spans);
+  free(expected);
+  free(covered);
+  spans = frameSpans;
+}
+#endif
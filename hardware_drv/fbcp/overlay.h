@@ -0,0 +1,37 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "diff.h"
+
+// Overlays are small pre-rasterized RGB565 sprites (statistics text, low battery icon) that are composited on top of the captured frames.
+// Each overlay keeps the pixels that are currently on screen separate from its next contents, so redrawing an overlay only costs an update
+// of its own area when the contents actually change, instead of dirtying the captured frame and skewing the frame diff.
+
+struct Overlay;
+
+// Each overlay adds at most two spans of its own to a frame, see PresentChangedOverlays()
+#define MAX_OVERLAYS 32
+
+// Creates a new overlay that can hold at most maxPixels pixels. Overlays are composited in the order they were created in.
+Overlay *CreateOverlay(int maxPixels, const char *reason);
+
+// Starts redrawing the overlay to cover the given rectangle in framebuffer coordinates. Returns a width*height pixel buffer with a tight
+// stride to draw the new contents to, which take effect at the next call to PresentChangedOverlays() after EndOverlayUpdate().
+uint16_t *BeginOverlayUpdate(Overlay *overlay, int x, int y, int width, int height);
+void EndOverlayUpdate(Overlay *overlay);
+
+// Draws the given text with its top left corner at (x,y) as the new contents of the overlay. Text is laid out like DrawText() does it, i.e.
+// in display coordinates when DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE is enabled. An empty string hides the overlay.
+void DrawOverlayText(Overlay *overlay, const char *text, int x, int y, uint16_t color, uint16_t bgColor);
+
+void HideOverlay(Overlay *overlay);
+
+// Draws all currently shown overlays on top of a newly captured frame. Unchanged overlays then match what is already on the display, so they
+// do not produce any spans when the frame is diffed.
+void DrawOverlays(uint16_t *framebuffer);
+
+// Presents the overlays whose contents have changed since the last call: their new contents are drawn to the framebuffer, and spans covering
+// the old and new areas of them are added to the given span list. These areas are cut out of the spans already in the list, so that no pixel
+// is sent twice.
+void PresentChangedOverlays(uint16_t *framebuffer, Span *&head);
@@ -0,0 +1,204 @@
+#include "config.h"
+#include "panel_power.h"
+
+#ifdef PANEL_POWER_SAVING
+
+#include <limits.h>
+#include <memory.h>
+
+#include "display.h"
+#include "diff.h"
+#include "gpu.h"
+#include "spi.h"
+#include "tick.h"
+#include "util.h"
+
+// Scanning the whole screen for idle mode suitability is not free, so do it at most this often.
+#define IDLE_MODE_CONTENT_CHECK_INTERVAL_USECS 1000000
+
+// PTLON blanks the display outside the partial area, so it can only be used when the panel controller maps
+// framebuffer rows to its gate lines one to one (i.e. the image is not transposed in hardware).
+#if defined(DISPLAY_SUPPORTS_PARTIAL_MODE) && (!defined(DISPLAY_SHOULD_FLIP_ORIENTATION) || defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE))
+#define PANEL_PARTIAL_MODE_AVAILABLE
+#endif
+
+// IDMON/IDMOFF are only sent to controllers that declare them, see DISPLAY_SUPPORTS_IDLE_MODE.
+#ifdef DISPLAY_SUPPORTS_IDLE_MODE
+#define PANEL_IDLE_MODE_AVAILABLE
+#endif
+
+static bool lowFrameRateOn = false;
+static bool partialModeOn = false;
+static int partialModeY, partialModeEndY; // Rows [y, endY[ that are shown while in partial mode
+
+// Union of all rows that have changed since bandStartTime. If the content only ever changes inside this band and everything else is black, partial mode can be used.
+static int bandY = INT_MAX, bandEndY = -1;
+static uint64_t bandStartTime = 0;
+static bool bandCheckedForPartialMode = false;
+
+static uint64_t contentsLastChanged = 0;
+#ifdef PANEL_IDLE_MODE_AVAILABLE
+static bool idleModeOn = false;
+static uint64_t idleModeLastChecked = 0;
+static uint64_t eightColorSince = 0; // Time since which the whole screen has consisted of 8-color pixels, or 0 if it does not
+static bool contentsChangedSinceIdleModeCheck = true;
+
+// In idle mode the panel only displays the most significant bit of each color channel. Only pixels whose R, G and B channels are each
+// either all zeros or all ones are shown unchanged, i.e. all the bits of each channel agree.
+static inline bool Is8ColorPixel(uint16_t pixel)
+{
+  return (((pixel >> 1) ^ pixel) & 0x7BEF) == 0;
+}
+
+static bool Is8ColorRectangle(uint16_t *framebuffer, int x, int y, int endX, int endY)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  for(int Y = y; Y < endY; ++Y)
+  {
+    uint16_t *scanline = framebuffer + Y*stride;
+    for(int X = x; X < endX; ++X)
+      if (!Is8ColorPixel(scanline[X]))
+        return false;
+  }
+  return true;
+}
+#endif
+
+static bool IsBlackOutsideRows(uint16_t *framebuffer, int y, int endY)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  for(int Y = 0; Y < gpuFrameHeight; ++Y)
+  {
+    if (Y == y) Y = endY;
+    if (Y >= gpuFrameHeight) break;
+    uint16_t *scanline = framebuffer + Y*stride;
+    for(int X = 0; X < gpuFrameWidth; ++X)
+      if (scanline[X])
+        return false;
+  }
+  return true;
+}
+
+#ifdef PANEL_IDLE_MODE_AVAILABLE
+static void SetIdleMode(bool on)
+{
+  if (on)
+    QUEUE_SPI_TRANSFER(0x39/*IDMON: Idle Mode On*/);
+  else
+    QUEUE_SPI_TRANSFER(0x38/*IDMOFF: Idle Mode Off*/);
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+  idleModeOn = on;
+  if (!on)
+    eightColorSince = 0;
+}
+#endif
+
+static void SetLowFrameRate(bool on)
+{
+#ifdef DISPLAY_FRAME_RATE_CONTROL
+  QUEUE_SPI_TRANSFER(DISPLAY_FRAME_RATE_CONTROL, (uint8_t)(on ? DISPLAY_FRAME_RATE_LOW : DISPLAY_FRAME_RATE_NORMAL));
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+#endif
+  lowFrameRateOn = on;
+}
+
+#ifdef PANEL_PARTIAL_MODE_AVAILABLE
+static void SetPartialMode(bool on, int y, int endY)
+{
+  if (on)
+    QueueEnterPartialDisplayMode(displayYOffset + y, displayYOffset + endY);
+  else
+    QueueExitPartialDisplayMode();
+  partialModeOn = on;
+  partialModeY = y;
+  partialModeEndY = endY;
+}
+#endif
+
+void UpdatePanelPowerSaving(uint16_t *framebuffer, Span *head)
+{
+  uint64_t now = tick();
+  if (head)
+  {
+    contentsLastChanged = now;
+#ifdef PANEL_IDLE_MODE_AVAILABLE
+    contentsChangedSinceIdleModeCheck = true;
+    bool eightColor = true;
+#endif
+
+    int y = INT_MAX, endY = -1;
+    for(Span *i = head; i; i = i->next)
+    {
+      y = MIN(y, i->y);
+      endY = MAX(endY, i->endY);
+#ifdef PANEL_IDLE_MODE_AVAILABLE
+      if (idleModeOn && eightColor)
+        eightColor = Is8ColorRectangle(framebuffer, i->x, i->y, i->endX, i->endY);
+#endif
+    }
+
+    // Leave the modes that the new content does not fit before any of it is sent to the display
+    if (lowFrameRateOn)
+      SetLowFrameRate(false);
+#ifdef PANEL_IDLE_MODE_AVAILABLE
+    if (idleModeOn && !eightColor)
+      SetIdleMode(false);
+#endif
+#ifdef PANEL_PARTIAL_MODE_AVAILABLE
+    if (partialModeOn && (y < partialModeY || endY > partialModeEndY))
+      SetPartialMode(false, 0, 0);
+#endif
+
+    // Grow the band of changing rows, or restart it if changes are no longer confined to a thin strip
+    const int maxBandHeight = gpuFrameHeight * PANEL_PARTIAL_MODE_MAX_HEIGHT_PERCENTAGE / 100;
+    if (MAX(bandEndY, endY) - MIN(bandY, y) > maxBandHeight)
+    {
+      bandY = y;
+      bandEndY = endY;
+      bandStartTime = now;
+      bandCheckedForPartialMode = false;
+    }
+    else if (y < bandY || endY > bandEndY)
+    {
+      bandY = MIN(bandY, y);
+      bandEndY = MAX(bandEndY, endY);
+      bandCheckedForPartialMode = false;
+    }
+  }
+  else if (!lowFrameRateOn && now - contentsLastChanged >= PANEL_POWER_SAVING_DELAY_USECS)
+    SetLowFrameRate(true);
+
+#ifdef PANEL_IDLE_MODE_AVAILABLE
+  if (!idleModeOn && now - idleModeLastChecked >= IDLE_MODE_CONTENT_CHECK_INTERVAL_USECS)
+  {
+    idleModeLastChecked = now;
+    if (contentsChangedSinceIdleModeCheck)
+    {
+      contentsChangedSinceIdleModeCheck = false;
+      if (!Is8ColorRectangle(framebuffer, 0, 0, gpuFrameWidth, gpuFrameHeight))
+        eightColorSince = 0;
+      else if (!eightColorSince)
+        eightColorSince = now;
+    }
+    if (eightColorSince && now - eightColorSince >= PANEL_POWER_SAVING_DELAY_USECS)
+      SetIdleMode(true);
+  }
+#endif
+
+#ifdef PANEL_PARTIAL_MODE_AVAILABLE
+  if (!partialModeOn && !bandCheckedForPartialMode && bandY < bandEndY && bandEndY - bandY <= gpuFrameHeight * PANEL_PARTIAL_MODE_MAX_HEIGHT_PERCENTAGE / 100
+    && now - bandStartTime >= PANEL_POWER_SAVING_DELAY_USECS)
+  {
+    // Rows outside the band have not changed for a while now, so this only needs to be rechecked when the band grows.
+    bandCheckedForPartialMode = true;
+    if (IsBlackOutsideRows(framebuffer, bandY, bandEndY))
+      SetPartialMode(true, bandY, bandEndY);
+  }
+#endif
+}
+
+#else
+
+void UpdatePanelPowerSaving(uint16_t *framebuffer, Span *head) {}
+
+#endif
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <inttypes.h>
+
+struct Span;
+
+// All functions here are no-op when PANEL_POWER_SAVING is undef so they can be
+// called unconditionnaly.
+
+// Inspects the list of changed spans of the current frame, and queues the display
+// commands to enter or leave the panel power saving modes accordingly. Must be called
+// each frame before the spans are submitted, since leaving a mode has to happen before
+// content that does not fit the mode is sent to the display.
+void UpdatePanelPowerSaving(uint16_t *framebuffer, Span *head);
@@ -0,0 +1,367 @@
+#include "config.h"
+
+#ifdef USE_SOFTWARE_SCALING
+
+#include <memory.h>
+#include <stdio.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCALER_USE_NEON
+#endif
+
+#include "scaler.h"
+#include "mem_alloc.h"
+#include "util.h"
+
+// Source frames are compared against the previous frame in tiles of this many pixels squared to find the areas that need to be rescaled.
+#define SOFTWARE_SCALING_TILE_SIZE 16
+
+enum ScalingMethod
+{
+  SCALE_COPY, // Source and destination are the same size (e.g. DISPLAY_CROPPED_INSTEAD_OF_SCALING)
+  SCALE_BOX_2X, // Destination is exactly half the size of the source, average each 2x2 block of source pixels
+  SCALE_BILINEAR, // Arbitrary ratio, down to 2:1
+  SCALE_AREA // Downscaling by more than 2:1 along either axis, where two bilinear taps would skip source pixels and alias
+};
+
+static ScalingMethod method;
+static int srcWidth, srcHeight, dstWidth, dstHeight;
+
+// For bilinear scaling, destination pixel d samples source pixels index[d] and index[d]+1, the latter weighted by weight[d]/256.
+// For area scaling, destination pixel d averages the source pixels [index[d], end[d][.
+static uint16_t *xIndex, *xWeight, *yIndex, *yWeight, *xEnd, *yEnd;
+
+// Sums of the color channels of the source scanlines that a destination scanline covers, for area scaling.
+static uint32_t *sumR, *sumG, *sumB;
+
+// Vertically filtered source scanline for bilinear scaling, with the color channels unpacked to 8.8 fixed point.
+static uint16_t *rowR, *rowG, *rowB;
+
+#ifdef SOFTWARE_SCALING_ONLY_CHANGED_TILES
+static uint16_t *prevSrc; // Copy of the previous source frame, tightly packed
+static uint16_t *scaled; // Scaled result of the previous frame, tightly packed
+static bool havePrevSrc = false;
+static int numTilesX, numTilesY;
+// Range of destination pixels [dst0[t], dst1[t][ that sample from source tile column/row t.
+static uint16_t *tileDstX0, *tileDstX1, *tileDstY0, *tileDstY1;
+#endif
+
+static void ComputeBilinearTable(int srcSize, int dstSize, uint16_t *index, uint16_t *weight)
+{
+  for(int d = 0; d < dstSize; ++d)
+  {
+    // Align pixel centers of the source and the destination, and compute the source coordinate in 8.8 fixed point.
+    int s = (int)((2*d + 1) * (int64_t)srcSize * 256 / (2*dstSize)) - 128;
+    s = MAX(s, 0);
+    int i = s >> 8, w = s & 0xFF;
+    if (i >= srcSize-1)
+    {
+      i = srcSize-1;
+      w = 0;
+    }
+    index[d] = i;
+    weight[d] = w;
+  }
+}
+
+static void ComputeAreaTable(int srcSize, int dstSize, uint16_t *index, uint16_t *end)
+{
+  for(int d = 0; d < dstSize; ++d)
+  {
+    index[d] = (uint16_t)((int64_t)d * srcSize / dstSize);
+    end[d] = (uint16_t)MAX((int64_t)(d+1) * srcSize / dstSize, index[d] + 1);
+  }
+}
+
+#ifdef SCALER_USE_NEON
+static inline uint16x8_t Average4(uint16x8_t a, uint16x8_t b, uint16x8_t c, uint16x8_t d)
+{
+  const uint16x8_t mask6 = vdupq_n_u16(0x3F), mask5 = vdupq_n_u16(0x1F);
+  uint16x8_t r = vaddq_u16(vaddq_u16(vshrq_n_u16(a, 11), vshrq_n_u16(b, 11)), vaddq_u16(vshrq_n_u16(c, 11), vshrq_n_u16(d, 11)));
+  uint16x8_t g = vaddq_u16(vaddq_u16(vandq_u16(vshrq_n_u16(a, 5), mask6), vandq_u16(vshrq_n_u16(b, 5), mask6)), vaddq_u16(vandq_u16(vshrq_n_u16(c, 5), mask6), vandq_u16(vshrq_n_u16(d, 5), mask6)));
+  uint16x8_t bl = vaddq_u16(vaddq_u16(vandq_u16(a, mask5), vandq_u16(b, mask5)), vaddq_u16(vandq_u16(c, mask5), vandq_u16(d, mask5)));
+  return vorrq_u16(vorrq_u16(vshlq_n_u16(vrshrq_n_u16(r, 2), 11), vshlq_n_u16(vrshrq_n_u16(g, 2), 5)), vrshrq_n_u16(bl, 2));
+}
+#endif
+
+static inline uint16_t Average4(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+  uint32_t r = ((a >> 11) + (b >> 11) + (c >> 11) + (d >> 11) + 2) >> 2;
+  uint32_t g = (((a >> 5) & 0x3F) + ((b >> 5) & 0x3F) + ((c >> 5) & 0x3F) + ((d >> 5) & 0x3F) + 2) >> 2;
+  uint32_t bl = ((a & 0x1F) + (b & 0x1F) + (c & 0x1F) + (d & 0x1F) + 2) >> 2;
+  return (uint16_t)((r << 11) | (g << 5) | bl);
+}
+
+static void BoxFilterRow(const uint16_t *top, const uint16_t *bottom, uint16_t *dst, int dx, int endDx)
+{
+#ifdef SCALER_USE_NEON
+  for(; dx + 8 <= endDx; dx += 8)
+  {
+    uint16x8x2_t t = vld2q_u16(top + 2*dx), b = vld2q_u16(bottom + 2*dx); // Deinterleaves even and odd source pixels
+    vst1q_u16(dst + dx, Average4(t.val[0], t.val[1], b.val[0], b.val[1]));
+  }
+#endif
+  for(; dx < endDx; ++dx)
+    dst[dx] = Average4(top[2*dx], top[2*dx+1], bottom[2*dx], bottom[2*dx+1]);
+}
+
+// Blends two source scanlines a and b with weights (256-w)/256 and w/256 over the columns [x, endX[, unpacking the result to rowR/G/B.
+static void FilterRowsVertically(const uint16_t *a, const uint16_t *b, int w, int x, int endX)
+{
+  const uint16_t wa = 256 - w, wb = w;
+#ifdef SCALER_USE_NEON
+  const uint16x8_t mask6 = vdupq_n_u16(0x3F), mask5 = vdupq_n_u16(0x1F);
+  for(; x + 8 <= endX; x += 8)
+  {
+    uint16x8_t pa = vld1q_u16(a + x), pb = vld1q_u16(b + x);
+    vst1q_u16(rowR + x, vmlaq_n_u16(vmulq_n_u16(vshrq_n_u16(pa, 11), wa), vshrq_n_u16(pb, 11), wb));
+    vst1q_u16(rowG + x, vmlaq_n_u16(vmulq_n_u16(vandq_u16(vshrq_n_u16(pa, 5), mask6), wa), vandq_u16(vshrq_n_u16(pb, 5), mask6), wb));
+    vst1q_u16(rowB + x, vmlaq_n_u16(vmulq_n_u16(vandq_u16(pa, mask5), wa), vandq_u16(pb, mask5), wb));
+  }
+#endif
+  for(; x < endX; ++x)
+  {
+    rowR[x] = (a[x] >> 11) * wa + (b[x] >> 11) * wb;
+    rowG[x] = ((a[x] >> 5) & 0x3F) * wa + ((b[x] >> 5) & 0x3F) * wb;
+    rowB[x] = (a[x] & 0x1F) * wa + (b[x] & 0x1F) * wb;
+  }
+}
+
+static void FilterRowHorizontally(uint16_t *dst, int dx, int endDx)
+{
+  for(; dx < endDx; ++dx)
+  {
+    const int i = xIndex[dx];
+    const uint32_t wb = xWeight[dx], wa = 256 - wb;
+    uint32_t r = (rowR[i] * wa + rowR[i+1] * wb + 32768) >> 16;
+    uint32_t g = (rowG[i] * wa + rowG[i+1] * wb + 32768) >> 16;
+    uint32_t b = (rowB[i] * wa + rowB[i+1] * wb + 32768) >> 16;
+    dst[dx] = (uint16_t)((r << 11) | (g << 5) | b);
+  }
+}
+
+// Produces destination scanline pixels [dx, endDx[ from the source rows [sy, endSy[ by averaging each destination pixel's source footprint.
+static void AreaFilterRow(const uint16_t *src, int srcStride, int sy, int endSy, uint16_t *dst, int dx, int endDx)
+{
+  const int sx = xIndex[dx], endSx = xEnd[endDx-1];
+  memset(sumR + sx, 0, (endSx - sx)*sizeof(uint32_t));
+  memset(sumG + sx, 0, (endSx - sx)*sizeof(uint32_t));
+  memset(sumB + sx, 0, (endSx - sx)*sizeof(uint32_t));
+  for(int y = sy; y < endSy; ++y)
+  {
+    const uint16_t *row = src + y*srcStride;
+    for(int x = sx; x < endSx; ++x)
+    {
+      sumR[x] += row[x] >> 11;
+      sumG[x] += (row[x] >> 5) & 0x3F;
+      sumB[x] += row[x] & 0x1F;
+    }
+  }
+  const uint32_t rows = endSy - sy;
+  for(; dx < endDx; ++dx)
+  {
+    uint32_t r = 0, g = 0, b = 0;
+    for(int x = xIndex[dx]; x < xEnd[dx]; ++x)
+    {
+      r += sumR[x];
+      g += sumG[x];
+      b += sumB[x];
+    }
+    const uint32_t n = rows * (xEnd[dx] - xIndex[dx]);
+    dst[dx] = (uint16_t)((((r + n/2) / n) << 11) | (((g + n/2) / n) << 5) | ((b + n/2) / n));
+  }
+}
+
+// Produces the destination rectangle [dx, endDx[ x [dy, endDy[. Strides are in pixels.
+static void ScaleRect(const uint16_t *src, int srcStride, uint16_t *dst, int dstStride, int dx, int dy, int endDx, int endDy)
+{
+  if (dx >= endDx || dy >= endDy)
+    return;
+
+  switch(method)
+  {
+  case SCALE_COPY:
+    for(int y = dy; y < endDy; ++y)
+      memcpy(dst + y*dstStride + dx, src + y*srcStride + dx, (endDx - dx)*2);
+    break;
+  case SCALE_BOX_2X:
+    for(int y = dy; y < endDy; ++y)
+      BoxFilterRow(src + 2*y*srcStride, src + (2*y+1)*srcStride, dst + y*dstStride, dx, endDx);
+    break;
+  case SCALE_BILINEAR:
+  {
+    // Only filter vertically the source columns that the horizontal pass will sample from
+    const int sx = xIndex[dx], endSx = MIN(xIndex[endDx-1] + 2, srcWidth);
+    for(int y = dy; y < endDy; ++y)
+    {
+      const int sy = yIndex[y];
+      FilterRowsVertically(src + sy*srcStride, src + MIN(sy+1, srcHeight-1)*srcStride, yWeight[y], sx, endSx);
+      FilterRowHorizontally(dst + y*dstStride, dx, endDx);
+    }
+    break;
+  }
+  case SCALE_AREA:
+    for(int y = dy; y < endDy; ++y)
+      AreaFilterRow(src, srcStride, yIndex[y], yEnd[y], dst + y*dstStride, dx, endDx);
+    break;
+  }
+}
+
+#ifdef SOFTWARE_SCALING_ONLY_CHANGED_TILES
+// Computes the range of source pixels [lo, hi] along one axis that destination pixel d samples from.
+static void SourceFootprint(int d, bool vertical, int &lo, int &hi)
+{
+  switch(method)
+  {
+  case SCALE_COPY: lo = hi = d; break;
+  case SCALE_BOX_2X: lo = 2*d; hi = 2*d+1; break;
+  case SCALE_BILINEAR:
+    lo = vertical ? yIndex[d] : xIndex[d];
+    hi = MIN(lo+1, (vertical ? srcHeight : srcWidth) - 1);
+    break;
+  case SCALE_AREA:
+    lo = vertical ? yIndex[d] : xIndex[d];
+    hi = (vertical ? yEnd[d] : xEnd[d]) - 1;
+    break;
+  }
+}
+
+static void MapTilesToDestination(int numTiles, int dstSize, bool vertical, uint16_t *dst0, uint16_t *dst1)
+{
+  for(int t = 0; t < numTiles; ++t)
+  {
+    const int tileStart = t * SOFTWARE_SCALING_TILE_SIZE, tileEnd = tileStart + SOFTWARE_SCALING_TILE_SIZE;
+    dst0[t] = dstSize;
+    dst1[t] = 0;
+    for(int d = 0; d < dstSize; ++d)
+    {
+      int lo, hi;
+      SourceFootprint(d, vertical, lo, hi);
+      if (hi >= tileStart && lo < tileEnd)
+      {
+        dst0[t] = MIN(dst0[t], d);
+        dst1[t] = d+1;
+      }
+    }
+  }
+}
+#endif
+
+void InitSoftwareScaler(int srcW, int srcH, int dstW, int dstH)
+{
+  srcWidth = srcW;
+  srcHeight = srcH;
+  dstWidth = dstW;
+  dstHeight = dstH;
+
+  if (srcW == dstW && srcH == dstH)
+    method = SCALE_COPY;
+  else if (srcW == 2*dstW && srcH == 2*dstH)
+    method = SCALE_BOX_2X;
+  else if (srcW > 2*dstW || srcH > 2*dstH)
+  {
+    method = SCALE_AREA;
+    xIndex = (uint16_t *)Malloc(dstW * sizeof(uint16_t), "scaler.cpp xIndex");
+    xEnd = (uint16_t *)Malloc(dstW * sizeof(uint16_t), "scaler.cpp xEnd");
+    yIndex = (uint16_t *)Malloc(dstH * sizeof(uint16_t), "scaler.cpp yIndex");
+    yEnd = (uint16_t *)Malloc(dstH * sizeof(uint16_t), "scaler.cpp yEnd");
+    ComputeAreaTable(srcW, dstW, xIndex, xEnd);
+    ComputeAreaTable(srcH, dstH, yIndex, yEnd);
+    sumR = (uint32_t *)Malloc(srcW * sizeof(uint32_t), "scaler.cpp sumR");
+    sumG = (uint32_t *)Malloc(srcW * sizeof(uint32_t), "scaler.cpp sumG");
+    sumB = (uint32_t *)Malloc(srcW * sizeof(uint32_t), "scaler.cpp sumB");
+  }
+  else
+  {
+    method = SCALE_BILINEAR;
+    xIndex = (uint16_t *)Malloc(dstW * sizeof(uint16_t), "scaler.cpp xIndex");
+    xWeight = (uint16_t *)Malloc(dstW * sizeof(uint16_t), "scaler.cpp xWeight");
+    yIndex = (uint16_t *)Malloc(dstH * sizeof(uint16_t), "scaler.cpp yIndex");
+    yWeight = (uint16_t *)Malloc(dstH * sizeof(uint16_t), "scaler.cpp yWeight");
+    ComputeBilinearTable(srcW, dstW, xIndex, xWeight);
+    ComputeBilinearTable(srcH, dstH, yIndex, yWeight);
+
+    // The horizontal pass reads one past the last source pixel with a zero weight, so leave room for it.
+    rowR = (uint16_t *)Malloc((srcW + 1) * sizeof(uint16_t), "scaler.cpp rowR");
+    rowG = (uint16_t *)Malloc((srcW + 1) * sizeof(uint16_t), "scaler.cpp rowG");
+    rowB = (uint16_t *)Malloc((srcW + 1) * sizeof(uint16_t), "scaler.cpp rowB");
+    memset(rowR, 0, (srcW + 1) * sizeof(uint16_t));
+    memset(rowG, 0, (srcW + 1) * sizeof(uint16_t));
+    memset(rowB, 0, (srcW + 1) * sizeof(uint16_t));
+  }
+
+#ifdef SOFTWARE_SCALING_ONLY_CHANGED_TILES
+  numTilesX = (srcW + SOFTWARE_SCALING_TILE_SIZE - 1) / SOFTWARE_SCALING_TILE_SIZE;
+  numTilesY = (srcH + SOFTWARE_SCALING_TILE_SIZE - 1) / SOFTWARE_SCALING_TILE_SIZE;
+  tileDstX0 = (uint16_t *)Malloc(numTilesX * sizeof(uint16_t), "scaler.cpp tileDstX0");
+  tileDstX1 = (uint16_t *)Malloc(numTilesX * sizeof(uint16_t), "scaler.cpp tileDstX1");
+  tileDstY0 = (uint16_t *)Malloc(numTilesY * sizeof(uint16_t), "scaler.cpp tileDstY0");
+  tileDstY1 = (uint16_t *)Malloc(numTilesY * sizeof(uint16_t), "scaler.cpp tileDstY1");
+  MapTilesToDestination(numTilesX, dstW, false, tileDstX0, tileDstX1);
+  MapTilesToDestination(numTilesY, dstH, true, tileDstY0, tileDstY1);
+  prevSrc = (uint16_t *)Malloc(srcW * srcH * sizeof(uint16_t), "scaler.cpp prevSrc");
+  scaled = (uint16_t *)Malloc(dstW * dstH * sizeof(uint16_t), "scaler.cpp scaled");
+#endif
+
+  static const char * const methodNames[] = { "copy", "2:1 box filter", "bilinear", "area average" };
+#ifdef SCALER_USE_NEON
+  const char *simd = " (NEON)";
+#else
+  const char *simd = "";
+#endif
+  printf("Software scaling %dx%d -> %dx%d using %s%s.\n", srcW, srcH, dstW, dstH, methodNames[method], (method == SCALE_BOX_2X || method == SCALE_BILINEAR) ? simd : "");
+}
+
+#ifdef SOFTWARE_SCALING_ONLY_CHANGED_TILES
+
+void ScaleFramebuffer(const uint16_t *src, int srcStrideBytes, uint16_t *dst, int dstStrideBytes)
+{
+  const int srcStride = srcStrideBytes >> 1;
+  for(int ty = 0; ty < numTilesY; ++ty)
+  {
+    const int y = ty * SOFTWARE_SCALING_TILE_SIZE, endY = MIN(y + SOFTWARE_SCALING_TILE_SIZE, srcHeight);
+    int firstTile = numTilesX, lastTile = -1;
+    for(int tx = 0; tx < numTilesX; ++tx)
+    {
+      const int x = tx * SOFTWARE_SCALING_TILE_SIZE, width = MIN(SOFTWARE_SCALING_TILE_SIZE, srcWidth - x);
+      bool changed = !havePrevSrc;
+      for(int Y = y; Y < endY && !changed; ++Y)
+        changed = memcmp(src + Y*srcStride + x, prevSrc + Y*srcWidth + x, width*2) != 0;
+      if (changed)
+      {
+        firstTile = MIN(firstTile, tx);
+        lastTile = tx;
+      }
+    }
+    if (lastTile < 0)
+      continue;
+
+    // Rescale one rectangle per band of tiles, spanning from the first to the last changed tile
+    const int x = firstTile * SOFTWARE_SCALING_TILE_SIZE, endX = MIN((lastTile + 1) * SOFTWARE_SCALING_TILE_SIZE, srcWidth);
+    for(int Y = y; Y < endY; ++Y)
+      memcpy(prevSrc + Y*srcWidth + x, src + Y*srcStride + x, (endX - x)*2);
+    int dx = dstWidth, endDx = 0;
+    for(int tx = firstTile; tx <= lastTile; ++tx)
+    {
+      dx = MIN(dx, tileDstX0[tx]);
+      endDx = MAX(endDx, tileDstX1[tx]);
+    }
+    ScaleRect(src, srcStride, scaled, dstWidth, dx, tileDstY0[ty], endDx, tileDstY1[ty]);
+  }
+  havePrevSrc = true;
+
+  for(int y = 0; y < dstHeight; ++y)
+    memcpy(dst + y*(dstStrideBytes>>1), scaled + y*dstWidth, dstWidth*2);
+}
+
+#else
+
+void ScaleFramebuffer(const uint16_t *src, int srcStrideBytes, uint16_t *dst, int dstStrideBytes)
+{
+  ScaleRect(src, srcStrideBytes>>1, dst, dstStrideBytes>>1, 0, 0, dstWidth, dstHeight);
+}
+
+#endif
+
+#endif
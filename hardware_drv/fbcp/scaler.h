@@ -0,0 +1,12 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Scales captured frames on the CPU, used when USE_SOFTWARE_SCALING is defined.
+
+// Chooses the scaling method for the given source and destination sizes, and allocates the lookup tables and buffers that it needs.
+void InitSoftwareScaler(int srcWidth, int srcHeight, int dstWidth, int dstHeight);
+
+// Scales the source frame to the destination. With SOFTWARE_SCALING_ONLY_CHANGED_TILES, only the parts of the destination that are affected by
+// source tiles that changed since the previous call are rescaled, and the rest is copied from the previous result.
+void ScaleFramebuffer(const uint16_t *src, int srcStrideBytes, uint16_t *dst, int dstStrideBytes);
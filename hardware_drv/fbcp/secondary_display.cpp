@@ -0,0 +1,129 @@
+#include "config.h"
+#include "secondary_display.h"
+
+#ifdef SECONDARY_DISPLAY
+
+#include <memory.h>
+#include <stdio.h>
+
+#include "display.h"
+#include "gpu.h"
+#include "mem_alloc.h"
+#include "spi.h"
+#include "util.h"
+
+struct PanelRect
+{
+  int x, y, endX, endY; // In viewport coordinates
+};
+
+// A panel pipeline shows a viewport of the captured frame on one panel. It keeps its own copy of the pixels that the panel is showing to
+// diff against, its own list of changed rectangles, and sends them through the task queue of its panel.
+struct PanelPipeline
+{
+  int panel; // Index into spiTaskQueues
+  int viewportX, viewportY, width, height; // In framebuffer coordinates
+  uint16_t *prevPixels; // width*height pixels with a tight stride
+  PanelRect *rects;
+  int numRects;
+};
+
+static PanelPipeline secondary;
+
+void InitSecondaryDisplay()
+{
+  PanelPipeline &p = secondary;
+  p.panel = SECONDARY_PANEL;
+  p.viewportX = SECONDARY_DISPLAY_VIEWPORT_X;
+  p.viewportY = SECONDARY_DISPLAY_VIEWPORT_Y;
+  p.width = MIN(SECONDARY_DISPLAY_WIDTH, gpuFrameWidth - p.viewportX);
+  p.height = MIN(SECONDARY_DISPLAY_HEIGHT, gpuFrameHeight - p.viewportY);
+  if (p.width <= 0 || p.height <= 0)
+  {
+    printf("Secondary display viewport at (%d,%d) is outside of the %dx%d captured frame, secondary display disabled\n", p.viewportX, p.viewportY, gpuFrameWidth, gpuFrameHeight);
+    return;
+  }
+
+  // ClearScreen() left the secondary display black as well
+  p.prevPixels = (uint16_t*)Malloc(p.width*p.height*sizeof(uint16_t), "secondary_display.cpp previous pixels");
+  memset(p.prevPixels, 0, p.width*p.height*sizeof(uint16_t));
+  p.rects = (PanelRect*)Malloc(p.height*sizeof(PanelRect), "secondary_display.cpp changed rectangles");
+  printf("Secondary display shows the %dx%d area at (%d,%d) of the captured frame\n", p.width, p.height, p.viewportX, p.viewportY);
+}
+
+// Finds the changed pixels of each scanline of the viewport, and merges each run of consecutive changed scanlines to a single rectangle.
+// A status display usually updates a few compact areas, so this sends only few unchanged pixels, and keeps the number of write window
+// commands, which each need to wait for the SPI FIFO to drain, small.
+static void DiffViewport(PanelPipeline &p, const uint16_t *framebuffer)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  PanelRect *r = 0;
+  p.numRects = 0;
+  for(int y = 0; y < p.height; ++y)
+  {
+    const uint16_t *scanline = framebuffer + (p.viewportY + y)*stride + p.viewportX;
+    const uint16_t *prevScanline = p.prevPixels + y*p.width;
+    int x = 0;
+    while(x < p.width && scanline[x] == prevScanline[x]) ++x;
+    if (x == p.width)
+    {
+      r = 0;
+      continue;
+    }
+    int endX = p.width;
+    while(scanline[endX-1] == prevScanline[endX-1]) --endX;
+
+    if (r)
+    {
+      r->x = MIN(r->x, x);
+      r->endX = MAX(r->endX, endX);
+      r->endY = y + 1;
+    }
+    else
+    {
+      r = &p.rects[p.numRects++];
+      r->x = x;
+      r->y = y;
+      r->endX = endX;
+      r->endY = y + 1;
+    }
+  }
+}
+
+void UpdateSecondaryDisplay(uint16_t *framebuffer)
+{
+  PanelPipeline &p = secondary;
+  if (!p.prevPixels) return;
+  SharedMemory *queue = spiTaskQueues[p.panel];
+  if (queue->queueHead != queue->queueTail) return;
+
+  DiffViewport(p, framebuffer);
+  if (p.numRects == 0) return;
+
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  SelectPanelTaskQueue(p.panel);
+  for(int i = 0; i < p.numRects; ++i)
+  {
+    const PanelRect &r = p.rects[i];
+    const uint16_t *src = framebuffer + (p.viewportY + r.y)*stride + p.viewportX + r.x;
+    QueueDisplayRectangle(src, stride, r.x, r.y, r.endX - r.x, r.endY - r.y);
+    for(int y = r.y; y < r.endY; ++y)
+      memcpy(p.prevPixels + y*p.width + r.x, src + (y - r.y)*stride, (r.endX - r.x)*sizeof(uint16_t));
+  }
+  SelectPanelTaskQueue(PRIMARY_PANEL);
+}
+
+void DeinitSecondaryDisplay()
+{
+  Free(secondary.prevPixels);
+  Free(secondary.rects);
+  memset(&secondary, 0, sizeof(secondary));
+}
+
+#else
+
+void InitSecondaryDisplay() {}
+void UpdateSecondaryDisplay(uint16_t *framebuffer) {}
+void DeinitSecondaryDisplay() {}
+
+#endif
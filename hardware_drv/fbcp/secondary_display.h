@@ -0,0 +1,15 @@
+#pragma once
+
+#include <inttypes.h>
+
+// All functions here are no-op when SECONDARY_DISPLAY is undef so they can be called unconditionnaly.
+
+// Sets up the pipeline of the secondary display. Must be called after InitGPU(), since the viewport is clipped to the captured frame.
+void InitSecondaryDisplay(void);
+
+// Diffs the viewport of a newly captured frame against what the secondary display is showing, and queues the rectangles that changed to
+// the task queue of the secondary display. If the secondary display is still busy sending an earlier update, the frame is skipped and its
+// changes are picked up with the next frame, so that a slow secondary display never holds up the main display.
+void UpdateSecondaryDisplay(uint16_t *framebuffer);
+
+void DeinitSecondaryDisplay(void);
@@ -0,0 +1,209 @@
+#include "config.h"
+#include "settings.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "display.h"
+
+// Higher target frame rates than this are clamped. Nothing is captured faster than the display refresh, which is at most 120Hz.
+#define MAX_TARGET_FRAME_RATE 240
+
+Settings settings = {
+  TARGET_FRAME_RATE,
+#if defined(NO_INTERLACING)
+  INTERLACING_NEVER,
+#elif defined(ALWAYS_INTERLACING)
+  INTERLACING_ALWAYS,
+#else
+  INTERLACING_ADAPTIVE,
+#endif
+#ifdef FAST_BUT_COARSE_PIXEL_DIFF
+  DIFF_FAST_BUT_COARSE,
+#else
+  DIFF_EXACT,
+#endif
+#if defined(UPDATE_FRAMES_WITHOUT_DIFFING)
+  UPDATE_FULL_FRAME,
+#elif defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF)
+  UPDATE_SINGLE_RECTANGLE,
+#else
+  UPDATE_SCANLINE_SPANS,
+#endif
+#ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
+  true,
+#else
+  false,
+#endif
+#ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
+  true,
+#else
+  false,
+#endif
+#ifdef SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
+  true,
+#else
+  false,
+#endif
+};
+
+const char *interlacingModeNames[] = { "adaptive", "never", "always" };
+const char *diffMethodNames[] = { "exact", "coarse" };
+const char *updateStrategyNames[] = { "spans", "rectangle", "full", "adaptive" };
+
+// Returns the index of value in names, or -1 if it is not there.
+static int FindName(const char *value, const char **names, int numNames)
+{
+  for(int i = 0; i < numNames; ++i)
+    if (!strcmp(value, names[i])) return i;
+  return -1;
+}
+
+// Settings that turn a policy on or off take 0 or 1. Returns -1 for anything else.
+static int ParseOnOff(const char *value)
+{
+  if (!strcmp(value, "0")) return 0;
+  if (!strcmp(value, "1")) return 1;
+  return -1;
+}
+
+bool ApplySetting(const char *key, const char *value, const char *source)
+{
+  if (!strcmp(key, "FBCP_TARGET_FRAME_RATE"))
+  {
+    char *end;
+    long fps = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || fps <= 0)
+    {
+      printf("%s: invalid FBCP_TARGET_FRAME_RATE \"%s\"\n", source, value);
+      return false;
+    }
+    if (fps > MAX_TARGET_FRAME_RATE)
+    {
+      printf("%s: FBCP_TARGET_FRAME_RATE=%s is too high, using %d\n", source, value, MAX_TARGET_FRAME_RATE);
+      fps = MAX_TARGET_FRAME_RATE;
+    }
+    __atomic_store_n(&settings.targetFrameRate, (int)fps, __ATOMIC_RELAXED);
+  }
+  else if (!strcmp(key, "FBCP_INTERLACING"))
+  {
+    int mode = FindName(value, interlacingModeNames, sizeof(interlacingModeNames)/sizeof(interlacingModeNames[0]));
+    if (mode < 0)
+    {
+      printf("%s: invalid FBCP_INTERLACING \"%s\", expected adaptive, never or always\n", source, value);
+      return false;
+    }
+#ifdef NO_INTERLACING
+    if (mode != INTERLACING_NEVER)
+    {
+      printf("%s: FBCP_INTERLACING=%s has no effect, interlacing has been disabled with NO_INTERLACING at build time\n", source, value);
+      return false;
+    }
+#endif
+    __atomic_store_n(&settings.interlacing, (InterlacingMode)mode, __ATOMIC_RELAXED);
+  }
+  else if (!strcmp(key, "FBCP_DIFF"))
+  {
+    int method = FindName(value, diffMethodNames, sizeof(diffMethodNames)/sizeof(diffMethodNames[0]));
+    if (method < 0)
+    {
+      printf("%s: invalid FBCP_DIFF \"%s\", expected exact or coarse\n", source, value);
+      return false;
+    }
+#ifdef ALL_TASKS_SHOULD_DMA
+    if (method == DIFF_FAST_BUT_COARSE)
+    {
+      printf("%s: FBCP_DIFF=coarse is not available with ALL_TASKS_SHOULD_DMA at build time, the coarse diff produces spans that are too short to DMA well\n", source);
+      return false;
+    }
+#endif
+    __atomic_store_n(&settings.diffMethod, (DiffMethod)method, __ATOMIC_RELAXED);
+  }
+  else if (!strcmp(key, "FBCP_UPDATE"))
+  {
+    int strategy = FindName(value, updateStrategyNames, sizeof(updateStrategyNames)/sizeof(updateStrategyNames[0]));
+    if (strategy < 0)
+    {
+      printf("%s: invalid FBCP_UPDATE \"%s\", expected spans, rectangle, full or adaptive\n", source, value);
+      return false;
+    }
+#if defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)
+    if (strategy != UPDATE_FULL_FRAME)
+    {
+      printf("%s: FBCP_UPDATE=%s has no effect, the previous frame to diff against is not kept with UPDATE_FRAMES_WITHOUT_DIFFING at build time\n", source, value);
+      return false;
+    }
+#endif
+    __atomic_store_n(&settings.update, (UpdateStrategy)strategy, __ATOMIC_RELAXED);
+  }
+  else if (!strcmp(key, "FBCP_SLEEP_UNTIL_TARGET_FRAME") || !strcmp(key, "FBCP_SLEEP_WHEN_IDLE") || !strcmp(key, "FBCP_PREDICT_FRAME_ARRIVAL_TIMES"))
+  {
+    int on = ParseOnOff(value);
+    if (on < 0)
+    {
+      printf("%s: invalid %s \"%s\", expected 0 or 1\n", source, key, value);
+      return false;
+    }
+    bool *policy = !strcmp(key, "FBCP_SLEEP_UNTIL_TARGET_FRAME") ? &settings.sleepUntilTargetFrame
+                 : !strcmp(key, "FBCP_SLEEP_WHEN_IDLE") ? &settings.sleepWhenIdle : &settings.predictFrameArrivalTimes;
+    __atomic_store_n(policy, on != 0, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    if (!strncmp(key, "FBCP_", 5)) printf("%s: unknown setting %s\n", source, key);
+    return false;
+  }
+  return true;
+}
+
+static char *Trim(char *str)
+{
+  while(isspace(*str)) ++str;
+  char *end = str + strlen(str);
+  while(end > str && isspace(end[-1])) --end;
+  *end = '\0';
+  return str;
+}
+
+static void LoadSettingsFile(const char *filename)
+{
+  FILE *handle = fopen(filename, "r");
+  if (!handle) return;
+  char line[256];
+  while(fgets(line, sizeof(line), handle))
+  {
+    char *key = Trim(line);
+    char *value = strchr(key, '=');
+    if (key[0] == '#' || !value) continue;
+    *value++ = '\0';
+    key = Trim(key);
+    value = Trim(value);
+    // Values may be quoted like in systemd EnvironmentFiles
+    size_t len = strlen(value);
+    if (len >= 2 && (value[0] == '"' || value[0] == '\'') && value[len-1] == value[0])
+    {
+      value[len-1] = '\0';
+      ++value;
+    }
+    ApplySetting(key, value, filename);
+  }
+  fclose(handle);
+}
+
+void LoadSettings()
+{
+  LoadSettingsFile(RUNTIME_CONFIG_FILE);
+
+  const char *keys[] = { "FBCP_TARGET_FRAME_RATE", "FBCP_INTERLACING", "FBCP_DIFF", "FBCP_UPDATE", "FBCP_SLEEP_UNTIL_TARGET_FRAME", "FBCP_SLEEP_WHEN_IDLE", "FBCP_PREDICT_FRAME_ARRIVAL_TIMES" };
+  for(size_t i = 0; i < sizeof(keys)/sizeof(keys[0]); ++i)
+  {
+    const char *value = getenv(keys[i]);
+    if (value) ApplySetting(keys[i], value, "environment");
+  }
+
+  printf("Settings: target frame rate %d, interlacing %s, diff method %s, update strategy %s, sleep until target frame %d, sleep when idle %d, predict frame arrival times %d\n",
+    settings.targetFrameRate, interlacingModeNames[settings.interlacing], diffMethodNames[settings.diffMethod], updateStrategyNames[settings.update],
+    settings.sleepUntilTargetFrame, settings.sleepWhenIdle, settings.predictFrameArrivalTimes);
+}
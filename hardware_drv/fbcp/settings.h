@@ -0,0 +1,59 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Settings that can be changed without rebuilding, to try out different performance tradeoffs. They are read at startup from
+// RUNTIME_CONFIG_FILE as KEY=value lines, and then from environment variables of the same names, which take precedence. Settings
+// that are not given default to the build time options in config.h and display.h.
+// The control socket changes them on the main thread while the program runs, so they are written with __atomic_store_n(), and
+// read with __atomic_load_n() from the other threads.
+// The settings are only branched on once per frame or per scanline, outside of the per pixel loops, so they cost the same as the
+// build time options did. The panel controller, its bus width and pixel format, and the rotation stay build time options: they
+// select the controller's initialization sequence, GPIO and SPI setup and the layout of the SPI tasks throughout the program,
+// and are fixed by the hardware anyway, so they are not worth template specializing the main loop over.
+
+enum InterlacingMode
+{
+  INTERLACING_ADAPTIVE, // Interlace only when the changed pixels do not fit in the time of a frame
+  INTERLACING_NEVER,
+  INTERLACING_ALWAYS
+};
+
+enum DiffMethod
+{
+  DIFF_EXACT,
+  DIFF_FAST_BUT_COARSE // See FAST_BUT_COARSE_PIXEL_DIFF in config.h
+};
+
+enum UpdateStrategy
+{
+  UPDATE_SCANLINE_SPANS, // Diff each scanline to spans of changed pixels, and merge the spans across scanlines
+  UPDATE_SINGLE_RECTANGLE, // See UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF in config.h
+  UPDATE_FULL_FRAME, // See UPDATE_FRAMES_WITHOUT_DIFFING in config.h
+  UPDATE_ADAPTIVE // Pick one of the above per frame based on what the recent frames looked like, see update_strategy.cpp
+};
+
+struct Settings
+{
+  int targetFrameRate; // FBCP_TARGET_FRAME_RATE=<fps>
+  InterlacingMode interlacing; // FBCP_INTERLACING=adaptive|never|always
+  DiffMethod diffMethod; // FBCP_DIFF=exact|coarse
+  UpdateStrategy update; // FBCP_UPDATE=spans|rectangle|full|adaptive
+  // The SAVE_BATTERY_* policies of config.h. They only decide how long the GPU polling thread sleeps between snapshots.
+  bool sleepUntilTargetFrame; // FBCP_SLEEP_UNTIL_TARGET_FRAME=0|1
+  bool sleepWhenIdle; // FBCP_SLEEP_WHEN_IDLE=0|1
+  bool predictFrameArrivalTimes; // FBCP_PREDICT_FRAME_ARRIVAL_TIMES=0|1
+};
+
+extern Settings settings;
+
+// Names of the values of the settings that take one of a set of values, indexed by the value
+extern const char *interlacingModeNames[];
+extern const char *diffMethodNames[];
+extern const char *updateStrategyNames[];
+
+void LoadSettings(void);
+
+// Changes the setting with the given name, e.g. "FBCP_DIFF", to the given value. Returns false if the setting or value is invalid,
+// after printing out why, prefixed with source.
+bool ApplySetting(const char *key, const char *value, const char *source);
@@ -266,6 +266,11 @@ void WaitForPolledSPITransferToFinish()
 #error When building with #define ALL_TASKS_SHOULD_DMA enabled, -DUSE_DMA_TRANSFERS=ON should be set in CMake command line!
 #endif
 
+#if defined(SECONDARY_DISPLAY) && defined(DISPLAY_NEEDS_CHIP_SELECT_SIGNAL)
+// DMA runs the tasks back to back without the CPU in between to toggle the secondary panel's GPIO chip select line around each command
+#error SECONDARY_DISPLAY on a display that needs DISPLAY_NEEDS_CHIP_SELECT_SIGNAL is not compatible with ALL_TASKS_SHOULD_DMA!
+#endif
+
 // Synchonously performs a single SPI command byte + N data bytes transfer on the calling thread. Call in between a BEGIN_SPI_COMMUNICATION() and END_SPI_COMMUNICATION() pair.
 void RunSPITask(SPITask *task)
 {
@@ -335,6 +340,11 @@ void RunSPITask(SPITask *task)
 }
 #else
 
+#if defined(SECONDARY_DISPLAY) && defined(DISPLAY_NEEDS_CHIP_SELECT_SIGNAL)
+// GPIO chip select line that is toggled around each task along with the hardware one, or -1 if none. See SwitchBusToPanel().
+static int taskChipSelectGpio = -1;
+#endif
+
 void RunSPITask(SPITask *task)
 {
   WaitForPolledSPITransferToFinish();
@@ -344,6 +354,9 @@ void RunSPITask(SPITask *task)
   // transitions to let the CS line live. For most other displays, we just set CS line always enabled for the display throughout fbcp-ili9341 lifetime,
   // which is a tiny bit faster.
 #ifdef DISPLAY_NEEDS_CHIP_SELECT_SIGNAL
+#ifdef SECONDARY_DISPLAY
+  if (taskChipSelectGpio >= 0) CLEAR_GPIO(taskChipSelectGpio);
+#endif
   BEGIN_SPI_COMMUNICATION();
 #endif
 
@@ -402,6 +415,9 @@ void RunSPITask(SPITask *task)
 
 #ifdef DISPLAY_NEEDS_CHIP_SELECT_SIGNAL
   END_SPI_COMMUNICATION();
+#ifdef SECONDARY_DISPLAY
+  if (taskChipSelectGpio >= 0) SET_GPIO(taskChipSelectGpio);
+#endif
 #endif
 }
 #endif
@@ -412,22 +428,136 @@ volatile uint64_t spiThreadSleepStartTime = 0;
 volatile int spiThreadSleeping = 0;
 double spiUsecsPerByte;
 
-SPITask *GetTask() // Returns the first task in the queue, called in worker thread
+uint32_t spiQueuePeakOccupancyBytes = 0;
+
+void SampleSPIQueueOccupancy()
+{
+  uint32_t head = spiTaskMemory->queueHead, tail = spiTaskMemory->queueTail;
+  uint32_t used = (tail >= head) ? tail - head : SPI_QUEUE_SIZE - head + tail;
+  if (used > spiQueuePeakOccupancyBytes) spiQueuePeakOccupancyBytes = used;
+}
+
+static SPITask *PeekTask(SharedMemory *queue) // Returns the first task in the given queue, called in worker thread
 {
-  uint32_t head = spiTaskMemory->queueHead;
-  uint32_t tail = spiTaskMemory->queueTail;
+  uint32_t head = queue->queueHead;
+  uint32_t tail = queue->queueTail;
   if (head == tail) return 0;
-  SPITask *task = (SPITask*)(spiTaskMemory->buffer + head);
+  SPITask *task = (SPITask*)(queue->buffer + head);
   if (task->cmd == 0) // Wrapped around?
   {
-    spiTaskMemory->queueHead = 0;
+    queue->queueHead = 0;
     __sync_synchronize();
     if (tail == 0) return 0;
-    task = (SPITask*)spiTaskMemory->buffer;
+    task = (SPITask*)queue->buffer;
   }
   return task;
 }
 
+#ifdef SECONDARY_DISPLAY
+
+SharedMemory *spiTaskQueues[NUM_DISPLAY_PANELS] = {};
+volatile uint32_t spiTaskQueuesSignal = 0;
+
+#ifdef DISPLAY_USES_CS1
+static const int panelChipSelectPin[NUM_DISPLAY_PANELS] = { GPIO_SPI0_CE1, GPIO_SPI0_CE0 };
+#else
+static const int panelChipSelectPin[NUM_DISPLAY_PANELS] = { GPIO_SPI0_CE0, GPIO_SPI0_CE1 };
+#endif
+static const uint32_t panelBusPriority[NUM_DISPLAY_PANELS] = { PRIMARY_DISPLAY_BUS_PRIORITY, SECONDARY_DISPLAY_BUS_PRIORITY };
+
+// The panel whose chip select line is currently active
+static int busPanel = PRIMARY_PANEL;
+
+// Bus time that each panel has used, as the number of bytes it has sent scaled by 256/priority
+static uint64_t panelBusTime[NUM_DISPLAY_PANELS] = {};
+
+// Switching panels waits for the SPI FIFO to drain, so the active panel keeps the bus until it is this much ahead of the others
+#define PANEL_SWITCH_QUANTUM (4096 << 8)
+
+static int PanelOfTask(SPITask *task)
+{
+  for(int i = 1; i < NUM_DISPLAY_PANELS; ++i)
+    if ((uint8_t*)task >= spiTaskQueues[i]->buffer && (uint8_t*)task < spiTaskQueues[i]->buffer + SPI_QUEUE_SIZE)
+      return i;
+  return PRIMARY_PANEL;
+}
+
+// Displays that need to see the chip select line toggle for each command keep the hardware chip select of SPI0 on the primary panel, like
+// in a single display build. SPI0 drives only one chip select line at a time, so the secondary panel's line is a GPIO, and while the
+// secondary panel has the bus, the primary panel's line is switched from SPI0 to a deselected GPIO. RunSPITask() then toggles the GPIO
+// line around each task like SPI0 does for the primary panel.
+static void SwitchBusToPanel(int panel)
+{
+#ifdef USE_DMA_TRANSFERS
+  WaitForDMAFinished();
+#endif
+  WaitForPolledSPITransferToFinish();
+#ifdef DISPLAY_NEEDS_CHIP_SELECT_SIGNAL
+  if (panel == PRIMARY_PANEL)
+  {
+    SET_GPIO(panelChipSelectPin[SECONDARY_PANEL]);
+    SET_GPIO_MODE(panelChipSelectPin[PRIMARY_PANEL], 0x04);
+  }
+  else
+  {
+    SET_GPIO(panelChipSelectPin[PRIMARY_PANEL]);
+    SET_GPIO_MODE(panelChipSelectPin[PRIMARY_PANEL], 0x01);
+  }
+  taskChipSelectGpio = (panel == SECONDARY_PANEL) ? panelChipSelectPin[SECONDARY_PANEL] : -1;
+#else
+  SET_GPIO(panelChipSelectPin[busPanel]);
+  CLEAR_GPIO(panelChipSelectPin[panel]);
+#endif
+  busPanel = panel;
+}
+
+// The bus scheduler: out of the panels that have tasks pending, picks the one that has used the least bus time for its priority. Each
+// display controller keeps its own write window, so the tasks of different panels can be interleaved at any task boundary.
+SPITask *GetTask() // Returns the next task to run, called in worker thread
+{
+  SPITask *tasks[NUM_DISPLAY_PANELS];
+  int next = -1;
+  for(int i = 0; i < NUM_DISPLAY_PANELS; ++i)
+  {
+    tasks[i] = PeekTask(spiTaskQueues[i]);
+    if (tasks[i] && (next < 0 || panelBusTime[i] < panelBusTime[next])) next = i;
+  }
+  if (next < 0) return 0;
+  if (next != busPanel && tasks[busPanel] && panelBusTime[busPanel] < panelBusTime[next] + PANEL_SWITCH_QUANTUM) next = busPanel;
+
+  // Idle panels do not bank the bus time they did not use, or they would hog the bus when they get new tasks.
+  for(int i = 0; i < NUM_DISPLAY_PANELS; ++i)
+    if (!tasks[i]) panelBusTime[i] = MAX(panelBusTime[i], panelBusTime[next]);
+
+  if (next != busPanel) SwitchBusToPanel(next);
+  return tasks[next];
+}
+
+void DoneTask(SPITask *task) // Frees the first SPI task from its queue, called in worker thread
+{
+  const int panel = PanelOfTask(task);
+  SharedMemory *queue = spiTaskQueues[panel];
+  panelBusTime[panel] += ((uint64_t)(task->PayloadSize()+1) << 8) / panelBusPriority[panel];
+  __atomic_fetch_sub(&queue->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
+  queue->queueHead = (uint32_t)((uint8_t*)task - queue->buffer) + sizeof(SPITask) + task->size;
+  __sync_synchronize();
+}
+
+static bool SPITasksPending()
+{
+  for(int i = 0; i < NUM_DISPLAY_PANELS; ++i)
+    if (spiTaskQueues[i]->queueTail != spiTaskQueues[i]->queueHead)
+      return true;
+  return false;
+}
+
+#else
+
+SPITask *GetTask() // Returns the first task in the queue, called in worker thread
+{
+  return PeekTask(spiTaskMemory);
+}
+
 void DoneTask(SPITask *task) // Frees the first SPI task from the queue, called in worker thread
 {
   __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
@@ -435,6 +565,13 @@ void DoneTask(SPITask *task) // Frees the first SPI task from the queue, called
   __sync_synchronize();
 }
 
+static bool SPITasksPending()
+{
+  return spiTaskMemory->queueTail != spiTaskMemory->queueHead;
+}
+
+#endif
+
 extern volatile bool programRunning;
 
 void ExecuteSPITasks()
@@ -443,7 +580,7 @@ void ExecuteSPITasks()
   BEGIN_SPI_COMMUNICATION();
 #endif
   {
-    while(programRunning && spiTaskMemory->queueTail != spiTaskMemory->queueHead)
+    while(programRunning && SPITasksPending())
     {
       SPITask *task = GetTask();
       if (task)
@@ -469,7 +606,7 @@ void *spi_thread(void *unused)
 #endif
   while(programRunning)
   {
-    if (spiTaskMemory->queueTail != spiTaskMemory->queueHead)
+    if (SPITasksPending())
     {
       ExecuteSPITasks();
     }
@@ -480,7 +617,13 @@ void *spi_thread(void *unused)
       spiThreadSleepStartTime = t0;
       __atomic_store_n(&spiThreadSleeping, 1, __ATOMIC_RELAXED);
 #endif
+#ifdef SECONDARY_DISPLAY
+      // Read the signal before checking the queues one more time, so that tasks that are committed in between are not missed.
+      const uint32_t signal = __atomic_load_n(&spiTaskQueuesSignal, __ATOMIC_SEQ_CST);
+      if (programRunning && !SPITasksPending()) syscall(SYS_futex, &spiTaskQueuesSignal, FUTEX_WAIT, signal, 0, 0, 0); // Start sleeping until we get new tasks
+#else
       if (programRunning) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, spiTaskMemory->queueHead, 0, 0, 0); // Start sleeping until we get new tasks
+#endif
 #ifdef STATISTICS
       __atomic_store_n(&spiThreadSleeping, 0, __ATOMIC_RELAXED);
       uint64_t t1 = tick();
@@ -549,13 +692,25 @@ int InitSPI()
 #ifdef DISPLAY_USES_CS1
   SET_GPIO_MODE(GPIO_SPI0_CE1, 0x04);
 #endif
+#ifdef SECONDARY_DISPLAY
+  // The secondary panel's chip select line is a GPIO, see SwitchBusToPanel(). It follows the hardware one of the primary panel while the
+  // display is initialized, so that both panels receive the same initialization sequence.
+  SET_GPIO(panelChipSelectPin[SECONDARY_PANEL]);
+  SET_GPIO_MODE(panelChipSelectPin[SECONDARY_PANEL], 0x01);
+  taskChipSelectGpio = panelChipSelectPin[SECONDARY_PANEL];
+#endif
 #else
   // Set the SPI 0 pin explicitly to output, and enable chip select on the line by setting it to low.
   // fbcp-ili9341 assumes exclusive access to the SPI0 bus, and exclusive presence of only one device on the bus,
   // which is (permanently) activated here.
   SET_GPIO_MODE(GPIO_SPI0_CE0, 0x01);
   CLEAR_GPIO(GPIO_SPI0_CE0);
-#ifdef DISPLAY_USES_CS1
+#ifdef SECONDARY_DISPLAY
+  // Both panels are selected while the display is initialized, so that they receive the same initialization sequence. After that, the
+  // bus scheduler selects one panel at a time.
+  SET_GPIO_MODE(GPIO_SPI0_CE1, 0x01);
+  CLEAR_GPIO(GPIO_SPI0_CE1);
+#elif defined(DISPLAY_USES_CS1)
   SET_GPIO_MODE(GPIO_SPI0_CE1, 0x01);
 #endif
 #endif
@@ -593,6 +748,11 @@ int InitSPI()
 #endif
 
   spiTaskMemory->queueHead = spiTaskMemory->queueTail = spiTaskMemory->spiBytesQueued = 0;
+#ifdef SECONDARY_DISPLAY
+  spiTaskQueues[PRIMARY_PANEL] = spiTaskMemory;
+  spiTaskQueues[SECONDARY_PANEL] = (SharedMemory*)Malloc(SHARED_MEMORY_SIZE, "spi.cpp secondary display task memory");
+  spiTaskQueues[SECONDARY_PANEL]->queueHead = spiTaskQueues[SECONDARY_PANEL]->queueTail = spiTaskQueues[SECONDARY_PANEL]->spiBytesQueued = 0;
+#endif
 #endif
 
 #ifdef USE_DMA_TRANSFERS
@@ -605,6 +765,13 @@ int InitSPI()
 #if !defined(KERNEL_MODULE) && (!defined(KERNEL_MODULE_CLIENT) || defined(KERNEL_MODULE_CLIENT_DRIVES))
   printf("Initializing display\n");
   InitSPIDisplay();
+#ifdef SECONDARY_DISPLAY
+  SET_GPIO(panelChipSelectPin[SECONDARY_PANEL]);
+  busPanel = PRIMARY_PANEL;
+#ifdef DISPLAY_NEEDS_CHIP_SELECT_SIGNAL
+  taskChipSelectGpio = -1;
+#endif
+#endif
 
 #ifdef USE_SPI_THREAD
   // Create a dedicated thread to feed the SPI bus. While this is fast, it consumes a lot of CPU. It would be best to replace
@@ -666,7 +833,12 @@ void DeinitSPI()
   dma_free_writecombine(0, SHARED_MEMORY_SIZE, dmaSourceMemory, spiTaskMemoryPhysical);
   spiTaskMemoryPhysical = 0;
 #else
-  free(spiTaskMemory);
+#ifdef SECONDARY_DISPLAY
+  Free(spiTaskQueues[SECONDARY_PANEL]);
+  spiTaskMemory = spiTaskQueues[PRIMARY_PANEL];
+  spiTaskQueues[PRIMARY_PANEL] = spiTaskQueues[SECONDARY_PANEL] = 0;
+#endif
+  Free(spiTaskMemory);
 #endif
 #endif
   spiTaskMemory = 0;
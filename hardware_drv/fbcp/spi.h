@@ -84,7 +84,13 @@ extern volatile SPIRegisterFile *spi;
 // so for best performance, should be at least ~DISPLAY_WIDTH*DISPLAY_HEIGHT*BYTES_PER_PIXEL*2 bytes in size, plus some small
 // amount for structuring each SPITask command. Technically this can be something very small, like 4096b, and not need to contain
 // even a single full frame of data, but such small buffers can cause performance issues from threads starving.
+#ifdef COMPACT_MEMORY_PROFILE
+// Two frames are enough for the main thread to queue up a frame while the previous one is still being sent. The peak occupancy that is
+// printed at exit shows how much of it was actually needed.
+#define SHARED_MEMORY_SIZE (DISPLAY_DRAWABLE_WIDTH*DISPLAY_DRAWABLE_HEIGHT*SPI_BYTESPERPIXEL*2)
+#else
 #define SHARED_MEMORY_SIZE (DISPLAY_DRAWABLE_WIDTH*DISPLAY_DRAWABLE_HEIGHT*SPI_BYTESPERPIXEL*3)
+#endif
 #define SPI_QUEUE_SIZE (SHARED_MEMORY_SIZE - sizeof(SharedMemory))
 
 #if defined(SPI_3WIRE_DATA_COMMAND_FRAMING_BITS) && SPI_3WIRE_DATA_COMMAND_FRAMING_BITS == 1
@@ -256,6 +262,37 @@ extern dma_addr_t spiTaskMemoryPhysical;
 #define VIRT_TO_BUS(ptr) ((uintptr_t)(ptr) | 0xC0000000U)
 #endif
 extern SharedMemory *spiTaskMemory;
+
+#ifdef SECONDARY_DISPLAY
+
+#if defined(KERNEL_MODULE) || defined(KERNEL_MODULE_CLIENT)
+#error SECONDARY_DISPLAY is not supported with the kernel driver module
+#endif
+
+// Each display panel has its own task queue. AllocTask() and CommitTask() add tasks to the queue that spiTaskMemory points to, which is
+// the queue of the primary panel unless the main thread has selected another one with SelectPanelTaskQueue(). The SPI thread interleaves
+// the tasks of all queues, see GetTask().
+#define PRIMARY_PANEL 0
+#define SECONDARY_PANEL 1
+#define NUM_DISPLAY_PANELS 2
+extern SharedMemory *spiTaskQueues[NUM_DISPLAY_PANELS];
+
+static inline void SelectPanelTaskQueue(int panel) // Called on main thread
+{
+  spiTaskMemory = spiTaskQueues[panel];
+}
+
+// The SPI thread waits for tasks on all queues at once, so it sleeps on this futex word, which is bumped each time a queue gets new tasks.
+extern volatile uint32_t spiTaskQueuesSignal;
+#define WAKE_SPI_THREAD() do { \
+    __atomic_fetch_add(&spiTaskQueuesSignal, 1, __ATOMIC_SEQ_CST); \
+    syscall(SYS_futex, &spiTaskQueuesSignal, FUTEX_WAKE, 1, 0, 0, 0); \
+  } while(0)
+
+#else
+#define WAKE_SPI_THREAD() syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0)
+#endif
+
 extern double spiUsecsPerByte;
 
 extern SharedMemory *dmaSourceMemory; // TODO: Optimize away the need to have this at all, instead DMA directly from SPI ring buffer if possible
@@ -325,7 +362,7 @@ static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new S
     spiTaskMemory->queueTail = 0;
     __sync_synchronize();
 #if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
-    if (spiTaskMemory->queueHead == tail) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
+    if (spiTaskMemory->queueHead == tail) WAKE_SPI_THREAD(); // Wake the SPI thread if it was sleeping to get new tasks
 #endif
     tail = 0;
     newTail = bytesToAllocate;
@@ -372,7 +409,7 @@ static inline void CommitTask(SPITask *task) // Advertises the given SPI task fr
   __atomic_fetch_add(&spiTaskMemory->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
   __sync_synchronize();
 #if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
-  if (spiTaskMemory->queueHead == tail) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
+  if (spiTaskMemory->queueHead == tail) WAKE_SPI_THREAD(); // Wake the SPI thread if it was sleeping to get new tasks
 #endif
 }
 
@@ -393,6 +430,10 @@ void RunSPITask(SPITask *task);
 SPITask *GetTask(void);
 void DoneTask(SPITask *task);
 void DumpSPICS(uint32_t reg);
+
+// Records how much of the task ring is currently in use, called on the main thread after each frame has been queued.
+void SampleSPIQueueOccupancy(void);
+extern uint32_t spiQueuePeakOccupancyBytes;
 #ifdef RUN_WITH_REALTIME_THREAD_PRIORITY
 void SetRealtimeThreadPriority();
 #endif
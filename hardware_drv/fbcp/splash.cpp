@@ -0,0 +1,366 @@
+#include "config.h"
+#include "splash.h"
+
+#ifdef FAST_START_SPLASH
+
+#include <memory.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "display.h"
+#include "gpu.h"
+#include "spi.h"
+#include "transpose.h"
+#include "util.h"
+
+// Splash files are run length encoded R5G6B5 images. All fields are little endian, except for the pixels, which are stored big endian
+// like the display takes them in:
+//   char magic[4] = "FBSP";
+//   uint16_t width, height;
+//   followed by runs of { uint16_t count; uint16_t pixel; } that cover the image in scanline order.
+// The image is shown centered on the drawable area of the display. When the orientation is flipped in software, the image is in the same
+// landscape orientation as the HDMI output, and it is transposed to the display when loaded.
+//
+// The image can be followed by animation frames that are stored as deltas to the frame before them, see PlayBootAnimation():
+//   uint16_t delayMsecs; // How long the previous frame is shown before this one
+//   uint16_t numRects;
+//   followed by numRects of { uint16_t x, y, width, height; uint16_t pixels[width*height]; } that have changed, in image coordinates.
+// When the animation loops, it starts over from the first frame after the image, so the last frame should change the image back to
+// what it is at the start.
+#define SPLASH_MAGIC "FBSP"
+
+// Splash pixels in CPU native R5G6B5 like the framebuffers, and in display orientation
+static uint16_t *splashPixels = 0;
+static int splashX, splashY, splashWidth, splashHeight;
+
+// The splash is only needed until capture takes over, so its buffers come from the heap with malloc() instead of Malloc(), which would
+// carve them out of the memory arena ahead of the framebuffers and never get the space back.
+// Animation frames of the splash file, or null if it is a still image. They point into splashFile, which is kept until the hand-off.
+static uint8_t *splashFile = 0;
+static const uint8_t *animationFrames = 0, *animationFramesEnd = 0;
+static int numAnimationFrames = 0;
+
+static uint64_t BootTimeUsecs()
+{
+  timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+// Taken when the program is loaded, before main() runs, for measuring the time to first pixel
+static const uint64_t programStartTime = BootTimeUsecs();
+
+static inline uint16_t ReadU16(const uint8_t *&ptr)
+{
+  uint16_t value = ptr[0] | (ptr[1] << 8);
+  ptr += 2;
+  return value;
+}
+
+// Checks that the animation frames in [frames, end[ are well formed and stay inside the image, returns the number of frames or -1 if they are not.
+static int CountAnimationFrames(const uint8_t *frames, const uint8_t *end, int width, int height)
+{
+  int numFrames = 0;
+  while(frames < end)
+  {
+    if (end - frames < 4) return -1;
+    ReadU16(frames); // delayMsecs
+    const int numRects = ReadU16(frames);
+    for(int i = 0; i < numRects; ++i)
+    {
+      if (end - frames < 8) return -1;
+      const int x = ReadU16(frames), y = ReadU16(frames), w = ReadU16(frames), h = ReadU16(frames);
+      const size_t rectBytes = (size_t)w*h*sizeof(uint16_t);
+      if (x + w > width || y + h > height || (size_t)(end - frames) < rectBytes) return -1;
+      frames += rectBytes;
+    }
+    ++numFrames;
+  }
+  return numFrames;
+}
+
+// Reads the splash file and decodes its image, returns the decoded pixels in file orientation, or null if there is no valid splash file.
+static uint16_t *LoadSplashFile(const char *filename, int &width, int &height)
+{
+  FILE *handle = fopen(filename, "rb");
+  if (!handle)
+  {
+    printf("Splash image %s not found, leaving the display blank until capture starts\n", filename);
+    return 0;
+  }
+  fseek(handle, 0, SEEK_END);
+  const long fileSize = ftell(handle);
+  fseek(handle, 0, SEEK_SET);
+  uint8_t *file = (fileSize >= 8) ? (uint8_t*)malloc(fileSize) : 0;
+  const bool readOk = file && (fread(file, 1, fileSize, handle) == (size_t)fileSize);
+  fclose(handle);
+  if (!readOk || memcmp(file, SPLASH_MAGIC, 4))
+  {
+    printf("%s is not a splash image file\n", filename);
+    free(file);
+    return 0;
+  }
+
+  const uint8_t *ptr = file + 4, *end = file + fileSize;
+  width = ReadU16(ptr);
+  height = ReadU16(ptr);
+
+  // The image is in file orientation, i.e. transposed from the display when the orientation is flipped in software.
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  const int maxWidth = DISPLAY_DRAWABLE_HEIGHT, maxHeight = DISPLAY_DRAWABLE_WIDTH;
+#else
+  const int maxWidth = DISPLAY_DRAWABLE_WIDTH, maxHeight = DISPLAY_DRAWABLE_HEIGHT;
+#endif
+  if (width <= 0 || height <= 0 || width > maxWidth || height > maxHeight)
+  {
+    printf("Splash image %s of size %dx%d does not fit on the %dx%d display\n", filename, width, height, maxWidth, maxHeight);
+    free(file);
+    return 0;
+  }
+
+  // Each run takes four bytes and covers at most 65535 pixels, so reject files that are too short to cover the image before decoding them.
+  const size_t numPixels = (size_t)width*height;
+  if ((size_t)(end - ptr) / 4 * 0xFFFF < numPixels)
+  {
+    printf("Splash image %s is truncated\n", filename);
+    free(file);
+    return 0;
+  }
+
+  uint16_t *pixels = (uint16_t*)malloc(numPixels*sizeof(uint16_t));
+  if (!pixels)
+  {
+    free(file);
+    return 0;
+  }
+  size_t i = 0;
+  while(i < numPixels && end - ptr >= 4)
+  {
+    const size_t runLength = ReadU16(ptr);
+    const size_t count = MIN(runLength, numPixels - i);
+    const uint16_t pixel = (ptr[0] << 8) | ptr[1];
+    ptr += 2;
+    for(size_t runEnd = i + count; i < runEnd; ++i)
+      pixels[i] = pixel;
+  }
+  if (i < numPixels)
+  {
+    printf("Splash image %s is truncated\n", filename);
+    free(pixels);
+    free(file);
+    return 0;
+  }
+
+  numAnimationFrames = CountAnimationFrames(ptr, end, width, height);
+  if (numAnimationFrames > 0)
+  {
+    splashFile = file;
+    animationFrames = ptr;
+    animationFramesEnd = end;
+    printf("Splash image %s is a %dx%d animation of %d frames\n", filename, width, height, numAnimationFrames);
+  }
+  else
+  {
+    if (numAnimationFrames < 0) printf("Animation frames in %s are malformed, only showing the first frame\n", filename);
+    numAnimationFrames = 0;
+    free(file);
+  }
+  return pixels;
+}
+
+// Queues the given rectangle of the display to be filled with the pixels at src, or with black if src is null. Stride is in pixels.
+static void QueueRectangle(const uint16_t *src, int stride, int x, int y, int width, int height)
+{
+  if (width <= 0 || height <= 0) return;
+  QueueDisplayRectangle(src, stride, x, y, width, height);
+
+  // The main loop expects the write window to span the whole display when it starts, like ClearScreen() leaves it.
+  int bytesTransferred = 0; // Counted by the QUEUE_* macros
+  QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_X, 0, DISPLAY_WIDTH - 1);
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+  QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, 0, DISPLAY_HEIGHT - 1);
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+}
+
+void ShowSplash()
+{
+  int width, height;
+  uint16_t *pixels = LoadSplashFile(FAST_START_SPLASH, width, height);
+  if (!pixels) return;
+
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  splashPixels = (uint16_t*)malloc(width*height*sizeof(uint16_t));
+  if (splashPixels) TransposeFramebuffer(pixels, width*sizeof(uint16_t), splashPixels, height*sizeof(uint16_t), width, height);
+  free(pixels);
+  if (!splashPixels) return;
+  splashWidth = height;
+  splashHeight = width;
+#else
+  splashPixels = pixels;
+  splashWidth = width;
+  splashHeight = height;
+#endif
+
+  splashX = DISPLAY_COVERED_LEFT_SIDE + (DISPLAY_DRAWABLE_WIDTH - splashWidth) / 2;
+  splashY = DISPLAY_COVERED_TOP_SIDE + (DISPLAY_DRAWABLE_HEIGHT - splashHeight) / 2;
+
+  // Wait for the first band to go out to measure the time to first pixel, the rest of the splash is sent while the program keeps initializing.
+  const int firstBandHeight = MIN(DISPLAY_RECTANGLE_BAND_HEIGHT, splashHeight);
+  QueueRectangle(splashPixels, splashWidth, splashX, splashY, splashWidth, firstBandHeight);
+  while(spiTaskMemory->queueHead != spiTaskMemory->queueTail) usleep(100);
+  const uint64_t now = BootTimeUsecs();
+  printf("Splash image %s: first pixels on display %.2f msecs after program start, %.2f msecs after system boot\n", FAST_START_SPLASH, (now - programStartTime) / 1000.0, now / 1000.0);
+  QueueRectangle(splashPixels + firstBandHeight*splashWidth, splashWidth, splashX, splashY + firstBandHeight, splashWidth, splashHeight - firstBandHeight);
+}
+
+// Applies the changed rectangles of an animation frame to the splash pixels, and queues them to the display. Returns the start of the next frame.
+static const uint8_t *PlayAnimationFrame(const uint8_t *frame)
+{
+  const int numRects = ReadU16(frame);
+  for(int i = 0; i < numRects; ++i)
+  {
+    const int x = ReadU16(frame), y = ReadU16(frame), w = ReadU16(frame), h = ReadU16(frame);
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+    for(int Y = 0; Y < h; ++Y)
+      for(int X = 0; X < w; ++X, frame += 2)
+        splashPixels[(x + X)*splashWidth + y + Y] = (frame[0] << 8) | frame[1];
+    QueueRectangle(splashPixels + x*splashWidth + y, splashWidth, splashX + y, splashY + x, h, w);
+#else
+    for(int Y = 0; Y < h; ++Y)
+    {
+      uint16_t *scanline = splashPixels + (y + Y)*splashWidth + x;
+      for(int X = 0; X < w; ++X, frame += 2)
+        scanline[X] = (frame[0] << 8) | frame[1];
+    }
+    QueueRectangle(splashPixels + y*splashWidth + x, splashWidth, splashX + x, splashY + y, w, h);
+#endif
+  }
+  return frame;
+}
+
+#ifdef BOOT_ANIMATION_HANDOFF_SOCKET
+// Returns a listening socket that is connected to when the boot animation should hand the display over to capture, or -1 on failure.
+static int OpenHandOffSocket()
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, BOOT_ANIMATION_HANDOFF_SOCKET, sizeof(addr.sun_path) - 1);
+  unlink(addr.sun_path);
+  if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+#endif
+
+extern volatile bool programRunning;
+
+static pthread_t animationThread;
+static bool animationThreadRunning = false;
+
+static void *boot_animation_thread(void*)
+{
+  int handOffSocket = -1;
+#ifdef BOOT_ANIMATION_HANDOFF_SOCKET
+  handOffSocket = OpenHandOffSocket();
+  if (handOffSocket < 0) printf("Failed to listen on boot animation hand-off socket %s, playing the animation through once\n", BOOT_ANIMATION_HANDOFF_SOCKET);
+#endif
+
+  const uint8_t *frame = animationFrames;
+  int numFramesPlayed = 0;
+  while(programRunning)
+  {
+    if (frame == animationFramesEnd)
+    {
+      if (handOffSocket < 0) break; // Without a hand-off socket, the animation plays through once
+      frame = animationFrames;
+    }
+    const int delayMsecs = ReadU16(frame);
+    if (handOffSocket >= 0)
+    {
+      pollfd handOff = { handOffSocket, POLLIN, 0 };
+      if (poll(&handOff, 1, delayMsecs) > 0)
+      {
+        close(accept(handOffSocket, 0, 0));
+        break;
+      }
+    }
+    else
+      usleep(delayMsecs * 1000);
+    frame = PlayAnimationFrame(frame);
+    ++numFramesPlayed;
+  }
+
+#ifdef BOOT_ANIMATION_HANDOFF_SOCKET
+  if (handOffSocket >= 0)
+  {
+    close(handOffSocket);
+    unlink(BOOT_ANIMATION_HANDOFF_SOCKET);
+  }
+#endif
+  printf("Boot animation played %d frames, handing the display over to capture\n", numFramesPlayed);
+  return 0;
+}
+
+void PlayBootAnimation()
+{
+  if (!splashPixels || !animationFrames) return;
+  // Until HandOverSplashToCapture(), the animation is the only one to queue tasks to the display, so it can run alongside the GPU initialization
+  int rc = pthread_create(&animationThread, NULL, boot_animation_thread, NULL);
+  if (rc != 0) FATAL_ERROR("Failed to create boot animation thread!");
+  animationThreadRunning = true;
+}
+
+void HandOverSplashToCapture(uint16_t *prevFramebuffer)
+{
+  if (animationThreadRunning)
+  {
+    pthread_join(animationThread, NULL);
+    animationThreadRunning = false;
+  }
+  free(splashFile);
+  splashFile = 0;
+  animationFrames = animationFramesEnd = 0;
+  if (!splashPixels) return;
+
+  // Captured frames cover the rectangle [displayXOffset, displayXOffset+gpuFrameWidth[ x [displayYOffset, displayYOffset+gpuFrameHeight[ of the display
+  const int x = MAX(splashX, displayXOffset), endX = MIN(splashX + splashWidth, displayXOffset + gpuFrameWidth);
+  const int y = MAX(splashY, displayYOffset), endY = MIN(splashY + splashHeight, displayYOffset + gpuFrameHeight);
+  if (x < endX && y < endY)
+  {
+    const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+    for(int Y = y; Y < endY; ++Y)
+      memcpy(prevFramebuffer + (Y - displayYOffset)*stride + (x - displayXOffset), splashPixels + (Y - splashY)*splashWidth + (x - splashX), (endX - x)*sizeof(uint16_t));
+
+    // Clear the parts of the splash around the captured area: above and below it, and to its left and right.
+    QueueRectangle(0, 0, splashX, splashY, splashWidth, y - splashY);
+    QueueRectangle(0, 0, splashX, endY, splashWidth, splashY + splashHeight - endY);
+    QueueRectangle(0, 0, splashX, y, x - splashX, endY - y);
+    QueueRectangle(0, 0, endX, y, splashX + splashWidth - endX, endY - y);
+  }
+  else
+    QueueRectangle(0, 0, splashX, splashY, splashWidth, splashHeight);
+
+  free(splashPixels);
+  splashPixels = 0;
+}
+
+#else
+
+void ShowSplash() {}
+void PlayBootAnimation() {}
+void HandOverSplashToCapture(uint16_t *prevFramebuffer) {}
+
+#endif
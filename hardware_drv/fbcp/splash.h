@@ -0,0 +1,27 @@
+#pragma once
+
+#include <inttypes.h>
+
+// All functions here are no-op when FAST_START_SPLASH is undef so they can be
+// called unconditionnaly.
+
+// Loads the splash image and queues it to the display. Must be called right after
+// InitSPI(), so that the SPI thread sends the splash out while the rest of the
+// program (GPU capture in particular) is still initializing.
+void ShowSplash(void);
+
+// If the splash file also contains animation frames, starts playing them on a thread
+// of its own, until a connection is made to BOOT_ANIMATION_HANDOFF_SOCKET, or through
+// once if it is undef. Must be called after ShowSplash() and before InitGPU(), so that
+// GPU capture initializes while the animation plays. Frames are only captured after
+// HandOverSplashToCapture(), see StartGPUCapture().
+void PlayBootAnimation(void);
+
+// Hands the display over from the splash to captured frames. Waits for the boot
+// animation to finish first, if one is playing. Must be called once the framebuffers
+// have been allocated: prevFramebuffer is the framebuffer that
+// holds what the display is currently showing, so the parts of the splash that
+// are covered by captured frames are written to it, and the first frame then
+// only updates the pixels that differ from the splash. The rest of the splash
+// is cleared.
+void HandOverSplashToCapture(uint16_t *prevFramebuffer);
@@ -7,6 +7,10 @@
 #include <memory.h>
 #include <stdio.h>
 
+#ifdef ST7789
+static bool rowsMirroredInFrameMemory = false;
+#endif
+
 void InitST7735R()
 {
   // If a Reset pin is defined, toggle it briefly high->low->high to enable the device. Some devices do not have a reset pin, in which case compile with GPIO_TFT_RESET_PIN left undefined.
@@ -39,6 +43,11 @@ void InitST7735R()
     SPI_TRANSFER(0x3A/*COLMOD: Pixel Format Set*/, 0x05/*16bpp*/);
     usleep(20 * 1000);
 
+#if defined(DMA_READS_PIXELS_DIRECTLY_FROM_FRAMEBUFFER) && defined(DISPLAY_SUPPORTS_LITTLE_ENDIAN_PIXELS)
+    // Pixels are DMAd out as-is from the framebuffer, so ask the display to interpret them in little endian order.
+    SPI_TRANSFER(0xB0/*RAMCTRL: RAM Control*/, 0x00/*RAM access from MCU interface*/, 0xF8/*EPF=11, ENDIAN=1: little endian*/);
+#endif
+
 #define MADCTL_BGR_PIXEL_ORDER (1<<3)
 #define MADCTL_ROW_COLUMN_EXCHANGE (1<<5)
 #define MADCTL_COLUMN_ADDRESS_ORDER_SWAP (1<<6)
@@ -93,6 +102,7 @@ void InitST7735R()
     // direction so that contents of Y=80...319 is displayed instead of Y=0...239.
     if ((madctl & MADCTL_ROW_ADDRESS_ORDER_SWAP))
       SPI_TRANSFER(0x37/*VSCSAD: Vertical Scroll Start Address of RAM*/, 0, 320 - DISPLAY_WIDTH);
+    rowsMirroredInFrameMemory = (madctl & MADCTL_ROW_ADDRESS_ORDER_SWAP) != 0;
 #endif
 
     // TODO: The 0xB1 command is not Frame Rate Control for ST7789VW, 0xB3 is (add support to it)
@@ -168,6 +178,36 @@ void TurnDisplayOn()
 //  printf("Turned display ON\n");
 }
 
+#ifdef ST7789
+void QueueEnterPartialDisplayMode(int y, int endY)
+{
+  // PTLAR addresses lines of the 320 line frame memory, so with the row address order swapped, the area needs to be mirrored the same way the
+  // written pixels are (see the VSCSAD comment in InitST7735R())
+  int startLine = y, endLine = endY - 1;
+  if (rowsMirroredInFrameMemory)
+  {
+    startLine = 319 - (endY - 1);
+    endLine = 319 - y;
+  }
+  QUEUE_SPI_TRANSFER(0x30/*PTLAR: Partial Area*/, (uint8_t)(startLine >> 8), (uint8_t)startLine, (uint8_t)(endLine >> 8), (uint8_t)endLine);
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+  QUEUE_SPI_TRANSFER(0x12/*PTLON: Partial Display Mode On*/);
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+}
+
+void QueueExitPartialDisplayMode()
+{
+  QUEUE_SPI_TRANSFER(0x13/*NORON: Partial off (normal)*/);
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+  // NORON also leaves vertical scroll mode, so restore the scroll offset that was set up in InitST7735R()
+  if (rowsMirroredInFrameMemory)
+  {
+    QUEUE_SPI_TRANSFER(0x37/*VSCSAD: Vertical Scroll Start Address of RAM*/, 0, 320 - DISPLAY_WIDTH);
+    IN_SINGLE_THREADED_MODE_RUN_TASK();
+  }
+}
+#endif
+
 void DeinitSPIDisplay()
 {
   ClearScreen();
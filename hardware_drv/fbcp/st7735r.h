@@ -56,6 +56,22 @@ void TurnDisplayOff(void);
 // (ST7735R does not care about this)
 // TODO: It is actually untested if ST7789VW really needs this, but does work with it, so kept for now
 #define DISPLAY_NEEDS_CHIP_SELECT_SIGNAL
+
+// The RAMCTRL command on ST7789 has an ENDIAN bit that allows receiving RGB565 pixels in little endian byte order.
+#define DISPLAY_SUPPORTS_LITTLE_ENDIAN_PIXELS
+
+// Partial display mode (PTLAR/PTLON), used by PANEL_POWER_SAVING. The partial area is given as the range [y, endY[ of write window rows.
+#define DISPLAY_SUPPORTS_PARTIAL_MODE
+void QueueEnterPartialDisplayMode(int y, int endY);
+void QueueExitPartialDisplayMode(void);
+
+// Idle mode (IDMON 0x39/IDMOFF 0x38), used by PANEL_POWER_SAVING: the panel shows only the most significant bit of each color channel.
+#define DISPLAY_SUPPORTS_IDLE_MODE
+
+// FRCTRL2: Frame Rate Control in Normal Mode. RTNA=0x0F is the power-on default of 60Hz, RTNA=0x1F gives 39Hz.
+#define DISPLAY_FRAME_RATE_CONTROL 0xC6
+#define DISPLAY_FRAME_RATE_NORMAL 0x0F
+#define DISPLAY_FRAME_RATE_LOW 0x1F
 #endif
 
 #endif
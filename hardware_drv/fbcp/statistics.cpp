@@ -12,11 +12,13 @@
 
 #include "tick.h"
 #include "text.h"
+#include "overlay.h"
 #include "spi.h"
 #include "util.h"
 #include "mailbox.h"
 #include "mem_alloc.h"
 #include "dma.h"
+#include "settings.h"
 
 volatile uint64_t timeWastedPollingGPU = 0;
 volatile float statsSpiBusSpeed = 0;
@@ -86,33 +88,49 @@ void UpdateStatisticsNumbers()
   statsCpuFrequency = (int)MailboxRet2(0x00030002/*Get Clock Rate*/, 0x3/*ARM*/) / 1000000;
 }
 
-void DrawStatisticsOverlay(uint16_t *framebuffer)
+// Each text field of the statistics HUD lives in an overlay of its own, so that only the fields whose text changed get sent to the display.
+#define MAX_STATISTICS_OVERLAYS 16
+static Overlay *statisticsOverlays[MAX_STATISTICS_OVERLAYS] = {};
+static int numStatisticsOverlaysDrawn = 0;
+
+static void DrawStatisticsText(const char *text, int x, int y, uint16_t color)
+{
+  Overlay *&o = statisticsOverlays[numStatisticsOverlaysDrawn++];
+  if (!o) o = CreateOverlay(32*TEXT_CELL_WIDTH*TEXT_CELL_HEIGHT, "statistics.cpp text overlay");
+  DrawOverlayText(o, text, x, y, color, 0);
+}
+
+static void UpdateStatisticsOverlays()
 {
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, fpsText, 1, 1, fpsColor, 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, statsFrameSkipText, strlen(fpsText)*6, 1, RGB565(31,0,0), 0);
+  numStatisticsOverlaysDrawn = 0;
+  DrawStatisticsText(fpsText, 1, 1, fpsColor);
+  DrawStatisticsText(statsFrameSkipText, strlen(fpsText)*6, 1, RGB565(31,0,0));
 
 #if DISPLAY_DRAWABLE_WIDTH > 130
 #ifdef USE_DMA_TRANSFERS
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, dmaChannelsText, 1, 10, RGB565(31, 44, 8), 0);
+  DrawStatisticsText(dmaChannelsText, 1, 10, RGB565(31, 44, 8));
 #endif
 #ifdef USE_SPI_THREAD
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiUsagePercentageText, 75, 10, spiUsageColor, 0);
+  DrawStatisticsText(spiUsagePercentageText, 75, 10, spiUsageColor);
 #endif
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiBusDataRateText, 60, 1, 0xFFFF, 0);
+  DrawStatisticsText(spiBusDataRateText, 60, 1, 0xFFFF);
 #endif
 
 #if DISPLAY_DRAWABLE_WIDTH > 180
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiSpeedText, 120, 1, RGB565(31,14,20), 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiSpeedText2, 120, 10, RGB565(10,24,31), 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, cpuTemperatureText, 190, 1, cpuTemperatureColor, 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, gpuPollingWastedText, 222, 1, gpuPollingWastedColor, 0);
+  DrawStatisticsText(spiSpeedText, 120, 1, RGB565(31,14,20));
+  DrawStatisticsText(spiSpeedText2, 120, 10, RGB565(10,24,31));
+  DrawStatisticsText(cpuTemperatureText, 190, 1, cpuTemperatureColor);
+  DrawStatisticsText(gpuPollingWastedText, 222, 1, gpuPollingWastedColor);
 #endif
 
 #if (defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && DISPLAY_DRAWABLE_HEIGHT >= 290) || (!defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && DISPLAY_DRAWABLE_WIDTH >= 290)
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, cpuMemoryUsedText, 250, 1, RGB565(31,50,21), 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, gpuMemoryUsedText, 250, 10, RGB565(31,50,31), 0);
+  DrawStatisticsText(cpuMemoryUsedText, 250, 1, RGB565(31,50,21));
+  DrawStatisticsText(gpuMemoryUsedText, 250, 10, RGB565(31,50,31));
 #endif
+}
 
+void DrawStatisticsOverlay(uint16_t *framebuffer)
+{
 #ifdef FRAME_COMPLETION_TIME_STATISTICS
 
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
@@ -160,7 +178,7 @@ void RefreshStatisticsOverlayText()
 #ifdef FRAME_COMPLETION_TIME_STATISTICS
   if (frameCompletionTimeHistorySize > 1)
   {
-    uint64_t maxInterval = 4000000 / TARGET_FRAME_RATE;
+    uint64_t maxInterval = 4000000 / settings.targetFrameRate;
     uint64_t accumIntervals = 0;
     for(int i = 0; i < frameCompletionTimeHistorySize-1; ++i)
     {
@@ -168,7 +186,7 @@ void RefreshStatisticsOverlayText()
       accumIntervals += interval;
       statsFrameIntervalsY[i] = FRAMERATE_GRAPH_MAX_Y - (FRAMERATE_GRAPH_MAX_Y - FRAMERATE_GRAPH_MIN_Y) * interval / maxInterval;
     }
-    statsTargetFrameRateY = FRAMERATE_GRAPH_MAX_Y - (FRAMERATE_GRAPH_MAX_Y - FRAMERATE_GRAPH_MIN_Y) * (1000000/TARGET_FRAME_RATE) / maxInterval;
+    statsTargetFrameRateY = FRAMERATE_GRAPH_MAX_Y - (FRAMERATE_GRAPH_MAX_Y - FRAMERATE_GRAPH_MIN_Y) * (1000000/settings.targetFrameRate) / maxInterval;
     statsAvgFrameRateIntervalY = FRAMERATE_GRAPH_MAX_Y - (FRAMERATE_GRAPH_MAX_Y - FRAMERATE_GRAPH_MIN_Y) * (accumIntervals / (frameCompletionTimeHistorySize-1)) / maxInterval;
     statsFrameIntervalsSize = frameCompletionTimeHistorySize-1;
   }
@@ -285,6 +303,8 @@ void RefreshStatisticsOverlayText()
   if (totalGpuMemoryUsed > 0)
     sprintf(gpuMemoryUsedText, "GPU:%.2f" HINTSUFFIX, totalGpuMemoryUsed/1024.0/1024.0);
 #endif
+
+  UpdateStatisticsOverlays();
 }
 #else
 void RefreshStatisticsOverlayText() {}
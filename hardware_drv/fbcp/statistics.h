@@ -4,7 +4,9 @@
 
 #include "gpu.h"
 
+// Updates the statistics text, which is shown via overlays (see overlay.h)
 void RefreshStatisticsOverlayText(void);
+// Draws the parts of the statistics HUD that are not overlays (the frame completion time graph) to the framebuffer
 void DrawStatisticsOverlay(uint16_t *framebuffer);
 
 #ifdef STATISTICS
@@ -1,9 +1,152 @@
 #include "config.h"
 #include "text.h"
 #include "display.h"
+#include "mem_alloc.h"
+#include "util.h"
+
+#include <memory.h>
+#include <string.h>
+
+// #define BENCHMARK_TEXT_RENDERING // Uncomment to time DrawText() against the original bit by bit font renderer at first use, and to check that both produce the same pixels
+
+#ifdef BENCHMARK_TEXT_RENDERING
+#include <stdio.h>
+#include <stdlib.h>
+#include "tick.h"
+#endif
+
+#define NUM_GLYPHS (127-32)
+#define GLYPH_PIXELS (TEXT_CELL_WIDTH*TEXT_CELL_HEIGHT)
+
+// The HUD uses a dozen or so different colors, so this many atlases avoids re-rasterizing in practice.
+#define GLYPH_ATLAS_CACHE_SIZE 16
+
+// The font pre-expanded to RGB565 pixels for one foreground/background colour pair. Glyph cells are stored in the same orientation
+// as the framebuffer, so that each glyph row (or column when flipping in software) can be copied to the framebuffer in one go.
+struct GlyphAtlas
+{
+  uint16_t color, bgColor;
+  uint16_t *pixels; // NUM_GLYPHS cells of GLYPH_PIXELS each
+};
+
+static GlyphAtlas glyphAtlases[GLYPH_ATLAS_CACHE_SIZE];
+static int numGlyphAtlases = 0;
+static int nextGlyphAtlasToEvict = 0;
+
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+#define CELL_AT(x, y) ((x)*TEXT_CELL_HEIGHT+(y))
+#else
+#define CELL_AT(x, y) ((y)*TEXT_CELL_WIDTH+(x))
+#endif
+
+static void RasterizeGlyph(uint16_t *cell, int ch, uint16_t color, uint16_t bgColor)
+{
+  for(int i = 0; i < GLYPH_PIXELS; ++i)
+    cell[i] = bgColor;
+
+  // Glyph bitmaps have MONACO_WIDTH bits per row, and start monaco_height_adjust[ch] rows below the y coordinate of the text, which is row 2 of the cell.
+  const uint8_t *bits = monaco_font + ch*MONACO_BYTES_PER_CHAR;
+  const int y = 2 + monaco_height_adjust[ch];
+  for(int i = 0; i < MONACO_WIDTH*MONACO_HEIGHT && y + i/MONACO_WIDTH < TEXT_CELL_HEIGHT; ++i)
+    if ((bits[i>>3] & (1 << (i&7))))
+      cell[CELL_AT(i % MONACO_WIDTH, y + i/MONACO_WIDTH)] = color;
+}
+
+static const uint16_t *GetGlyphAtlas(uint16_t color, uint16_t bgColor)
+{
+  for(int i = 0; i < numGlyphAtlases; ++i)
+    if (glyphAtlases[i].color == color && glyphAtlases[i].bgColor == bgColor)
+      return glyphAtlases[i].pixels;
+
+  GlyphAtlas *atlas;
+  if (numGlyphAtlases < GLYPH_ATLAS_CACHE_SIZE)
+  {
+    atlas = &glyphAtlases[numGlyphAtlases++];
+    atlas->pixels = (uint16_t*)Malloc(NUM_GLYPHS*GLYPH_PIXELS*sizeof(uint16_t), "text.cpp glyph atlas");
+  }
+  else // All atlases in use, recycle them in round robin order
+  {
+    atlas = &glyphAtlases[nextGlyphAtlasToEvict];
+    nextGlyphAtlasToEvict = (nextGlyphAtlasToEvict + 1) % GLYPH_ATLAS_CACHE_SIZE;
+  }
+
+  atlas->color = color;
+  atlas->bgColor = bgColor;
+  for(int ch = 0; ch < NUM_GLYPHS; ++ch)
+    RasterizeGlyph(atlas->pixels + ch*GLYPH_PIXELS, ch, color, bgColor);
+  return atlas->pixels;
+}
+
+static inline int GlyphIndex(char c)
+{
+  uint8_t ch = (uint8_t)c;
+  return (ch < 32 || ch >= 127) ? 0 : ch - 32;
+}
+
+#ifdef BENCHMARK_TEXT_RENDERING
+static void BenchmarkTextRendering();
+#endif
 
 void DrawText(uint16_t *framebuffer, int framebufferWidth, int framebufferStrideBytes, int framebufferHeight, const char *text, int x, int y, uint16_t color, uint16_t bgColor)
 {
+#ifdef BENCHMARK_TEXT_RENDERING
+  static bool benchmarked = false;
+  if (!benchmarked)
+  {
+    benchmarked = true;
+    BenchmarkTextRendering();
+  }
+#endif
+
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  const int W = framebufferHeight;
+  const int H = framebufferWidth;
+#else
+  const int W = framebufferWidth;
+  const int H = framebufferHeight;
+#endif
+  const int stride = framebufferStrideBytes>>1;
+
+  // Clip the whole string once, after which glyph rows are copied without any per pixel checks
+  const int top = y - 2;
+  const int startX = MAX(x, 0), endX = MIN(x + (int)strlen(text)*TEXT_CELL_WIDTH, W);
+  const int startY = MAX(top, 0), endY = MIN(top + TEXT_CELL_HEIGHT, H);
+  if (startX >= endX || startY >= endY) return;
+
+  const uint16_t *atlas = GetGlyphAtlas(color, bgColor);
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // Framebuffer scanlines run down along the text, so each glyph column is one contiguous run of pixels
+  const bool unclippedColumns = (endY - startY == TEXT_CELL_HEIGHT);
+  const int columnBytes = (endY - startY)*sizeof(uint16_t);
+  for(int X = startX; X < endX; ++X)
+  {
+    const int cellX = X - x;
+    const uint16_t *column = atlas + GlyphIndex(text[cellX / TEXT_CELL_WIDTH])*GLYPH_PIXELS + CELL_AT(cellX % TEXT_CELL_WIDTH, startY - top);
+    if (unclippedColumns) memcpy(framebuffer + X*stride + startY, column, TEXT_CELL_HEIGHT*sizeof(uint16_t)); // Constant size, so the copy gets inlined
+    else memcpy(framebuffer + X*stride + startY, column, columnBytes);
+  }
+#else
+  const int firstChar = (startX - x) / TEXT_CELL_WIDTH, lastChar = (endX - 1 - x) / TEXT_CELL_WIDTH;
+  for(int Y = startY; Y < endY; ++Y)
+  {
+    uint16_t *scanline = framebuffer + Y*stride + startX;
+    for(int i = firstChar; i <= lastChar; ++i)
+    {
+      const int cellStartX = MAX(x + i*TEXT_CELL_WIDTH, startX), cellEndX = MIN(x + (i+1)*TEXT_CELL_WIDTH, endX);
+      const uint16_t *row = atlas + GlyphIndex(text[i])*GLYPH_PIXELS + CELL_AT(cellStartX - x - i*TEXT_CELL_WIDTH, Y - top);
+      if (cellEndX - cellStartX == TEXT_CELL_WIDTH) memcpy(scanline, row, TEXT_CELL_WIDTH*sizeof(uint16_t)); // Constant size, so the copy gets inlined
+      else memcpy(scanline, row, (cellEndX - cellStartX)*sizeof(uint16_t));
+      scanline += cellEndX - cellStartX;
+    }
+  }
+#endif
+}
+
+#ifdef BENCHMARK_TEXT_RENDERING
+// The original renderer, which decodes the font bit by bit for each drawn pixel. Apart from the cell rows it leaves untouched,
+// DrawText() must produce identical output.
+static void DrawTextPerPixel(uint16_t *framebuffer, int framebufferWidth, int framebufferStrideBytes, int framebufferHeight, const char *text, int x, int y, uint16_t color, uint16_t bgColor)
+{
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
   const int W = framebufferHeight;
   const int H = framebufferWidth;
@@ -64,3 +207,29 @@ void DrawText(uint16_t *framebuffer, int framebufferWidth, int framebufferStride
     x += 6;
   }
 }
+
+static void BenchmarkTextRendering()
+{
+  const int size = 320, strideBytes = size*sizeof(uint16_t), numIterations = 10000;
+  const char *text = "SPI:15.625MHz (/16) $%&@ 0123456789";
+  const int positions[][2] = { { 1, 10 }, { -5, 3 }, { 100, size-4 } }; // Unclipped, clipped at the left and at the bottom
+  uint16_t *reference = (uint16_t*)calloc(size*size, sizeof(uint16_t));
+  uint16_t *result = (uint16_t*)calloc(size*size, sizeof(uint16_t));
+
+  uint64_t t0 = tick();
+  for(int i = 0; i < numIterations; ++i)
+    for(int j = 0; j < 3; ++j)
+      DrawTextPerPixel(reference, size, strideBytes, size, text, positions[j][0], positions[j][1], 0xFFFF, 0);
+  uint64_t t1 = tick();
+  for(int i = 0; i < numIterations; ++i)
+    for(int j = 0; j < 3; ++j)
+      DrawText(result, size, strideBytes, size, text, positions[j][0], positions[j][1], 0xFFFF, 0);
+  uint64_t t2 = tick();
+
+  const double perPixelUsecs = (double)(t1 - t0) / (3*numIterations), atlasUsecs = (double)(t2 - t1) / (3*numIterations);
+  printf("DrawText() benchmark: per pixel renderer %.3f usecs, glyph atlas renderer %.3f usecs per string (%.2fx faster). Output %s.\n",
+    perPixelUsecs, atlasUsecs, perPixelUsecs / atlasUsecs, memcmp(reference, result, size*strideBytes) ? "DIFFERS" : "matches");
+  free(reference);
+  free(result);
+}
+#endif
@@ -1063,4 +1063,11 @@ static const int8_t monaco_height_adjust[] = {
 
 #define RGB565(r, g, b) (((r) << 11) | ((g) << 5) | (b))
 
+// Each character of text occupies a cell of this many pixels, starting two rows above the y coordinate the text is drawn at
+// (the '$' glyph reaches that high).
+#define TEXT_CELL_WIDTH (MONACO_WIDTH+1)
+#define TEXT_CELL_HEIGHT (MONACO_HEIGHT+1)
+
+// Draws text so that its character cells fully cover the area [x, x+TEXT_CELL_WIDTH*strlen(text)[ x [y-2, y-2+TEXT_CELL_HEIGHT[, clipped
+// to the framebuffer. With DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE, x runs along framebuffer columns and y along scanlines.
 void DrawText(uint16_t *framebuffer, int framebufferWidth, int framebufferStrideBytes, int framebufferHeight, const char *text, int x, int y, uint16_t color, uint16_t bgColor);
@@ -0,0 +1,167 @@
+#include "config.h"
+
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+
+#include <memory.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TRANSPOSE_USE_NEON
+#endif
+
+#include "transpose.h"
+#include "util.h"
+
+// #define BENCHMARK_TRANSPOSE // Uncomment to time the tiled transpose against the original per pixel loop at first use, and to check that all produce the same pixels
+
+#ifdef BENCHMARK_TRANSPOSE
+#include <stdio.h>
+#include <stdlib.h>
+#include "tick.h"
+#endif
+
+// The frame is transposed in tiles of this many pixels squared, so that the source and destination scanlines that a tile touches
+// stay in the L1 cache while the tile is processed. Must be a multiple of 8.
+#define TRANSPOSE_TILE_SIZE 16
+
+#ifdef TRANSPOSE_USE_NEON
+// Transposes an 8x8 block of pixels. Strides are in pixels.
+static inline void Transpose8x8(const uint16_t *src, int srcStride, uint16_t *dst, int dstStride)
+{
+  // Transpose 2x2 blocks of pixels, then 2x2 blocks of pixel pairs, and finally swap the 4x4 quadrants.
+  uint16x8x2_t t01 = vtrnq_u16(vld1q_u16(src), vld1q_u16(src + srcStride));
+  uint16x8x2_t t23 = vtrnq_u16(vld1q_u16(src + 2*srcStride), vld1q_u16(src + 3*srcStride));
+  uint16x8x2_t t45 = vtrnq_u16(vld1q_u16(src + 4*srcStride), vld1q_u16(src + 5*srcStride));
+  uint16x8x2_t t67 = vtrnq_u16(vld1q_u16(src + 6*srcStride), vld1q_u16(src + 7*srcStride));
+  uint32x4x2_t u02 = vtrnq_u32(vreinterpretq_u32_u16(t01.val[0]), vreinterpretq_u32_u16(t23.val[0]));
+  uint32x4x2_t u13 = vtrnq_u32(vreinterpretq_u32_u16(t01.val[1]), vreinterpretq_u32_u16(t23.val[1]));
+  uint32x4x2_t u46 = vtrnq_u32(vreinterpretq_u32_u16(t45.val[0]), vreinterpretq_u32_u16(t67.val[0]));
+  uint32x4x2_t u57 = vtrnq_u32(vreinterpretq_u32_u16(t45.val[1]), vreinterpretq_u32_u16(t67.val[1]));
+  uint16x8_t a0 = vreinterpretq_u16_u32(u02.val[0]), a1 = vreinterpretq_u16_u32(u13.val[0]), a2 = vreinterpretq_u16_u32(u02.val[1]), a3 = vreinterpretq_u16_u32(u13.val[1]);
+  uint16x8_t b0 = vreinterpretq_u16_u32(u46.val[0]), b1 = vreinterpretq_u16_u32(u57.val[0]), b2 = vreinterpretq_u16_u32(u46.val[1]), b3 = vreinterpretq_u16_u32(u57.val[1]);
+  vst1q_u16(dst,               vcombine_u16(vget_low_u16(a0), vget_low_u16(b0)));
+  vst1q_u16(dst + dstStride,   vcombine_u16(vget_low_u16(a1), vget_low_u16(b1)));
+  vst1q_u16(dst + 2*dstStride, vcombine_u16(vget_low_u16(a2), vget_low_u16(b2)));
+  vst1q_u16(dst + 3*dstStride, vcombine_u16(vget_low_u16(a3), vget_low_u16(b3)));
+  vst1q_u16(dst + 4*dstStride, vcombine_u16(vget_high_u16(a0), vget_high_u16(b0)));
+  vst1q_u16(dst + 5*dstStride, vcombine_u16(vget_high_u16(a1), vget_high_u16(b1)));
+  vst1q_u16(dst + 6*dstStride, vcombine_u16(vget_high_u16(a2), vget_high_u16(b2)));
+  vst1q_u16(dst + 7*dstStride, vcombine_u16(vget_high_u16(a3), vget_high_u16(b3)));
+}
+#endif
+
+// Transposes the source area [x, endX[ x [y, endY[. Strides are in pixels.
+static void TransposeTile(const uint16_t *src, int srcStride, uint16_t *dst, int dstStride, int x, int y, int endX, int endY)
+{
+#ifdef TRANSPOSE_USE_NEON
+  const int endX8 = x + ((endX - x) & ~7), endY8 = y + ((endY - y) & ~7);
+  for(int Y = y; Y < endY8; Y += 8)
+    for(int X = x; X < endX8; X += 8)
+      Transpose8x8(src + Y*srcStride + X, srcStride, dst + X*dstStride + Y, dstStride);
+
+  // Leftover pixels at the right and bottom edges of the frame
+  for(int Y = y; Y < endY; ++Y)
+    for(int X = (Y < endY8 ? endX8 : x); X < endX; ++X)
+      dst[X*dstStride + Y] = src[Y*srcStride + X];
+#else
+  // Without NEON, write each destination scanline of the tile in turn. Splitting the tile into 8x8 blocks only adds overhead here.
+  for(int X = x; X < endX; ++X)
+    for(int Y = y; Y < endY; ++Y)
+      dst[X*dstStride + Y] = src[Y*srcStride + X];
+#endif
+}
+
+#ifdef BENCHMARK_TRANSPOSE
+static void BenchmarkTranspose();
+#endif
+
+void TransposeFramebuffer(const uint16_t *src, int srcStrideBytes, uint16_t *dst, int dstStrideBytes, int width, int height)
+{
+#ifdef BENCHMARK_TRANSPOSE
+  static bool benchmarked = false;
+  if (!benchmarked)
+  {
+    benchmarked = true;
+    BenchmarkTranspose();
+  }
+#endif
+  for(int y = 0; y < height; y += TRANSPOSE_TILE_SIZE)
+    for(int x = 0; x < width; x += TRANSPOSE_TILE_SIZE)
+      TransposeTile(src, srcStrideBytes>>1, dst, dstStrideBytes>>1, x, y, MIN(x + TRANSPOSE_TILE_SIZE, width), MIN(y + TRANSPOSE_TILE_SIZE, height));
+}
+
+void TransposeChangedTiles(const uint16_t *src, const uint16_t *prevSrc, int srcStrideBytes, uint16_t *dst, int dstStrideBytes, int width, int height)
+{
+  const int srcStride = srcStrideBytes>>1;
+  for(int y = 0; y < height; y += TRANSPOSE_TILE_SIZE)
+  {
+    const int endY = MIN(y + TRANSPOSE_TILE_SIZE, height);
+    for(int x = 0; x < width; x += TRANSPOSE_TILE_SIZE)
+    {
+      const int endX = MIN(x + TRANSPOSE_TILE_SIZE, width);
+      // Tiles that did not change are left as they are in the destination, which already holds their transpose
+      for(int Y = y; Y < endY; ++Y)
+        if (memcmp(src + Y*srcStride + x, prevSrc + Y*srcStride + x, (endX - x)*2))
+        {
+          TransposeTile(src, srcStride, dst, dstStrideBytes>>1, x, y, endX, endY);
+          break;
+        }
+    }
+  }
+}
+
+#ifdef BENCHMARK_TRANSPOSE
+// The original transpose, one pixel at a time down the destination scanlines
+static void TransposePerPixel(const uint16_t *src, int srcStride, uint16_t *dst, int dstStride, int width, int height)
+{
+  for(int y = 0; y < width; ++y)
+    for(int x = 0; x < height; ++x)
+      dst[y*dstStride + x] = src[x*srcStride + y];
+}
+
+static void BenchmarkTranspose()
+{
+  // A 480x320 landscape capture, as on ILI9486/HX8357D displays, with the padded scanlines that captures have
+  const int width = 480, height = 320, srcStride = width + 16, dstStride = height, numIterations = 200;
+  uint16_t *src = (uint16_t*)malloc(srcStride*height*sizeof(uint16_t));
+  uint16_t *prevSrc = (uint16_t*)malloc(srcStride*height*sizeof(uint16_t));
+  uint16_t *reference = (uint16_t*)calloc(dstStride*width, sizeof(uint16_t));
+  uint16_t *result = (uint16_t*)calloc(dstStride*width, sizeof(uint16_t));
+  for(int i = 0; i < srcStride*height; ++i) src[i] = prevSrc[i] = (uint16_t)rand();
+  // A typical UI frame: a 64x16 pixel clock or status text changed since the previous frame, and the rest is static
+  for(int y = 100; y < 116; ++y)
+    for(int x = 200; x < 264; ++x)
+      src[y*srcStride + x] = (uint16_t)rand();
+
+  uint64_t t0 = tick();
+  for(int i = 0; i < numIterations; ++i)
+    TransposePerPixel(src, srcStride, reference, dstStride, width, height);
+  uint64_t t1 = tick();
+  for(int i = 0; i < numIterations; ++i)
+    TransposeFramebuffer(src, srcStride*sizeof(uint16_t), result, dstStride*sizeof(uint16_t), width, height);
+  uint64_t t2 = tick();
+  const bool tiledMatches = !memcmp(reference, result, dstStride*width*sizeof(uint16_t));
+
+  // Changed tiles only: start from the transpose of the previous frame
+  TransposePerPixel(prevSrc, srcStride, result, dstStride, width, height);
+  uint64_t t3 = tick();
+  for(int i = 0; i < numIterations; ++i)
+    TransposeChangedTiles(src, prevSrc, srcStride*sizeof(uint16_t), result, dstStride*sizeof(uint16_t), width, height);
+  uint64_t t4 = tick();
+  const bool changedTilesMatch = !memcmp(reference, result, dstStride*width*sizeof(uint16_t));
+
+  printf("Transpose benchmark %dx%d%s: per pixel %.3f msecs, tiled %.3f msecs%s, changed tiles only %.3f msecs%s per frame.\n", width, height,
+#ifdef TRANSPOSE_USE_NEON
+    " (NEON)",
+#else
+    "",
+#endif
+    (t1 - t0) / 1000.0 / numIterations, (t2 - t1) / 1000.0 / numIterations, tiledMatches ? "" : " (DIFFERS)", (t4 - t3) / 1000.0 / numIterations, changedTilesMatch ? "" : " (DIFFERS)");
+  free(src);
+  free(prevSrc);
+  free(reference);
+  free(result);
+}
+#endif
+
+#endif
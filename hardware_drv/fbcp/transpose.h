@@ -0,0 +1,10 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Transposes the width x height pixel area at src so that source column x becomes destination scanline x. Strides are in bytes.
+void TransposeFramebuffer(const uint16_t *src, int srcStrideBytes, uint16_t *dst, int dstStrideBytes, int width, int height);
+
+// Like TransposeFramebuffer(), but only transposes the tiles in which src differs from prevSrc, which must have the same stride as src.
+// The destination must already hold the transpose of prevSrc, the tiles that did not change are not written to.
+void TransposeChangedTiles(const uint16_t *src, const uint16_t *prevSrc, int srcStrideBytes, uint16_t *dst, int dstStrideBytes, int width, int height);
@@ -0,0 +1,231 @@
+#include "config.h"
+#include "update_strategy.h"
+
+#include "diff.h"
+#include "display.h"
+#include "gpu.h"
+#include "spi.h"
+#include "util.h"
+
+// #define BENCHMARK_UPDATE_STRATEGY // Uncomment to replay a session of text UI and emulator frames with each strategy at first use, and print the time that each took
+
+#ifdef BENCHMARK_UPDATE_STRATEGY
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tick.h"
+#endif
+
+// The classifier keeps a running estimate of how long updating a frame takes with each strategy: the time to diff it, plus the time that
+// the pixels it sends take on the SPI bus. A frame updated with scanline spans tells all of these: its changed pixels and number of spans
+// give the cost of spans, and their bounding rectangle the cost of a single rectangle (the smaller the fraction of the rectangle that
+// changed, the worse a rectangle does against spans). A full frame always costs the same. A frame updated with a single rectangle only
+// tells the costs of rectangle and full, so when not updating with spans, a frame is diffed to spans every now and then to see whether the
+// content has changed back to something that spans do better on.
+
+// Weight of the newest frame in the running estimates
+#define UPDATE_COST_SMOOTHING 0.25
+
+// Switch to another strategy only after it has been estimated to take less than this fraction of the time of the current one over this
+// many consecutive frames, so that a few odd frames, e.g. a menu popping up over a game, do not flip the strategy back and forth.
+#define UPDATE_STRATEGY_SWITCH_MARGIN 0.85
+#define UPDATE_STRATEGY_SWITCH_FRAMES 8
+
+// When updating with a single rectangle or full frames, diff one frame out of this many to spans to keep the estimates of spans fresh.
+#define UPDATE_STRATEGY_PROBE_INTERVAL 30
+
+// A diff that takes more than this many times the current estimate is counted as taking only that long, so that the thread being
+// preempted in the middle of one diff does not flip the strategy. Real changes in the content still move the estimate within a few frames.
+#define UPDATE_DIFF_TIME_OUTLIER_FACTOR 4
+
+UpdateStrategy adaptiveUpdateStrategy = UPDATE_SCANLINE_SPANS;
+uint32_t numAdaptiveUpdateStrategySwitches = 0;
+double updateStrategyCostUsecs[UPDATE_ADAPTIVE] = {};
+
+static double busUsecsEstimate[UPDATE_ADAPTIVE] = {};
+static double diffUsecsEstimate[UPDATE_ADAPTIVE] = {}; // Only measured when the strategy is used, zero until then so that each gets tried out
+
+static UpdateStrategy switchCandidate = UPDATE_SCANLINE_SPANS;
+static int numFramesFavoringCandidate = 0;
+static int numFramesSinceProbe = 0;
+
+// Returns true if a frame updated with the given strategy tells the cost of the other one. Strategies are ordered from finest to coarsest,
+// and the spans of a finer strategy tell the cost of all coarser ones.
+static bool Observes(UpdateStrategy strategy, UpdateStrategy other)
+{
+  return strategy <= other;
+}
+
+#ifdef BENCHMARK_UPDATE_STRATEGY
+static void BenchmarkUpdateStrategies();
+#endif
+
+UpdateStrategy ChooseUpdateStrategy()
+{
+#ifdef BENCHMARK_UPDATE_STRATEGY
+  static bool benchmarked = false;
+  if (!benchmarked)
+  {
+    benchmarked = true;
+    BenchmarkUpdateStrategies();
+  }
+#endif
+  if (settings.update != UPDATE_ADAPTIVE) return settings.update;
+  // Confirm a switch to a strategy whose cost the current one does not tell, and every now and then check whether one might be due
+  if ((numFramesFavoringCandidate > 0 && !Observes(adaptiveUpdateStrategy, switchCandidate)) || numFramesSinceProbe >= UPDATE_STRATEGY_PROBE_INTERVAL)
+    return UPDATE_SCANLINE_SPANS;
+  return adaptiveUpdateStrategy;
+}
+
+static void UpdateEstimate(double &estimate, double sample)
+{
+  estimate += (sample - estimate) * UPDATE_COST_SMOOTHING;
+}
+
+void ClassifyFrame(UpdateStrategy strategy, Span *head, uint64_t diffUsecs, bool interlaced)
+{
+  int numPixels = 0, numSpans = 0;
+  int x = gpuFrameWidth, y = gpuFrameHeight, endX = 0, endY = 0;
+  for(Span *i = head; i; i = i->next)
+  {
+    numPixels += i->size;
+    ++numSpans;
+    x = MIN(x, (int)i->x);
+    y = MIN(y, (int)i->y);
+    endX = MAX(endX, (int)i->endX);
+    endY = MAX(endY, (int)i->endY);
+  }
+  // An interlaced update only diffed and produced spans for every second scanline, the whole frame takes about twice that
+  if (interlaced)
+  {
+    numPixels *= 2;
+    numSpans *= 2;
+    diffUsecs *= 2;
+    endY = MIN(endY + 1, gpuFrameHeight);
+  }
+
+  // Starting a new span costs about as much bus time as sending SPAN_MERGE_THRESHOLD pixels, see diff.h
+  const double usecsPerPixel = SPI_BYTESPERPIXEL * spiUsecsPerByte;
+  UpdateEstimate(busUsecsEstimate[UPDATE_FULL_FRAME], (gpuFrameWidth*gpuFrameHeight + SPAN_MERGE_THRESHOLD) * usecsPerPixel);
+  if (Observes(strategy, UPDATE_SINGLE_RECTANGLE))
+    UpdateEstimate(busUsecsEstimate[UPDATE_SINGLE_RECTANGLE], numSpans ? ((endX - x)*(endY - y) + SPAN_MERGE_THRESHOLD) * usecsPerPixel : 0);
+  if (Observes(strategy, UPDATE_SCANLINE_SPANS))
+    UpdateEstimate(busUsecsEstimate[UPDATE_SCANLINE_SPANS], (numPixels + numSpans*SPAN_MERGE_THRESHOLD) * usecsPerPixel);
+  const double maxDiffUsecs = diffUsecsEstimate[strategy] * UPDATE_DIFF_TIME_OUTLIER_FACTOR;
+  UpdateEstimate(diffUsecsEstimate[strategy], (diffUsecsEstimate[strategy] > 0 && diffUsecs > maxDiffUsecs) ? maxDiffUsecs : (double)diffUsecs);
+
+  int best = 0;
+  for(int i = 0; i < UPDATE_ADAPTIVE; ++i)
+  {
+    updateStrategyCostUsecs[i] = busUsecsEstimate[i] + diffUsecsEstimate[i];
+    if (updateStrategyCostUsecs[i] < updateStrategyCostUsecs[best]) best = i;
+  }
+
+  if (settings.update != UPDATE_ADAPTIVE) return;
+  if (strategy == UPDATE_SCANLINE_SPANS) numFramesSinceProbe = 0;
+  else ++numFramesSinceProbe;
+
+  if (best == adaptiveUpdateStrategy || updateStrategyCostUsecs[best] >= updateStrategyCostUsecs[adaptiveUpdateStrategy] * UPDATE_STRATEGY_SWITCH_MARGIN)
+    numFramesFavoringCandidate = 0;
+  else if (Observes(strategy, (UpdateStrategy)best)) // Only count frames that actually measured the candidate
+  {
+    if (best != switchCandidate) numFramesFavoringCandidate = 0;
+    switchCandidate = (UpdateStrategy)best;
+    if (++numFramesFavoringCandidate >= UPDATE_STRATEGY_SWITCH_FRAMES)
+    {
+      adaptiveUpdateStrategy = switchCandidate;
+      ++numAdaptiveUpdateStrategySwitches;
+      numFramesFavoringCandidate = 0;
+      numFramesSinceProbe = 0;
+    }
+  }
+}
+
+#ifdef BENCHMARK_UPDATE_STRATEGY
+#define BENCHMARK_FRAMES 600
+
+// Draws frame i of a session that goes from a text UI to a full motion emulator and back, a third of the frames each.
+static void DrawBenchmarkFrame(uint16_t *framebuffer, int stride, int i)
+{
+  if (i >= BENCHMARK_FRAMES/3 && i < 2*BENCHMARK_FRAMES/3)
+  {
+    // Emulator: a 256x224 picture in the middle of the screen scrolls every frame
+    const int w = MIN(256, gpuFrameWidth), h = MIN(224, gpuFrameHeight), x0 = (gpuFrameWidth - w)/2, y0 = (gpuFrameHeight - h)/2;
+    for(int y = 0; y < h; ++y)
+      for(int x = 0; x < w; ++x)
+        framebuffer[(y0+y)*stride + x0+x] = (uint16_t)(((x + i) * 0x9E37) ^ (y * 0x45D9));
+  }
+  else
+  {
+    // Text UI: one 8x16 character typed per frame, and a clock in the top right corner that changes every 8th frame
+    const int columns = gpuFrameWidth / 8, rows = gpuFrameHeight / 16 - 1;
+    const int cell = i % (columns*rows), cellX = (cell % columns)*8, cellY = 16 + (cell / columns)*16;
+    for(int y = 0; y < 16; ++y)
+      for(int x = 0; x < 8; ++x)
+        framebuffer[(cellY+y)*stride + cellX+x] = ((x ^ y ^ i) & 3) ? 0 : 0xFFFF;
+    if (i % 8 == 0)
+      for(int y = 0; y < 16; ++y)
+        for(int x = MAX(gpuFrameWidth - 48, 0); x < gpuFrameWidth; ++x)
+          framebuffer[y*stride + x] = (uint16_t)(i*31 + x);
+  }
+}
+
+static void ResetClassifier()
+{
+  adaptiveUpdateStrategy = switchCandidate = UPDATE_SCANLINE_SPANS;
+  numAdaptiveUpdateStrategySwitches = 0;
+  numFramesFavoringCandidate = numFramesSinceProbe = 0;
+  for(int i = 0; i < UPDATE_ADAPTIVE; ++i)
+    updateStrategyCostUsecs[i] = busUsecsEstimate[i] = diffUsecsEstimate[i] = 0;
+}
+
+// Updates the replayed frames with each of the fixed strategies and with UPDATE_ADAPTIVE, the same way as the main loop does, and adds up
+// the time that diffing took and that the pixels and spans would take on the SPI bus (see SPAN_MERGE_THRESHOLD in diff.h).
+static void BenchmarkUpdateStrategies()
+{
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  uint16_t *framebuffer = (uint16_t*)malloc(gpuFramebufferSizeBytes);
+  uint16_t *prevFramebuffer = (uint16_t*)malloc(gpuFramebufferSizeBytes);
+  const UpdateStrategy savedUpdate = settings.update;
+  const double usecsPerPixel = SPI_BYTESPERPIXEL * spiUsecsPerByte;
+
+  for(int s = 0; s <= UPDATE_ADAPTIVE; ++s)
+  {
+    __atomic_store_n(&settings.update, (UpdateStrategy)s, __ATOMIC_RELAXED);
+    ResetClassifier();
+    memset(framebuffer, 0, gpuFramebufferSizeBytes);
+    memset(prevFramebuffer, 0, gpuFramebufferSizeBytes);
+    double busUsecs = 0;
+    uint64_t diffUsecs = 0;
+    for(int i = 0; i < BENCHMARK_FRAMES; ++i)
+    {
+      DrawBenchmarkFrame(framebuffer, stride, i);
+      const UpdateStrategy strategy = ChooseUpdateStrategy();
+      Span *head = 0;
+      const uint64_t t0 = tick();
+      if (strategy == UPDATE_FULL_FRAME)
+        NoDiffChangedRectangle(head);
+      else if (strategy == UPDATE_SINGLE_RECTANGLE)
+        DiffFramebuffersToSingleChangedRectangle(framebuffer, prevFramebuffer, head);
+      else
+        DiffFramebuffersToScanlineSpansExact(framebuffer, prevFramebuffer, false, 0, head);
+      MergeScanlineSpanList(head);
+      const uint64_t t1 = tick();
+      ClassifyFrame(strategy, head, t1 - t0, false);
+      diffUsecs += t1 - t0;
+      for(Span *i = head; i; i = i->next)
+        busUsecs += (i->size + SPAN_MERGE_THRESHOLD) * usecsPerPixel;
+      memcpy(prevFramebuffer, framebuffer, gpuFramebufferSizeBytes);
+    }
+    printf("Update strategy benchmark, %d frames of %dx%d with %s: bus %.1f msecs, diff %.1f msecs, total %.1f msecs", BENCHMARK_FRAMES, gpuFrameWidth, gpuFrameHeight,
+      updateStrategyNames[s], busUsecs / 1000.0, diffUsecs / 1000.0, (busUsecs + diffUsecs) / 1000.0);
+    if (s == UPDATE_ADAPTIVE) printf(", %u switches", numAdaptiveUpdateStrategySwitches);
+    printf("\n");
+  }
+
+  __atomic_store_n(&settings.update, savedUpdate, __ATOMIC_RELAXED);
+  ResetClassifier();
+  free(framebuffer);
+  free(prevFramebuffer);
+}
+#endif
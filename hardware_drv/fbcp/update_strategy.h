@@ -0,0 +1,22 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "settings.h"
+
+struct Span;
+
+// Returns the strategy to update the next frame with: settings.update, or if that is UPDATE_ADAPTIVE, the strategy that the recent
+// frames have been classified to.
+UpdateStrategy ChooseUpdateStrategy(void);
+
+// Feeds a newly captured frame to the classifier: the strategy that it was updated with, the spans it produced (before any overlays are
+// added), how long finding those spans took, and whether only one field of it was diffed.
+void ClassifyFrame(UpdateStrategy strategy, Span *head, uint64_t diffUsecs, bool interlaced);
+
+// The strategy that UPDATE_ADAPTIVE currently picks, and how many times it has switched, for the statistics.
+extern UpdateStrategy adaptiveUpdateStrategy;
+extern uint32_t numAdaptiveUpdateStrategySwitches;
+
+// Predicted time in usecs that updating a frame takes with each of the fixed strategies, indexed by UpdateStrategy.
+extern double updateStrategyCostUsecs[UPDATE_ADAPTIVE];
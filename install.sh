@@ -123,6 +123,13 @@ cd "$SOURCE_DIR"
 # --- Шаг 4: Настройка системных сервисов (systemd) ---
 _print "\n>>> Step 4: Creating and enabling system services..." "\n>>> Шаг 4: Создание и включение системных сервисов..."
 
+_print "Creating the mcs group for writing to the MCS cartridge FIFO..." "Создание группы mcs для записи в FIFO картриджей MCS..."
+groupadd -f --system mcs
+if [ -n "$SUDO_USER" ] && [ "$SUDO_USER" != "root" ]; then
+  usermod -aG mcs "$SUDO_USER"
+  _print "User $SUDO_USER added to the mcs group." "Пользователь $SUDO_USER добавлен в группу mcs."
+fi
+
 _print "Creating cardkb.service..." "Создание cardkb.service..."
 cat > /etc/systemd/system/cardkb.service << EOL
 [Unit]
@@ -130,7 +137,9 @@ Description=CardKB I2C Keyboard Daemon for CLST2
 After=multi-user.target
 [Service]
 Type=simple
-ExecStart=${INSTALL_DIR}/cardkb_daemon -i /dev/i2c-1
+RuntimeDirectory=cardkb
+RuntimeDirectoryMode=0755
+ExecStart=${INSTALL_DIR}/cardkb_daemon -i /dev/i2c-1 --smooth-cutoff 5 --mcs-fifo /run/cardkb/mcs_fifo --mcs-group mcs
 Restart=always
 RestartSec=5
 [Install]
@@ -69,6 +69,7 @@ rm -f /etc/systemd/system/fbcp.service
 
 systemctl daemon-reload
 _print "Service files removed." "Файлы сервисов удалены."
+groupdel mcs 2>/dev/null || true
 
 # --- Шаг 3: Удаление скомпилированных драйверов ---
 _print "\n>>> Step 3: Removing compiled driver binaries..." "\n>>> Шаг 3: Удаление скомпилированных драйверов..."
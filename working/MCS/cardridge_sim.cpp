@@ -5,6 +5,7 @@
 // Описание:
 // Эта простая программа имитирует вставку картриджа. Она записывает
 // строку-"паспорт" в именованный канал (FIFO) и завершает работу.
+// FIFO создаёт cardkb_daemon (--mcs-fifo); писать в него может группа mcs.
 // =========================================================================
 
 #include <iostream>
@@ -17,7 +18,7 @@
 #include <unistd.h>
 
 // --- НАСТРОЙКИ ---
-const std::string FIFO_PATH = "/tmp/mcs_fifo";
+const std::string FIFO_PATH = "/run/cardkb/mcs_fifo";
 const std::string PASSPORT_PRINTER = "TP=PRINTER;NM=SIG-MA v1;DRVID=00000001;CRDID=A1B2C3D4;";
 const std::string PASSPORT_SENSOR = "TP=SENSOR;NM=Temp Sensor;DRVID=00000002;CRDID=BEEFCAFE;ODRVID=00000001;";
 
@@ -25,16 +26,16 @@ const std::string PASSPORT_SENSOR = "TP=SENSOR;NM=Temp Sensor;DRVID=00000002;CRD
 int main(int argc, char *argv[]) {
     std::cout << "Эмулятор Картриджа запущен..." << std::endl;
 
-    // --- 1. Создаем FIFO, если он не существует ---
-    // mkfifo вернет 0, если FIFO создан, или -1, если он уже существует или есть ошибка
-    if (mkfifo(FIFO_PATH.c_str(), 0666) == -1) {
-        if (errno != EEXIST) {
-            perror("Ошибка при создании FIFO");
-            return 1;
-        }
-        std::cout << "FIFO " << FIFO_PATH << " уже существует." << std::endl;
-    } else {
-        std::cout << "FIFO " << FIFO_PATH << " успешно создан." << std::endl;
+    // --- 1. Проверяем FIFO ---
+    // Сами FIFO не создаем: его создает демон с нужными правами, а без демона паспорт все равно некому читать
+    struct stat st;
+    if (stat(FIFO_PATH.c_str(), &st) == -1) {
+        perror("FIFO не найден, запущен ли cardkb_daemon");
+        return 1;
+    }
+    if (!S_ISFIFO(st.st_mode)) {
+        std::cerr << FIFO_PATH << " не является FIFO." << std::endl;
+        return 1;
     }
 
     // --- 2. Выбираем, какой паспорт "вставить" ---
@@ -51,9 +52,15 @@ int main(int argc, char *argv[]) {
     // Важно: open "зависнет" до тех пор, пока кто-нибудь не откроет
     // этот же FIFO на чтение с другого конца!
     std::cout << "Ожидание, пока кто-нибудь откроет FIFO для чтения..." << std::endl;
-    int fd = open(FIFO_PATH.c_str(), O_WRONLY);
+    int fd = open(FIFO_PATH.c_str(), O_WRONLY | O_NOFOLLOW);
     if (fd == -1) {
-        perror("Ошибка при открытии FIFO для записи");
+        perror("Ошибка при открытии FIFO для записи (пользователь в группе mcs?)");
+        return 1;
+    }
+    // Путь могли подменить между stat() и open()
+    if (fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+        std::cerr << FIFO_PATH << " не является FIFO." << std::endl;
+        close(fd);
         return 1;
     }
     std::cout << "Читатель подключился! Отправка паспорта..." << std::endl;
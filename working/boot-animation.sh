@@ -3,7 +3,7 @@
 # ==========================================================
 # Скрипт для проигрывания ASCII-анимации при загрузке
 # Проект: CLST2
-# Версия: 1.1 (с взмахами и встряхиванием)
+# Версия: 1.2 (с взмахами и встряхиванием, уступает анимации fbcp)
 # ==========================================================
 
 # Путь к директории с кадрами анимации
@@ -15,6 +15,27 @@ WAVE_DELAY=0.3
 # Задержка для быстрого встряхивания (в секундах)
 SHAKE_DELAY=0.08
 
+# Сокет передачи дисплея fbcp (BOOT_ANIMATION_HANDOFF_SOCKET в config.h), задаётся в boot-animation.service
+HANDOFF_SOCKET="${HANDOFF_SOCKET:-/run/fbcp-handoff.sock}"
+HANDOFF_WAIT_SECS="${HANDOFF_WAIT_SECS:-5}"
+
+# Если fbcp сам проигрывает анимацию из файла заставки прямо на дисплей, рисовать на tty1 незачем:
+# это только лишние перерисовки консоли. Просто ждём, пока systemd остановит сервис, а ExecStopPost
+# передаст дисплей захвату. fbcp открывает сокет, как только показал заставку, то есть за доли секунды
+# после запуска. Ждём, пока fbcp работает: если он упал, собран без анимации или не запущен вовсе,
+# сокета не будет, и после HANDOFF_WAIT_SECS рисуем анимацию сами.
+WAITED=0
+while true; do
+    if [ -S "$HANDOFF_SOCKET" ]; then
+        exec sleep infinity
+    fi
+    if [ "$WAITED" -ge $((HANDOFF_WAIT_SECS * 5)) ] || ! systemctl is-active --quiet fbcp-ili9341.service; then
+        break
+    fi
+    sleep 0.2
+    WAITED=$((WAITED + 1))
+done
+
 # Проверяем, существует ли директория с кадрами, чтобы избежать ошибок
 if [ ! -d "$FRAME_DIR" ]; then
     # Если директории нет, просто выходим.
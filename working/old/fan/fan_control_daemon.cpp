@@ -1,102 +1,690 @@
 // ==========================================================
 // Название:      fan_control_daemon.cpp
-// Версия:        1.0
+// Версия:        3.0
 // Описание:      Демон для управления вентилятором проекта CLST2.
-//                Читает температуру CPU и управляет GPIO-пином.
+//                Читает температуру CPU и загрузку из /proc/stat и задаёт скважность ШИМ вентилятора
+//                ПИД-регулятором с упреждением по загрузке. ШИМ аппаратный (sysfs pwm), если задан канал,
+//                иначе программный на линии GPIO. Пока вентилятор стоит и холодно, демон опрашивает редко: загрузку
+//                раз в секунду, чтобы упреждение срабатывало и из простоя, температуру раз в 5 с.
 //==========================================================
 
 #include <iostream>
 #include <fstream>
 #include <string>
-#include <thread>
-#include <chrono>
-#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
 #include <unistd.h>
-#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <linux/gpio.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/thermal.h>
 
 // --- НАСТРОЙКИ ---
+const std::string FAN_GPIO_CHIP = "/dev/gpiochip0";
 const int FAN_GPIO_PIN = 3; // PA3 -> GPIO 3
 const std::string TEMP_FILE_PATH = "/sys/class/thermal/thermal_zone0/temp";
-const float TEMP_OFF = 45.0f;
+const std::string PROC_STAT_PATH = "/proc/stat";
+const std::string CPU_FREQ_PATH = "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq";
+const std::string CPU_MAX_FREQ_PATH = "/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq";
+const std::string FAN_PWM_CHIP = "/sys/class/pwm/pwmchip0";
+const float TEMP_OFF = 45.0f; // Пороги прежнего релейного режима (--bang-bang)
 const float TEMP_ON = 50.0f;
+const int FALLBACK_POLL_MS = 5000; // Опрос в простое, между событиями термозоны
+const int IDLE_LOAD_SAMPLE_MS = 1000; // Замер загрузки в простое: начавшаяся сборка будит регулятор до нагрева
+
+// Регулятор. Ошибка - превышение температуры над целевой, выход - скважность 0..1.
+const float TARGET_TEMP = 50.0f;
+const float KP = 0.1f;          // На градус превышения
+const float KI = 0.01f;         // На градус в секунду
+const float KD = 0.05f;         // На градус в секунду роста
+const float TEMP_SMOOTHING = 0.3f; // Вес нового замера: датчик отдаёт температуру ступеньками
+const float FF_GAIN = 0.5f;     // Упреждение: скважность на полную загрузку CPU, вентилятор разгоняется раньше нагрева
+const float FF_MIN_TEMP = 40.0f; // Холодному процессору упреждение не нужно
+const float MIN_DUTY = 0.25f;   // Ниже этого воздуходувка 4010 останавливается
+const float IDLE_MARGIN = 5.0f; // Ниже TARGET_TEMP - IDLE_MARGIN без нагрузки регулятор засыпает
+const float IDLE_MAX_LOAD = 0.2f;
+const float THROTTLE_MIN_LOAD = 0.8f; // Частота ниже максимальной при такой загрузке считается троттлингом
+const int CONTROL_PERIOD_MS = 1000;
+const int SOFT_PWM_HZ = 25;     // Программный ШИМ: медленно, но для воздуходувки с ключом на MOSFET достаточно
+const int HW_PWM_PERIOD_NS = 40000; // 25 кГц, вне слышимого диапазона
 
-// --- Класс для простого управления GPIO через sysfs ---
+// --- Класс для управления GPIO через символьное устройство (GPIO uAPI v2) ---
+// Линия запрашивается один раз и остаётся за демоном, значение меняется одним ioctl() без открытия файлов.
 class GPIOManager {
 private:
+    std::string chip_path;
     int pin_number;
-    std::string gpio_path;
+    int fd_line = -1;
+
+public:
+    GPIOManager(const std::string& chip, int pin) : chip_path(chip), pin_number(pin) {}
+    ~GPIOManager() { if (fd_line >= 0) close(fd_line); } // Закрытие освобождает линию
 
-    bool write_to_sysfs(const std::string& path, const std::string& value) {
-        std::ofstream fs(path);
-        if (!fs.is_open()) {
-            std::cerr << "Ошибка: Не удалось открыть sysfs-файл: " << path << std::endl;
+    bool setup() {
+        int fd_chip = open(chip_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_chip < 0) {
+            std::cerr << "Ошибка: Не удалось открыть " << chip_path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        struct gpio_v2_line_request req;
+        memset(&req, 0, sizeof(req));
+        req.offsets[0] = pin_number;
+        req.num_lines = 1;
+        req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+        req.config.num_attrs = 1; // Начальное значение: вентилятор выключен
+        req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+        req.config.attrs[0].attr.values = 0;
+        req.config.attrs[0].mask = 1;
+        strcpy(req.consumer, "fan_control_daemon");
+        int ret = ioctl(fd_chip, GPIO_V2_GET_LINE_IOCTL, &req);
+        close(fd_chip);
+        if (ret < 0) {
+            std::cerr << "Ошибка: Не удалось запросить линию " << pin_number << " на " << chip_path << ": " << strerror(errno) << std::endl;
             return false;
         }
-        fs << value;
-        fs.close();
-        return !fs.fail();
+        fd_line = req.fd;
+        return true;
     }
 
+    void set_value(int value) {
+        struct gpio_v2_line_values values;
+        values.bits = value ? 1 : 0;
+        values.mask = 1;
+        if (ioctl(fd_line, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
+            std::cerr << "Ошибка: Не удалось установить GPIO " << pin_number << ": " << strerror(errno) << std::endl;
+    }
+};
+
+// --- Датчик температуры ---
+// Файл открыт один раз, каждое чтение - pread() с нулевого смещения, sysfs при этом заново спрашивает драйвер.
+class TempSensor {
+private:
+    int fd = -1;
+
 public:
-    GPIOManager(int pin) : pin_number(pin) {
-        gpio_path = "/sys/class/gpio/gpio" + std::to_string(pin_number);
+    ~TempSensor() { if (fd >= 0) close(fd); }
+
+    bool open_file(const std::string& path) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        return fd >= 0;
     }
 
-    bool setup() {
-        struct stat buffer;
-        if (stat(gpio_path.c_str(), &buffer) != 0) {
-            std::cout << "Экспортируем GPIO " << pin_number << "..." << std::endl;
-            if (!write_to_sysfs("/sys/class/gpio/export", std::to_string(pin_number))) return false;
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    float read_celsius() {
+        char buf[16];
+        ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (n <= 0) return 50.0f; // Как и раньше: без показаний считаем, что горячо
+        buf[n] = 0;
+        return static_cast<float>(atoi(buf)) / 1000.0f;
+    }
+};
+
+// --- События термозон через generic netlink ---
+// Ядро (5.10+) рассылает в семействе "thermal", группе "event", пересечения точек срабатывания термозон. Демон подписан
+// только на неё (не на "sampling", где приходит каждый замер каждой зоны). Первая точка срабатывания обычно намного выше
+// порогов регулятора, поэтому события лишь будят демон раньше, а в простое он всё равно опрашивает датчик каждые
+// FALLBACK_POLL_MS.
+class ThermalEvents {
+private:
+    int fd = -1;
+
+    // Отправляет CTRL_CMD_GETFAMILY и подписывается на нужные группы из ответа
+    bool subscribe() {
+        struct {
+            struct nlmsghdr nlh;
+            struct genlmsghdr genl;
+            char attrs[64];
+        } req;
+        memset(&req, 0, sizeof(req));
+        req.nlh.nlmsg_type = GENL_ID_CTRL;
+        req.nlh.nlmsg_flags = NLM_F_REQUEST;
+        req.genl.cmd = CTRL_CMD_GETFAMILY;
+        req.genl.version = 1;
+        struct nlattr* name = (struct nlattr*)req.attrs;
+        name->nla_type = CTRL_ATTR_FAMILY_NAME;
+        name->nla_len = NLA_HDRLEN + sizeof(THERMAL_GENL_FAMILY_NAME);
+        memcpy((char*)name + NLA_HDRLEN, THERMAL_GENL_FAMILY_NAME, sizeof(THERMAL_GENL_FAMILY_NAME));
+        req.nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN) + NLA_ALIGN(name->nla_len);
+        if (send(fd, &req, req.nlh.nlmsg_len, 0) < 0) return false;
+
+        char buf[4096];
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        struct nlmsghdr* nlh = (struct nlmsghdr*)buf;
+        if (len <= 0 || !NLMSG_OK(nlh, (size_t)len) || nlh->nlmsg_type == NLMSG_ERROR) return false; // Нет семейства thermal
+
+        int groups = 0;
+        int attrs_len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+        for (struct nlattr* a = (struct nlattr*)((char*)NLMSG_DATA(nlh) + GENL_HDRLEN); attrs_len >= NLA_HDRLEN && a->nla_len <= attrs_len;
+             attrs_len -= NLA_ALIGN(a->nla_len), a = (struct nlattr*)((char*)a + NLA_ALIGN(a->nla_len))) {
+            if (a->nla_type != CTRL_ATTR_MCAST_GROUPS) continue;
+            // Список групп: вложенные атрибуты, в каждом имя и номер группы
+            int list_len = a->nla_len - NLA_HDRLEN;
+            for (struct nlattr* g = (struct nlattr*)((char*)a + NLA_HDRLEN); list_len >= NLA_HDRLEN && g->nla_len <= list_len;
+                 list_len -= NLA_ALIGN(g->nla_len), g = (struct nlattr*)((char*)g + NLA_ALIGN(g->nla_len))) {
+                const char* group_name = nullptr;
+                int group_id = -1;
+                int group_len = g->nla_len - NLA_HDRLEN;
+                for (struct nlattr* f = (struct nlattr*)((char*)g + NLA_HDRLEN); group_len >= NLA_HDRLEN && f->nla_len <= group_len;
+                     group_len -= NLA_ALIGN(f->nla_len), f = (struct nlattr*)((char*)f + NLA_ALIGN(f->nla_len))) {
+                    if (f->nla_type == CTRL_ATTR_MCAST_GRP_NAME) group_name = (const char*)f + NLA_HDRLEN;
+                    if (f->nla_type == CTRL_ATTR_MCAST_GRP_ID) group_id = *(const int*)((const char*)f + NLA_HDRLEN);
+                }
+                if (!group_name || group_id < 0) continue;
+                if (strcmp(group_name, THERMAL_GENL_EVENT_GROUP_NAME) != 0) continue;
+                if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group_id, sizeof(group_id)) == 0) groups++;
+            }
         }
+        return groups > 0;
+    }
 
-        std::cout << "Устанавливаем направление 'out' для GPIO " << pin_number << "..." << std::endl;
-        return write_to_sysfs(gpio_path + "/direction", "out");
+public:
+    ~ThermalEvents() { if (fd >= 0) close(fd); }
+
+    // Возвращает false, если ядро не умеет рассылать события термозон - тогда остаётся опрос по таймеру
+    bool open_socket() {
+        if (fd >= 0) close(fd);
+        fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+        if (fd < 0) return false;
+        if (!subscribe()) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        return true;
     }
 
-    void set_value(int value) {
-        write_to_sysfs(gpio_path + "/value", std::to_string(value));
+    int fd_events() const { return fd; }
+
+    // Вычитывает все пришедшие события. Какой зоны они касаются, не важно: температура всё равно перечитывается одним pread().
+    // При переполнении буфера сокета ядро теряет события и сообщает об этом один раз через ENOBUFS (poll() даёт POLLERR,
+    // пока ошибку не прочитают) - это тоже повод перечитать температуру. Возвращает false, если сокет сломан и нужна
+    // новая подписка.
+    bool drain() {
+        char buf[4096];
+        for (;;) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n > 0 || (n < 0 && (errno == ENOBUFS || errno == EINTR))) continue;
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
     }
 };
 
-float get_cpu_temp() {
-    std::ifstream temp_file(TEMP_FILE_PATH);
-    if (!temp_file.is_open()) {
-        return 50.0f;
+// --- Выход ШИМ ---
+// Аппаратный канал sysfs pwm, если он задан, иначе программный ШИМ: линия GPIO переключается по timerfd.
+// Скважность 0 и 1 программному ШИМ таймера не требуют.
+class FanOutput {
+private:
+    GPIOManager& gpio;
+    int fd_duty = -1;   // duty_cycle аппаратного канала, открыт всё время
+    int fd_timer = -1;  // Переключения программного ШИМ
+    float duty = 0;
+    bool level = false;
+
+    static bool write_sysfs(const std::string& path, const std::string& value) {
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        bool ok = write(fd, value.c_str(), value.size()) == (ssize_t)value.size();
+        close(fd);
+        return ok;
+    }
+
+    // Взводит таймер на долю периода ШИМ, 0 снимает его
+    void arm(float fraction) {
+        long ns = (long)(fraction * 1e9f / SOFT_PWM_HZ);
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        if (fraction > 0) {
+            its.it_value.tv_sec = ns / 1000000000;
+            its.it_value.tv_nsec = std::max(ns % 1000000000, 1L);
+        }
+        timerfd_settime(fd_timer, 0, &its, nullptr);
+    }
+
+public:
+    FanOutput(GPIOManager& line) : gpio(line) {}
+    ~FanOutput() {
+        if (fd_duty >= 0) close(fd_duty);
+        if (fd_timer >= 0) close(fd_timer);
+    }
+
+    bool setup(int pwm_channel) {
+        if (pwm_channel >= 0) {
+            std::string channel_path = FAN_PWM_CHIP + "/pwm" + std::to_string(pwm_channel);
+            if (access(channel_path.c_str(), F_OK) != 0) write_sysfs(FAN_PWM_CHIP + "/export", std::to_string(pwm_channel));
+            if (write_sysfs(channel_path + "/period", std::to_string(HW_PWM_PERIOD_NS)) && write_sysfs(channel_path + "/duty_cycle", "0")
+                && write_sysfs(channel_path + "/enable", "1")) {
+                fd_duty = open((channel_path + "/duty_cycle").c_str(), O_WRONLY | O_CLOEXEC);
+                if (fd_duty >= 0) {
+                    std::cout << "Аппаратный ШИМ: " << channel_path << std::endl;
+                    return true;
+                }
+            }
+            std::cerr << "Предупреждение: канал ШИМ " << channel_path << " недоступен, программный ШИМ." << std::endl;
+        }
+        fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        std::cout << "Программный ШИМ " << SOFT_PWM_HZ << " Гц на GPIO " << FAN_GPIO_PIN << std::endl;
+        return fd_timer >= 0;
+    }
+
+    int fd_soft_pwm() const { return fd_timer; }
+    float get_duty() const { return duty; }
+    bool is_hardware() const { return fd_duty >= 0; }
+
+    void set_duty(float value) {
+        value = std::min(std::max(value, 0.0f), 1.0f);
+        if (fd_duty >= 0) {
+            std::string ns = std::to_string((int)(value * HW_PWM_PERIOD_NS));
+            pwrite(fd_duty, ns.c_str(), ns.size(), 0);
+            duty = value;
+            return;
+        }
+        bool was_running = duty > 0 && duty < 1;
+        duty = value;
+        if (duty <= 0 || duty >= 1) {
+            level = duty >= 1;
+            gpio.set_value(level);
+            arm(0);
+        } else if (!was_running) {
+            level = true;
+            gpio.set_value(1);
+            arm(duty);
+        } // Иначе новая скважность вступит в силу со следующего переключения
     }
-    int temp_milli_celsius;
-    temp_file >> temp_milli_celsius;
-    return static_cast<float>(temp_milli_celsius) / 1000.0f;
+
+    // Следующее переключение программного ШИМ
+    void on_soft_pwm_timer() {
+        uint64_t expirations;
+        if (read(fd_timer, &expirations, sizeof(expirations)) < 0 || duty <= 0 || duty >= 1) return;
+        level = !level;
+        gpio.set_value(level);
+        arm(level ? duty : 1 - duty);
+    }
+};
+
+// --- Загрузка CPU по /proc/stat ---
+// Файл открыт один раз, загрузка - доля не простаивавшего времени с прошлого чтения.
+class CpuLoad {
+private:
+    int fd = -1;
+    uint64_t prev_total = 0, prev_idle = 0;
+
+public:
+    ~CpuLoad() { if (fd >= 0) close(fd); }
+
+    bool open_file() {
+        fd = open(PROC_STAT_PATH.c_str(), O_RDONLY | O_CLOEXEC);
+        return fd >= 0;
+    }
+
+    float read_fraction() {
+        char buf[256]; // Нужна только первая строка "cpu  user nice system idle iowait irq softirq steal ..."
+        ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (n <= 0) return 0;
+        buf[n] = 0;
+        unsigned long long v[8] = {};
+        if (sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4) return 0;
+        uint64_t total = 0;
+        for (unsigned long long x : v) total += x;
+        uint64_t idle = v[3] + v[4];
+        float load = (prev_total && total > prev_total) ? 1.0f - (float)(idle - prev_idle) / (float)(total - prev_total) : 0.0f;
+        prev_total = total;
+        prev_idle = idle;
+        return std::min(std::max(load, 0.0f), 1.0f);
+    }
+};
+
+// Читает целое из файла sysfs через постоянно открытый fd, 0 если файла нет
+class SysfsValue {
+private:
+    int fd = -1;
+
+public:
+    SysfsValue(const std::string& path) { fd = open(path.c_str(), O_RDONLY | O_CLOEXEC); }
+    ~SysfsValue() { if (fd >= 0) close(fd); }
+
+    long read_value() {
+        char buf[32];
+        ssize_t n = fd >= 0 ? pread(fd, buf, sizeof(buf) - 1, 0) : -1;
+        if (n <= 0) return 0;
+        buf[n] = 0;
+        return atol(buf);
+    }
+};
+
+// --- ПИД-регулятор с упреждением ---
+class FanController {
+private:
+    float temp = 0;      // Сглаженная температура
+    float prev_temp = 0;
+    float integral = 0;
+    bool primed = false;
+
+public:
+    float p = 0, i = 0, d = 0, ff = 0; // Слагаемые последнего шага, для журнала
+
+    void reset() { integral = 0; primed = false; }
+
+    float step(float measured_temp, float load, float dt) {
+        if (!primed) {
+            temp = prev_temp = measured_temp;
+            primed = true;
+        }
+        temp += (measured_temp - temp) * TEMP_SMOOTHING;
+        float error = temp - TARGET_TEMP;
+        p = KP * error;
+        d = KD * (temp - prev_temp) / dt;
+        ff = temp >= FF_MIN_TEMP ? FF_GAIN * load : 0;
+        prev_temp = temp;
+
+        // Интеграл копится, только пока выход не упёрся в предел в ту же сторону, чтобы не было перерегулирования после насыщения
+        float unclamped = p + integral + d + ff;
+        if ((unclamped < 1 || error < 0) && (unclamped > 0 || error > 0)) integral += KI * error * dt;
+        integral = std::min(std::max(integral, -1.0f), 1.0f);
+        i = integral;
+
+        float duty = std::min(std::max(p + i + d + ff, 0.0f), 1.0f);
+        if (duty < MIN_DUTY / 2) return 0;
+        return std::max(duty, MIN_DUTY);
+    }
+};
+
+// --- Итоги для сравнения регуляторов ---
+struct RunStats {
+    double seconds = 0;
+    double duty_seconds = 0;
+    double throttled_seconds = 0;
+    double over_target_seconds = 0;
+    float max_temp = 0;
+};
+RunStats g_run;
+volatile sig_atomic_t g_print_summary = 0;
+volatile sig_atomic_t g_stop = 0;
+
+void print_summary() {
+    std::cout << "Итог: " << g_run.seconds << " с под контролем, средняя скважность " << (g_run.seconds > 0 ? g_run.duty_seconds / g_run.seconds : 0)
+              << ", троттлинг " << g_run.throttled_seconds << " с, выше " << TARGET_TEMP << "°C " << g_run.over_target_seconds
+              << " с, максимум " << g_run.max_temp << "°C" << std::endl;
+}
+
+// Вентилятор стоит, холодно и нагрузки нет - регулятор переходит на редкий опрос
+bool is_idle(float duty, float temp, float load) {
+    return duty == 0 && temp < TARGET_TEMP - IDLE_MARGIN && load < IDLE_MAX_LOAD;
 }
 
-int main() {
+// --- Модель для сравнения регуляторов без железа (--simulate) ---
+// Процессор - RC-звено первого порядка: мощность 2 + 6 * загрузка Вт, теплоёмкость 15 Дж/°C, отвод в воздух 25°C
+// 0.08 Вт/°C без вентилятора и ещё 0.25 Вт/°C на полных оборотах, датчик с шагом 1°C. Профиль нагрузки: 60 с простоя,
+// 340 с полной загрузки (сборка), 200 с простоя. Шаги и простой идут так же, как в main(): в простое загрузка
+// замеряется раз в IDLE_LOAD_SAMPLE_MS, температура раз в FALLBACK_POLL_MS. Троттлинг модель не описывает.
+// Журнал -l пишется в том же формате, что и на железе, так что трассы -s и -s -b можно сравнивать одним скриптом.
+int run_simulation(bool bang_bang, std::ofstream& log_file) {
+    const int PLANT_STEP_MS = 100;
+    const int LOAD_START_MS = 60000, LOAD_END_MS = 400000, END_MS = 600000;
+    FanController controller;
+    bool controlling = false, is_fan_on = false;
+    double temp = 40, duty = 0, duty_ms = 0, over_ms = 0, max_temp = 0;
+    int fan_start_ms = -1; // Когда вентилятор включился после начала нагрузки
+    int next_step_ms = 0, next_temp_ms = 0;
+    for (int t = 0; t < END_MS; t += PLANT_STEP_MS) {
+        const float load = (t >= LOAD_START_MS && t < LOAD_END_MS) ? 1.0f : 0.05f;
+        bool step_due = false;
+        if (t >= next_step_ms) {
+            if (controlling) {
+                step_due = true;
+                next_step_ms = t + CONTROL_PERIOD_MS;
+            } else {
+                step_due = load >= IDLE_MAX_LOAD || t >= next_temp_ms;
+                next_step_ms = t + IDLE_LOAD_SAMPLE_MS;
+            }
+        }
+        if (step_due) {
+            const float measured = std::floor(temp);
+            if (bang_bang) {
+                if (measured >= TEMP_ON && !is_fan_on) is_fan_on = true;
+                else if (measured < TEMP_OFF && is_fan_on) is_fan_on = false;
+                duty = is_fan_on ? 1 : 0;
+            } else {
+                duty = controller.step(measured, load, CONTROL_PERIOD_MS / 1000.0f);
+            }
+            if (duty > 0 && fan_start_ms < 0 && t >= LOAD_START_MS) fan_start_ms = t;
+            if (log_file.is_open())
+                log_file << t / 1000.0 << " " << measured << " " << load << " " << duty << " "
+                         << controller.p << " " << controller.i << " " << controller.d << " " << controller.ff << " 0 0" << std::endl;
+            bool idle = is_idle(duty, measured, load);
+            if (idle == controlling) {
+                controlling = !idle;
+                if (idle) controller.reset();
+                next_step_ms = t + (controlling ? CONTROL_PERIOD_MS : IDLE_LOAD_SAMPLE_MS);
+            }
+            if (!controlling) next_temp_ms = t + FALLBACK_POLL_MS;
+        }
+        temp += PLANT_STEP_MS / 1000.0 * (2 + 6 * load - (temp - 25) * (0.08 + 0.25 * duty)) / 15;
+        duty_ms += duty * PLANT_STEP_MS;
+        if (temp > TARGET_TEMP) over_ms += PLANT_STEP_MS;
+        max_temp = std::max(max_temp, temp);
+    }
+    std::cout << (bang_bang ? "Релейное управление" : "ПИД-регулятор") << ": средняя скважность " << duty_ms / END_MS
+              << ", выше " << TARGET_TEMP << "°C " << over_ms / 1000 << " с, максимум " << max_temp << "°C, вентилятор включился через "
+              << (fan_start_ms < 0 ? -1 : (fan_start_ms - LOAD_START_MS) / 1000.0) << " с после начала нагрузки" << std::endl;
+    return 0;
+}
+
+void arm_control_timer(int fd, bool run) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (run) {
+        its.it_value.tv_nsec = its.it_interval.tv_nsec = (CONTROL_PERIOD_MS % 1000) * 1000000L;
+        its.it_value.tv_sec = its.it_interval.tv_sec = CONTROL_PERIOD_MS / 1000;
+    }
+    timerfd_settime(fd, 0, &its, nullptr);
+}
+
+void print_help(const char* prog_name) {
+    std::cout << "Usage: " << prog_name << " [options]\n"
+              << "Options:\n"
+              << "  -p, --pwm-channel <n>   Drive the fan from channel n of " << FAN_PWM_CHIP << ". Default: software PWM on GPIO " << FAN_GPIO_PIN << "\n"
+              << "  -l, --log <file>        Append a trace line per control step: time, temperature, load, duty, P, I, D, FF, CPU kHz, throttled\n"
+              << "  -b, --bang-bang         Old on/off control at " << TEMP_ON << "/" << TEMP_OFF << " °C, to compare traces against\n"
+              << "  -s, --simulate          Run the controller against a thermal model of the SoC under a compile load instead of\n"
+              << "                          the hardware, print a summary and exit. Combine with -b and -l for A/B traces\n"
+              << "  -h, --help              Show this help message and exit.\n"
+              << "Send SIGUSR1 to print average duty and throttling time so far.\n";
+}
+
+int main(int argc, char *argv[]) {
+    int pwm_channel = -1;
+    std::string log_path;
+    bool bang_bang = false;
+    bool simulate = false;
+
+    const struct option long_options[] = {
+        {"pwm-channel", required_argument, 0, 'p'},
+        {"log",         required_argument, 0, 'l'},
+        {"bang-bang",   no_argument,       0, 'b'},
+        {"simulate",    no_argument,       0, 's'},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:l:bsh", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'p': pwm_channel = atoi(optarg); break;
+            case 'l': log_path = optarg; break;
+            case 'b': bang_bang = true; break;
+            case 's': simulate = true; break;
+            case 'h': print_help(argv[0]); return 0;
+            default: print_help(argv[0]); return 1;
+        }
+    }
+
+    if (simulate) {
+        std::ofstream sim_log;
+        if (!log_path.empty()) {
+            sim_log.open(log_path, std::ios::trunc);
+            if (!sim_log) { std::cerr << "Критическая ошибка: Не удалось открыть журнал " << log_path << std::endl; return 1; }
+            sim_log << "# t_s temp_c load duty p i d ff cpu_khz throttled (simulation" << (bang_bang ? ", bang-bang" : "") << ")" << std::endl;
+        }
+        return run_simulation(bang_bang, sim_log);
+    }
+
     std::cout << "Запуск демона управления вентилятором..." << std::endl;
 
-    GPIOManager fan_gpio(FAN_GPIO_PIN);
+    GPIOManager fan_gpio(FAN_GPIO_CHIP, FAN_GPIO_PIN);
     if (!fan_gpio.setup()) {
         std::cerr << "Критическая ошибка: Не удалось настроить GPIO. Запустите с sudo." << std::endl;
         return 1;
     }
 
-    std::cout << "Демон запущен. Управление GPIO " << FAN_GPIO_PIN << " активно." << std::endl;
-    
-    bool is_fan_on = false;
+    TempSensor sensor;
+    if (!sensor.open_file(TEMP_FILE_PATH)) {
+        std::cerr << "Критическая ошибка: Не удалось открыть " << TEMP_FILE_PATH << std::endl;
+        return 1;
+    }
 
-    while (true) {
-        float temp = get_cpu_temp();
+    FanOutput fan(fan_gpio);
+    if (!fan.setup(pwm_channel)) {
+        std::cerr << "Критическая ошибка: Не удалось создать таймер ШИМ." << std::endl;
+        return 1;
+    }
+
+    CpuLoad cpu_load;
+    if (!cpu_load.open_file()) std::cerr << "Предупреждение: Не удалось открыть " << PROC_STAT_PATH << ", упреждения по загрузке не будет." << std::endl;
+    SysfsValue cpu_freq(CPU_FREQ_PATH), cpu_max_freq(CPU_MAX_FREQ_PATH);
+
+    std::ofstream log_file;
+    if (!log_path.empty()) {
+        log_file.open(log_path, std::ios::app);
+        if (!log_file) { std::cerr << "Критическая ошибка: Не удалось открыть журнал " << log_path << std::endl; return 1; }
+        log_file << "# t_s temp_c load duty p i d ff cpu_khz throttled" << (bang_bang ? " (bang-bang)" : "") << std::endl;
+    }
 
-        if (temp >= TEMP_ON && !is_fan_on) {
-            std::cout << "Температура: " << temp << "°C. Включаем вентилятор." << std::endl;
-            fan_gpio.set_value(1);
-            is_fan_on = true;
-        } else if (temp < TEMP_OFF && is_fan_on) {
-            std::cout << "Температура: " << temp << "°C. Выключаем вентилятор." << std::endl;
-            fan_gpio.set_value(0);
-            is_fan_on = false;
+    ThermalEvents thermal;
+    bool event_driven = thermal.open_socket();
+    if (event_driven) std::cout << "События термозон получены от ядра, пересечение точки срабатывания будит демон сразу." << std::endl;
+    else std::cout << "Ядро не рассылает события термозон." << std::endl;
+    std::cout << "В простое опрос каждые " << FALLBACK_POLL_MS / 1000 << " с." << std::endl;
+
+    int fd_control = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd_control < 0) {
+        std::cerr << "Критическая ошибка: Не удалось создать таймер регулятора." << std::endl;
+        return 1;
+    }
+
+    signal(SIGUSR1, [](int) { g_print_summary = 1; });
+    signal(SIGINT, [](int) { g_stop = 1; });
+    signal(SIGTERM, [](int) { g_stop = 1; });
+
+    std::cout << "Демон запущен. " << (bang_bang ? "Релейное управление" : "ПИД-регулятор, цель " + std::to_string((int)TARGET_TEMP) + "°C")
+              << ", GPIO " << FAN_GPIO_PIN << "." << std::endl;
+
+    FanController controller;
+    bool controlling = false; // Идёт ли шаг регулятора по таймеру, или демон в простое опрашивает редко
+    bool is_fan_on = false;   // Для релейного режима
+    struct timespec start_ts;
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+    struct pollfd pfds[3] = {
+        { thermal.fd_events(), POLLIN, 0 },
+        { fd_control, POLLIN, 0 },
+        { fan.fd_soft_pwm(), POLLIN, 0 } // Отрицательный fd (аппаратный ШИМ) poll() пропускает
+    };
+    bool step_due = true;
+    float sampled_load = -1; // Загрузка, замеренная в простое для шага, который она вызвала
+    struct timespec last_step_ts = start_ts;
+
+    while (!g_stop) {
+        if (step_due) {
+            step_due = false;
+            float temp = sensor.read_celsius();
+            float load = sampled_load >= 0 ? sampled_load : cpu_load.read_fraction();
+            sampled_load = -1;
+            float duty;
+            if (bang_bang) {
+                if (temp >= TEMP_ON && !is_fan_on) is_fan_on = true;
+                else if (temp < TEMP_OFF && is_fan_on) is_fan_on = false;
+                duty = is_fan_on ? 1 : 0;
+            } else {
+                duty = controller.step(temp, load, CONTROL_PERIOD_MS / 1000.0f);
+            }
+            if ((duty > 0) != (fan.get_duty() > 0))
+                std::cout << "Температура: " << temp << "°C. " << (duty > 0 ? "Включаем вентилятор." : "Выключаем вентилятор.") << std::endl;
+            fan.set_duty(duty);
+
+            long khz = cpu_freq.read_value(), max_khz = cpu_max_freq.read_value();
+            bool throttled = khz && max_khz && khz < max_khz && load >= THROTTLE_MIN_LOAD;
+            if (controlling) {
+                float dt = CONTROL_PERIOD_MS / 1000.0f; // Шаги по таймеру равномерны, в простое время не учитывается
+                g_run.seconds += dt;
+                g_run.duty_seconds += duty * dt;
+                if (throttled) g_run.throttled_seconds += dt;
+                if (temp > TARGET_TEMP) g_run.over_target_seconds += dt;
+            }
+            g_run.max_temp = std::max(g_run.max_temp, temp);
+            if (log_file.is_open()) {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                log_file << (ts.tv_sec - start_ts.tv_sec) + (ts.tv_nsec - start_ts.tv_nsec) / 1e9 << " " << temp << " " << load << " " << duty << " "
+                         << controller.p << " " << controller.i << " " << controller.d << " " << controller.ff << " " << khz << " " << throttled << std::endl;
+            }
+
+            bool idle = is_idle(duty, temp, load);
+            if (idle == controlling) {
+                controlling = !idle;
+                if (idle) controller.reset();
+                arm_control_timer(fd_control, controlling);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &last_step_ts);
         }
 
-        std::this_thread::sleep_for(std::chrono::seconds(5));
+        // Точки срабатывания выше порогов регулятора, так что и с событиями термозон простой не может длиться без опроса.
+        // Загрузка в простое замеряется чаще температуры: упреждение должно срабатывать до нагрева.
+        int timeout_ms = controlling ? -1 : IDLE_LOAD_SAMPLE_MS;
+        int ready = poll(pfds, 3, timeout_ms);
+        if (g_print_summary) {
+            g_print_summary = 0;
+            print_summary();
+        }
+        if (ready == 0) { // Таймаут опроса в простое
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long since_step_ms = (now.tv_sec - last_step_ts.tv_sec) * 1000 + (now.tv_nsec - last_step_ts.tv_nsec) / 1000000;
+            sampled_load = cpu_load.read_fraction();
+            step_due = sampled_load >= IDLE_MAX_LOAD || since_step_ms >= FALLBACK_POLL_MS;
+            if (!step_due) sampled_load = -1; // Следующий шаг возьмёт загрузку за всё время с этого замера
+        }
+        if (ready <= 0) continue;
+        if (pfds[2].revents & POLLIN) fan.on_soft_pwm_timer();
+        if (pfds[0].revents & (POLLIN | POLLERR)) {
+            if (!thermal.drain()) {
+                event_driven = thermal.open_socket();
+                pfds[0].fd = thermal.fd_events();
+                if (!event_driven) std::cerr << "Предупреждение: сокет событий термозон потерян, остаётся опрос." << std::endl;
+            }
+            if (!controlling) step_due = true; // Пока идут шаги по таймеру, события только будят
+        }
+        if (pfds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(fd_control, &expirations, sizeof(expirations)) > 0) step_due = true;
+        }
     }
 
+    print_summary();
+    // Без демона вентилятору безопаснее работать. Канал sysfs pwm сохраняет скважность и после выхода, а линию GPIO ядро
+    // при выходе освобождает, и её уровень дальше зависит от драйвера и платы - там полные обороты без демона нужно
+    // обеспечить схемой (подтяжка затвора ключа к питанию) или настройкой вывода по умолчанию в device tree.
+    fan.set_duty(1);
+    if (!fan.is_hardware()) std::cerr << "Предупреждение: линия GPIO " << FAN_GPIO_PIN << " освобождена, уровень после выхода не гарантирован." << std::endl;
+    close(fd_control);
     return 0;
-}
\ No newline at end of file
+}